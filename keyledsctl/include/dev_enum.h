@@ -27,8 +27,18 @@ struct dev_enum_item {
     char *      description;
 };
 
-Keyleds * auto_select_device(const char * dev_path);
+struct dev_enum_probe {
+    const char *    path;
+    bool            usable;     /* set by enum_probe_devices */
+};
+
+extern bool g_device_stats;     /* record request statistics on selected devices */
+
+Keyleds * auto_select_device(const char * dev_path, /*@out@*/ uint8_t * target);
+void release_device(/*@only@*/ Keyleds * device);   /* prints statistics if recorded */
 
+void enum_probe_devices(struct dev_enum_probe * probes,       /* concurrently, results cached */
+                        unsigned probes_nb);
 bool enum_find_by_serial(const char * serial, /*@out@*/ struct dev_enum_item ** out);
 bool enum_list_devices(/*@out@*/ struct dev_enum_item ** out, /*@out@*/ unsigned * out_nb);
 
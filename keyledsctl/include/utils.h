@@ -18,6 +18,7 @@
 #define UTILS_H
 
 #include <stdbool.h>
+#include <stdio.h>
 
 struct color {
     uint8_t red;
@@ -28,4 +29,6 @@ struct color {
 bool parse_keycode(const char * str, keyleds_block_id_t block_id, unsigned *);
 bool parse_color(const char * str, struct color *);
 
+void print_stats(FILE * stream, const struct keyleds_stats * stats);
+
 #endif
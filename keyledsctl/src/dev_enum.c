@@ -14,14 +14,23 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <sys/types.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "config.h"
 #include "dev_enum.h"
 #include "keyleds.h"
 #include "logging.h"
+#include "utils.h"
 
-Keyleds * auto_select_device(const char * dev_path)
+bool g_device_stats = false;
+
+static Keyleds * open_device(const char * dev_path)
 {
     Keyleds * device = NULL;
     struct dev_enum_item * items;
@@ -70,6 +79,211 @@ Keyleds * auto_select_device(const char * dev_path)
     return device;
 }
 
+/****************************************************************************/
+/* Device probing
+ *
+ * Candidates all get a single handshake at once, bounded by the call timeout,
+ * so a scan takes one round trip rather than one per node. Definitive results
+ * are cached per device node: they hold until the node is re-created, as
+ * happens when the device is plugged again. Timeouts and system errors might
+ * not last, nor does the set of devices paired to a receiver: those nodes are
+ * probed every time.
+ */
+
+struct probe_cache_entry {
+    char *          path;
+    dev_t           rdev;
+    ino_t           ino;
+    time_t          ctime;
+    bool            usable;
+};
+
+struct probe_task {
+    struct dev_enum_probe * probe;
+    struct stat     node;           /* device node identity, if known */
+    bool            has_node;
+    bool            cached;         /* result came from cache */
+    bool            cacheable;      /* result is definitive */
+    bool            started;
+    pthread_t       thread;
+};
+
+static bool probe_cache_path(char * path, size_t size, bool create)
+{
+    const char * base = getenv("XDG_CACHE_HOME"), * suffix = "/keyleds";
+    int written;
+
+    if (base == NULL || base[0] == '\0') {
+        base = getenv("HOME");
+        suffix = "/.cache/keyleds";
+    }
+    if (base == NULL) { return false; }
+
+    written = snprintf(path, size, "%s%s", base, suffix);
+    if (written < 0 || (size_t)written >= size) { return false; }
+    if (create && !keyleds_cache_mkdir(path)) { return false; }
+
+    written = snprintf(path, size, "%s%s/probe", base, suffix);
+    return written >= 0 && (size_t)written < size;
+}
+
+static struct probe_cache_entry * probe_cache_load(unsigned * entries_nb)
+{
+    char path[PATH_MAX], line[PATH_MAX + 64];
+    struct probe_cache_entry * entries = NULL;
+    FILE * file;
+
+    *entries_nb = 0;
+    if (!probe_cache_path(path, sizeof(path), false)) { return NULL; }
+    if ((file = fopen(path, "r")) == NULL) { return NULL; }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long rdev, ino;
+        long long ctime;
+        int usable, offset = 0;
+        size_t length;
+
+        if (sscanf(line, "%d %lx %lu %lld %n", &usable, &rdev, &ino, &ctime, &offset) < 4 ||
+            offset == 0) {
+            continue;
+        }
+        length = strcspn(line + offset, "\n");
+
+        entries = realloc(entries, (*entries_nb + 1) * sizeof(entries[0]));
+        entries[*entries_nb].path = malloc(length + 1);
+        memcpy(entries[*entries_nb].path, line + offset, length);
+        entries[*entries_nb].path[length] = '\0';
+        entries[*entries_nb].rdev = (dev_t)rdev;
+        entries[*entries_nb].ino = (ino_t)ino;
+        entries[*entries_nb].ctime = (time_t)ctime;
+        entries[*entries_nb].usable = usable != 0;
+        *entries_nb += 1;
+    }
+    (void)fclose(file);
+    return entries;
+}
+
+static bool probe_cache_match(const struct probe_cache_entry * entry,
+                              const char * path, const struct stat * node)
+{
+    return strcmp(entry->path, path) == 0 && entry->rdev == node->st_rdev &&
+           entry->ino == node->st_ino && entry->ctime == node->st_ctime;
+}
+
+/* Rewrites the cache with new results, keeping entries of other nodes that still exist */
+static void probe_cache_save(const struct probe_cache_entry * entries, unsigned entries_nb,
+                             const struct probe_task * tasks, unsigned tasks_nb)
+{
+    char path[PATH_MAX], tmp_path[PATH_MAX + 4];
+    unsigned idx, task;
+    FILE * file;
+
+    if (!probe_cache_path(path, sizeof(path), true)) { return; }
+    (void)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if ((file = fopen(tmp_path, "w")) == NULL) {
+        LOG(INFO, "Cannot write probe cache %s: %s", tmp_path, strerror(errno));
+        return;
+    }
+
+    for (idx = 0; idx < entries_nb; idx += 1) {
+        struct stat node;
+        for (task = 0; task < tasks_nb; task += 1) {
+            if (strcmp(tasks[task].probe->path, entries[idx].path) == 0) { break; }
+        }
+        if (task < tasks_nb) { continue; }
+        if (stat(entries[idx].path, &node) < 0 ||
+            !probe_cache_match(&entries[idx], entries[idx].path, &node)) {
+            continue;
+        }
+        (void)fprintf(file, "%d %lx %lu %lld %s\n", entries[idx].usable,
+                      (unsigned long)entries[idx].rdev, (unsigned long)entries[idx].ino,
+                      (long long)entries[idx].ctime, entries[idx].path);
+    }
+    for (task = 0; task < tasks_nb; task += 1) {
+        if (!tasks[task].has_node || !tasks[task].cacheable) { continue; }
+        (void)fprintf(file, "%d %lx %lu %lld %s\n", tasks[task].probe->usable,
+                      (unsigned long)tasks[task].node.st_rdev,
+                      (unsigned long)tasks[task].node.st_ino,
+                      (long long)tasks[task].node.st_ctime, tasks[task].probe->path);
+    }
+
+    if (fclose(file) != 0 || rename(tmp_path, path) < 0) {
+        LOG(INFO, "Cannot write probe cache %s: %s", path, strerror(errno));
+        (void)remove(tmp_path);
+    }
+}
+
+static void * probe_thread(void * arg)
+{
+    struct probe_task * task = arg;
+    keyleds_error_t error;
+    unsigned version;
+
+    task->probe->usable = keyleds_probe(task->probe->path, KEYLEDSCTL_APP_ID,
+                                        KEYLEDSCTL_PROBE_TIMEOUT_US, &version);
+    error = keyleds_get_errno();
+    if (version == 1) {
+        /* Receiver: devices get paired and unpaired while its node stays */
+        task->cacheable = false;
+    } else {
+        task->cacheable = task->probe->usable ||
+                          error == KEYLEDS_ERROR_HIDREPORT || error == KEYLEDS_ERROR_HIDNOPP ||
+                          error == KEYLEDS_ERROR_HIDVERSION || error == KEYLEDS_ERROR_DEVICE;
+    }
+    if (!task->probe->usable) {
+        LOG(DEBUG, "Probing %s failed: %s", task->probe->path, keyleds_get_error_str());
+    }
+    return NULL;
+}
+
+void enum_probe_devices(struct dev_enum_probe * probes, unsigned probes_nb)
+{
+    struct probe_cache_entry * entries;
+    unsigned entries_nb, idx, entry;
+    bool dirty = false;
+
+    if (probes_nb == 0) { return; }
+    {
+    struct probe_task tasks[probes_nb];
+
+    entries = probe_cache_load(&entries_nb);
+    for (idx = 0; idx < probes_nb; idx += 1) {
+        struct probe_task * task = &tasks[idx];
+        task->probe = &probes[idx];
+        task->has_node = stat(probes[idx].path, &task->node) == 0;
+        task->cached = false;
+        task->cacheable = false;
+        task->started = false;
+
+        for (entry = 0; task->has_node && entry < entries_nb; entry += 1) {
+            if (probe_cache_match(&entries[entry], probes[idx].path, &task->node)) {
+                probes[idx].usable = entries[entry].usable;
+                task->cached = task->cacheable = true;
+                break;
+            }
+        }
+        if (task->cached) {
+            LOG(DEBUG, "Probe of %s cached", probes[idx].path);
+            continue;
+        }
+        task->started = pthread_create(&task->thread, NULL, probe_thread, task) == 0;
+        if (!task->started) { (void)probe_thread(task); }
+        dirty = dirty || task->has_node;
+    }
+
+    for (idx = 0; idx < probes_nb; idx += 1) {
+        if (tasks[idx].started) { (void)pthread_join(tasks[idx].thread, NULL); }
+    }
+
+    if (dirty) { probe_cache_save(entries, entries_nb, tasks, probes_nb); }
+    }
+
+    for (idx = 0; idx < entries_nb; idx += 1) { free(entries[idx].path); }
+    free(entries);
+}
+
+/****************************************************************************/
+
 void enum_free_item(struct dev_enum_item * item)
 {
     free(item->path);
@@ -87,3 +301,37 @@ void enum_free_list(struct dev_enum_item * list)
     }
     free(list);
 }
+
+Keyleds * auto_select_device(const char * dev_path, uint8_t * target)
+{
+    Keyleds * device = open_device(dev_path);
+    unsigned targets_nb;
+
+    if (device == NULL) { return NULL; }
+
+    /* Receivers may have several devices paired, pick the first one */
+    targets_nb = keyleds_get_targets(device, target, 1);
+    if (targets_nb == 0) {
+        (void)fprintf(stderr, "No usable device found: %s\n", keyleds_get_error_str());
+        keyleds_close(device);
+        return NULL;
+    }
+    if (targets_nb > 1) {
+        LOG(INFO, "Selecting first of %u paired devices, target %02x", targets_nb, *target);
+    }
+    if (g_device_stats && !keyleds_stats_enable(device, true)) {
+        (void)fprintf(stderr, "Cannot record statistics: %s\n", keyleds_get_error_str());
+    }
+    return device;
+}
+
+void release_device(Keyleds * device)
+{
+    struct keyleds_stats * stats;
+
+    if (g_device_stats && (stats = malloc(sizeof(*stats))) != NULL) {
+        if (keyleds_get_stats(device, stats)) { print_stats(stderr, stats); }
+        free(stats);
+    }
+    keyleds_close(device);
+}
@@ -16,10 +16,12 @@
  */
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <linux/hidraw.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "dev_enum.h"
@@ -40,42 +42,54 @@ bool enum_list_devices(struct dev_enum_item ** out, unsigned * out_nb)
 {
     struct dev_enum_item * items = NULL;
     unsigned items_nb = 0;
+    struct dev_enum_probe * probes = NULL;
+    unsigned probes_nb = 0, idx;
 
     DIR * dir;
     struct dirent * entry;
-    char path[sizeof(dev_root) + 1 + sizeof(entry->d_name) + 1];
-
-    strcpy(path, dev_root);
-    strcat(path, "/");
 
     if ((dir = opendir(dev_root)) == NULL) { return false; }
 
     while ((entry = readdir(dir)) != NULL) {
-        Keyleds * device;
-        struct hidraw_devinfo devinfo;
-
+        char * path;
         if (strncmp(entry->d_name, "hidraw", 6) != 0) { continue; }
 
-        strcpy(path + sizeof(dev_root) + 1 - 1, entry->d_name);
+        path = malloc(sizeof(dev_root) + 1 + strlen(entry->d_name));
+        strcpy(path, dev_root);
+        strcat(path, "/");
+        strcat(path, entry->d_name);
+
+        probes = realloc(probes, (probes_nb + 1) * sizeof(probes[0]));
+        probes[probes_nb].path = path;
+        probes_nb += 1;
+    }
+    closedir(dir);
+
+    enum_probe_devices(probes, probes_nb);
 
-        if ((device = keyleds_open(path, KEYLEDSCTL_APP_ID)) == NULL) { continue; }
+    for (idx = 0; idx < probes_nb; idx += 1) {
+        struct hidraw_devinfo devinfo;
+        int fd;
 
-        if (ioctl(keyleds_device_fd(device), HIDIOCGRAWINFO, &devinfo) >= 0) {
-            items = realloc(items, (items_nb + 1) * sizeof(struct dev_enum_item));
-            items[items_nb].path = malloc(strlen(path) + 1);
-            strcpy(items[items_nb].path, path);
-            items[items_nb].vendor_id = devinfo.vendor;
-            items[items_nb].product_id = devinfo.product;
-            items[items_nb].serial = NULL;
-            items[items_nb].description = NULL; /*FIXME*/
-            items_nb += 1;
+        if (probes[idx].usable && (fd = open(probes[idx].path, O_RDONLY)) >= 0) {
+            if (ioctl(fd, HIDIOCGRAWINFO, &devinfo) >= 0) {
+                items = realloc(items, (items_nb + 1) * sizeof(struct dev_enum_item));
+                items[items_nb].path = (char *)probes[idx].path;
+                items[items_nb].vendor_id = devinfo.vendor;
+                items[items_nb].product_id = devinfo.product;
+                items[items_nb].serial = NULL;
+                items[items_nb].description = NULL; /*FIXME*/
+                items_nb += 1;
+                probes[idx].path = NULL;
+            }
+            close(fd);
         }
-
-        keyleds_close(device);
+        free((char *)probes[idx].path);
     }
-    closedir(dir);
+    free(probes);
 
-    *out = items;
+    *out = realloc(items, (items_nb + 1) * sizeof(items[0]));
+    (*out)[items_nb].path = NULL;
     *out_nb = items_nb;
     return true;
 }
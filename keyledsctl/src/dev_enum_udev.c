@@ -67,6 +67,9 @@ bool enum_find_by_serial(const char * serial, struct dev_enum_item ** out)
     struct udev_list_entry * dev_first, * dev_current;
     const char * syspath;
     struct udev_device * usbdev = NULL, * hiddev = NULL;
+    struct udev_device ** hiddevs = NULL;
+    struct dev_enum_probe * probes = NULL;
+    unsigned probes_nb = 0, idx;
     bool result = false;
 
     assert(serial != NULL);
@@ -107,29 +110,35 @@ bool enum_find_by_serial(const char * serial, struct dev_enum_item ** out)
         goto err_find_free_enumerator;
     }
 
+    /* Probe all interfaces at once, then pick the first usable one */
     udev_list_entry_foreach(dev_current, dev_first) {
-        Keyleds * device;
         const char * devnode;
 
         syspath = udev_list_entry_get_name(dev_current);
-        if ((hiddev = udev_device_new_from_syspath(context, syspath)) == NULL) {
-            goto err_find_free_enumerator;
-        }
+        if ((hiddev = udev_device_new_from_syspath(context, syspath)) == NULL) { continue; }
         if ((devnode = udev_device_get_devnode(hiddev)) == NULL) {
             udev_device_unref(hiddev);
             continue;
         }
-        if ((device = keyleds_open(devnode, KEYLEDSCTL_APP_ID)) == NULL) {
-            udev_device_unref(hiddev);
-            continue;
+        hiddevs = realloc(hiddevs, (probes_nb + 1) * sizeof(hiddevs[0]));
+        probes = realloc(probes, (probes_nb + 1) * sizeof(probes[0]));
+        hiddevs[probes_nb] = hiddev;
+        probes[probes_nb].path = devnode;
+        probes_nb += 1;
+    }
+
+    enum_probe_devices(probes, probes_nb);
+
+    for (idx = 0; idx < probes_nb; idx += 1) {
+        if (!result && probes[idx].usable) {
+            *out = malloc(sizeof(**out));
+            result = fill_info_structure(usbdev, hiddevs[idx], *out);
+            if (!result) { free(*out); }
         }
-        keyleds_close(device);
-        *out = malloc(sizeof(**out));
-        fill_info_structure(usbdev, hiddev, *out);
-        udev_device_unref(hiddev);
-        result = true;
-        break;
+        udev_device_unref(hiddevs[idx]);
     }
+    free(hiddevs);
+    free(probes);
 
 err_find_free_enumerator:
     udev_enumerate_unref(enumerator);
@@ -147,6 +156,9 @@ bool enum_list_devices(struct dev_enum_item ** out, unsigned * out_nb)
 
     struct dev_enum_item * items = NULL;
     unsigned items_nb = 0;
+    struct udev_device ** hiddevs = NULL;
+    struct dev_enum_probe * probes = NULL;
+    unsigned probes_nb = 0, idx;
 
     bool result = false;
 
@@ -168,7 +180,6 @@ bool enum_list_devices(struct dev_enum_item ** out, unsigned * out_nb)
 
     udev_list_entry_foreach(dev_current, dev_first) {
         struct udev_device * hiddev, * usbdev;
-        Keyleds * device;
         unsigned vendor_id;
         const char * syspath, * devnode, * str;
 
@@ -191,20 +202,32 @@ bool enum_list_devices(struct dev_enum_item ** out, unsigned * out_nb)
         /* Filter out unwanted devices */
         if (vendor_id != LOGITECH_VENDOR_ID) { goto err_enum_release_device; }
 
-        /* Attempt to open device */
-        device = keyleds_open(devnode, KEYLEDSCTL_APP_ID);
-        if (device == NULL) { goto err_enum_release_device; }
-        keyleds_close(device);
-
-        /* Fill info structure */
-        items = realloc(items, (items_nb + 1) * sizeof(items[0]));
-        fill_info_structure(usbdev, hiddev, &items[items_nb]);
-        items_nb += 1;
+        /* Keep it for probing */
+        hiddevs = realloc(hiddevs, (probes_nb + 1) * sizeof(hiddevs[0]));
+        probes = realloc(probes, (probes_nb + 1) * sizeof(probes[0]));
+        hiddevs[probes_nb] = hiddev;
+        probes[probes_nb].path = devnode;
+        probes_nb += 1;
+        continue;
 
 err_enum_release_device:
         udev_device_unref(hiddev);
     }
 
+    enum_probe_devices(probes, probes_nb);
+
+    for (idx = 0; idx < probes_nb; idx += 1) {
+        if (probes[idx].usable) {
+            struct udev_device * usbdev = udev_device_get_parent_with_subsystem_devtype(
+                hiddevs[idx], "usb", "usb_device");
+            items = realloc(items, (items_nb + 1) * sizeof(items[0]));
+            if (fill_info_structure(usbdev, hiddevs[idx], &items[items_nb])) { items_nb += 1; }
+        }
+        udev_device_unref(hiddevs[idx]);
+    }
+    free(hiddevs);
+    free(probes);
+
     *out = realloc(items, (items_nb + 1) * sizeof(items[0]));
     (*out)[items_nb].path = NULL;
     *out_nb = items_nb;
@@ -14,11 +14,14 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <errno.h>
 #include <getopt.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -40,21 +43,27 @@ int main_list(int argc, char * argv[]);
 int main_info(int argc, char * argv[]);
 int main_get_leds(int argc, char * argv[]);
 int main_set_leds(int argc, char * argv[]);
+int main_stream(int argc, char * argv[]);
+int main_bench(int argc, char * argv[]);
 int main_gamemode(int argc, char * argv[]);
 
 static const struct main_modes main_modes[] = {
     { "help", main_help,
       "Usage: %s %s [subcommand]\n" },
     { "list", main_list,
-      "Usage: %s [-dqv] %s\n" },
+      "Usage: %s [-dqsv] %s\n" },
     { "info", main_info,
-      "Usage: %s [-dqv] %s [-d device]\n" },
+      "Usage: %s [-dqsv] %s [-d device]\n" },
     { "get-leds", main_get_leds,
-      "Usage: %s [-dqv] %s [-d device] [key1 [key2 [...]]]\n" },
+      "Usage: %s [-dqsv] %s [-d device] [key1 [key2 [...]]]\n" },
     { "set-leds", main_set_leds,
-      "Usage: %s [-dqv] %s [-d device] [key1=color1 [key2=color2 [...]]]\n" },
+      "Usage: %s [-dqsv] %s [-d device] [key1=color1 [key2=color2 [...]]]\n" },
+    { "stream", main_stream,
+      "Usage: %s [-dqsv] %s [-d device]\n" },
+    { "bench", main_bench,
+      "Usage: %s [-dqsv] %s [-d device] [-j] [-n iterations] [-p depth]\n" },
     { "gamemode", main_gamemode,
-      "Usage: %s [-dqv] %s [-d device] [key1 [key2 [...]]]\n" },
+      "Usage: %s [-dqsv] %s [-d device] [key1 [key2 [...]]]\n" },
 };
 
 /****************************************************************************/
@@ -66,12 +75,13 @@ struct main_options {
     /*@observer@*/ const char * mode;
     int                         keyleds_verbosity;
     int                         verbosity;
+    bool                        stats;
 };
 
 void main_usage(FILE * stream, const char * name)
 {
     unsigned idx;
-    (void)fprintf(stream, "Usage: %s [-dqv] ", name);
+    (void)fprintf(stream, "Usage: %s [-dqsv] ", name);
     for (idx = 0; idx < sizeof(main_modes) / sizeof(main_modes[0]); idx += 1) {
         (void)fprintf(stream, idx == 0 ? "%s" : "|%s", main_modes[idx].name);
     }
@@ -84,14 +94,16 @@ bool parse_main_options(int argc, char * argv[], /*@out@*/ struct main_options *
     options->mode       = NULL;
     options->keyleds_verbosity = KEYLEDS_LOG_WARNING;
     options->verbosity  = LOG_WARNING;
+    options->stats      = false;
 
-    while ((opt = getopt(argc, argv, "+dqv")) != -1) {
+    while ((opt = getopt(argc, argv, "+dqsv")) != -1) {
         switch (opt) {
         case 'd': options->keyleds_verbosity += 1; break;
         case 'q':
             options->keyleds_verbosity = KEYLEDS_LOG_ERROR;
             options->verbosity = LOG_ERROR;
             break;
+        case 's': options->stats = true; break;
         case 'v': options->verbosity += 1; break;
         default:
             return false;
@@ -114,6 +126,7 @@ int main(int argc, char * argv[])
 
     g_debug_level = options.verbosity;
     g_keyleds_debug_level = options.keyleds_verbosity;
+    g_device_stats = options.stats;
 
     for (idx = 0; idx < sizeof(main_modes) / sizeof(main_modes[0]); idx += 1) {
         if (strcmp(main_modes[idx].name, options.mode) == 0) {
@@ -219,12 +232,14 @@ int main_info(int argc, char * argv[])
 {
     struct info_options options;
     Keyleds * device;
+    uint8_t target;
     unsigned idx;
     char * name;
     const char * str;
     keyleds_device_type_t type;
     struct keyleds_device_version * info;
     unsigned feature_count;
+    uint16_t feature_ids[255];
     const char ** feature_names;
     unsigned * report_rates;
     struct keyleds_keyblocks_info * led_info;
@@ -232,11 +247,11 @@ int main_info(int argc, char * argv[])
 
     if (!parse_info_options(argc, argv, &options)) { return 1; }
 
-    device = auto_select_device(options.device);
+    device = auto_select_device(options.device, &target);
     if (device == NULL) { return 2; }
 
     /* Device name */
-    if (!keyleds_get_device_name(device, KEYLEDS_TARGET_DEFAULT, &name)) {
+    if (!keyleds_get_device_name(device, target, &name)) {
         (void)fprintf(stderr, "Get device name failed: %s\n", keyleds_get_error_str());
         result = 3;
         goto err_main_info_close;
@@ -245,7 +260,7 @@ int main_info(int argc, char * argv[])
     keyleds_free_device_name(name);
 
     /* Device type */
-    if (!keyleds_get_device_type(device, KEYLEDS_TARGET_DEFAULT, &type)) {
+    if (!keyleds_get_device_type(device, target, &type)) {
         (void)fprintf(stderr, "Get device type failed: %s\n", keyleds_get_error_str());
         result = 3;
         goto err_main_info_close;
@@ -254,7 +269,7 @@ int main_info(int argc, char * argv[])
     (void)printf("Type:           %s\n", str != NULL ? str : "unknown");
 
     /* Device software version */
-    if (!keyleds_get_device_version(device, KEYLEDS_TARGET_DEFAULT, &info)) {
+    if (!keyleds_get_device_version(device, target, &info)) {
         (void)fprintf(stderr, "Get device version failed: %s\n", keyleds_get_error_str());
         result = 3;
         goto err_main_info_close;
@@ -281,11 +296,15 @@ int main_info(int argc, char * argv[])
     keyleds_free_device_version(info);
 
     /* Device feature support */
-    feature_count = keyleds_get_feature_count(device, KEYLEDS_TARGET_DEFAULT);
+    feature_count = keyleds_get_feature_ids(device, target, feature_ids,
+                                            sizeof(feature_ids) / sizeof(feature_ids[0]));
+    if (feature_count > sizeof(feature_ids) / sizeof(feature_ids[0])) {
+        feature_count = sizeof(feature_ids) / sizeof(feature_ids[0]);
+    }
     feature_names = malloc(feature_count * sizeof(feature_names[0]));
     (void)printf("Features:       [");
     for (idx = 1; idx <= feature_count; idx += 1) {
-        uint16_t fid = keyleds_get_feature_id(device, KEYLEDS_TARGET_DEFAULT, idx);
+        uint16_t fid = feature_ids[idx - 1];
         feature_names[idx - 1] = keyleds_lookup_string(keyleds_feature_names, fid);
         (void)printf(idx == 1 ? "%04x" : ", %04x", fid);
     }
@@ -297,9 +316,9 @@ int main_info(int argc, char * argv[])
     free(feature_names);
 
     /* Reportrate feature */
-    if (keyleds_get_reportrates(device, KEYLEDS_TARGET_DEFAULT, &report_rates)) {
+    if (keyleds_get_reportrates(device, target, &report_rates)) {
         unsigned current_rate = 0;
-        keyleds_get_reportrate(device, KEYLEDS_TARGET_DEFAULT, &current_rate);
+        keyleds_get_reportrate(device, target, &current_rate);
         (void)printf("Report rates:  ");
         for (idx = 0; report_rates[idx] > 0; idx += 1) {
             (void)printf(report_rates[idx] == current_rate ? " [%dms]" : " %dms",
@@ -310,7 +329,7 @@ int main_info(int argc, char * argv[])
     }
 
     /* Leds feature */
-    if (keyleds_get_block_info(device, KEYLEDS_TARGET_DEFAULT, &led_info)) {
+    if (keyleds_get_block_info(device, target, &led_info)) {
         for (idx = 0; idx < led_info->length; idx += 1) {
             (void)printf("LED block[%02x]:  %3d keys, max_rgb(%d, %d, %d)\n",
                          led_info->blocks[idx].block_id,
@@ -323,7 +342,7 @@ int main_info(int argc, char * argv[])
     }
 
 err_main_info_close:
-    keyleds_close(device);
+    release_device(device);
     return result;
 }
 
@@ -373,15 +392,16 @@ int main_get_leds(int argc, char * argv[])
 {
     struct get_leds_options options;
     Keyleds * device;
+    uint8_t target;
     struct keyleds_keyblocks_info * led_info;
     unsigned idx, nb_keys = 0;
 
     if (!parse_get_leds_options(argc, argv, &options)) { return 1; }
 
-    device = auto_select_device(options.device);
+    device = auto_select_device(options.device, &target);
     if (device == NULL) { return 2; }
 
-    if (!keyleds_get_block_info(device, KEYLEDS_TARGET_DEFAULT, &led_info)) {
+    if (!keyleds_get_block_info(device, target, &led_info)) {
         fprintf(stderr, "Fetching led info failed: %s\n", keyleds_get_error_str());
         return 3;
     }
@@ -399,7 +419,7 @@ int main_get_leds(int argc, char * argv[])
 
     {
     struct keyleds_key_color keys[nb_keys];
-    if (!keyleds_get_leds(device, KEYLEDS_TARGET_DEFAULT, options.block_id,
+    if (!keyleds_get_leds(device, target, options.block_id,
                           keys, 0, nb_keys)) {
         fprintf(stderr, "Failed to read led status: %s\n", keyleds_get_error_str());
         return 5;
@@ -423,7 +443,7 @@ int main_get_leds(int argc, char * argv[])
     }
 
     }
-    keyleds_close(device);
+    release_device(device);
     return EXIT_SUCCESS;
 }
 
@@ -435,6 +455,36 @@ struct set_leds_directive {
     struct color        color;
 };
 
+/* Returns NULL on success, or a description of the error */
+static const char * parse_directive(const char * str, keyleds_block_id_t block_id,
+                                    /*@out@*/ struct set_leds_directive * directive)
+{
+    const char * equal = strchr(str, '=');
+    unsigned code;
+
+    if (equal == NULL) { return "no '='"; }
+
+    if (strncasecmp("all=", str, 4) == 0) {
+        code = KEYLEDS_KEY_ID_INVALID;
+
+    } else {
+        char string[equal - str + 1];
+        memcpy(string, str, equal - str);
+        string[equal - str] = '\0';
+
+        if (!parse_keycode(string, block_id, &code)) { return "invalid key"; }
+        if (block_id == KEYLEDS_BLOCK_KEYS) {
+            code = keyleds_translate_keycode(code);
+            if (code == KEYLEDS_KEY_ID_INVALID) { return "invalid key"; }
+        }
+    }
+
+    if (!parse_color(equal + 1, &directive->color)) { return "invalid color"; }
+    directive->block_id = block_id;
+    directive->id = code;
+    return NULL;
+}
+
 struct set_leds_options {
     const char *                device;
     struct set_leds_directive * directives;
@@ -455,44 +505,18 @@ bool parse_set_leds_options(int argc, char * argv[],
     while ((opt = getopt(argc, argv, "-b:d:")) != -1) {
         switch (opt) {
         case 1: {/* non-option */
-            char * keyname = optarg;
-            char * equal = strchr(keyname, '=');
-            unsigned code;
-            struct color color;
-
-            if (equal == NULL) {
-                fprintf(stderr, "%s: no '=' in directive -- '%s'\n", argv[0], optarg);
-                goto err_free_options;
-            }
-
-            if (strncasecmp("all=", keyname, 4) == 0) {
-                code = KEYLEDS_KEY_ID_INVALID;
-
-            } else {
-                char string[equal - keyname + 1];
-                memcpy(string, keyname, equal - keyname);
-                string[equal - keyname] = '\0';
-
-                if (!parse_keycode(string, block_id, &code)) {
-                    fprintf(stderr, "%s: invalid key in directive -- '%s'\n", argv[0], optarg);
-                    goto err_free_options;
-                }
-                if (block_id == KEYLEDS_BLOCK_KEYS) {
-                    code = keyleds_translate_keycode(code);
-                }
-            }
+            struct set_leds_directive directive;
+            const char * error = parse_directive(optarg, block_id, &directive);
 
-            if (!parse_color(equal + 1, &color)) {
-                fprintf(stderr, "%s: invalid color in directive -- '%s'\n", argv[0], optarg);
+            if (error != NULL) {
+                fprintf(stderr, "%s: %s in directive -- '%s'\n", argv[0], error, optarg);
                 goto err_free_options;
             }
 
             options->directives = realloc(options->directives,
                                           (options->directives_nb + 1)
                                           * sizeof(options->directives[0]));
-            options->directives[options->directives_nb].block_id = block_id;
-            options->directives[options->directives_nb].id = code;
-            memcpy(&options->directives[options->directives_nb].color, &color, sizeof(color));
+            options->directives[options->directives_nb] = directive;
             options->directives_nb += 1;
             break;
         }
@@ -529,9 +553,10 @@ int main_set_leds(int argc, char * argv[])
 {
     struct set_leds_options options;
     Keyleds * device;
+    uint8_t target;
     if (!parse_set_leds_options(argc, argv, &options)) { return 1; }
 
-    device = auto_select_device(options.device);
+    device = auto_select_device(options.device, &target);
     if (device == NULL) { return 2; }
 
     {
@@ -550,7 +575,7 @@ int main_set_leds(int argc, char * argv[])
             continue;
         }
         if (keys_nb > 0) {
-            if (!keyleds_set_leds(device, KEYLEDS_TARGET_DEFAULT,
+            if (!keyleds_set_leds(device, target,
                                 block_id, keys, keys_nb)) {
                 fprintf(stderr, "%s: set leds -- %s\n", argv[0], keyleds_get_error_str());
             }
@@ -558,7 +583,7 @@ int main_set_leds(int argc, char * argv[])
         }
         if (options.directives[idx].id == KEYLEDS_KEY_ID_INVALID) {
             if (!keyleds_set_led_block(
-                device, KEYLEDS_TARGET_DEFAULT,
+                device, target,
                 options.directives[idx].block_id,
                 options.directives[idx].color.red,
                 options.directives[idx].color.green,
@@ -578,22 +603,678 @@ int main_set_leds(int argc, char * argv[])
     }
 
     if (keys_nb > 0) {
-        if (!keyleds_set_leds(device, KEYLEDS_TARGET_DEFAULT,
+        if (!keyleds_set_leds(device, target,
                               block_id, keys, keys_nb)) {
             fprintf(stderr, "%s: set leds -- %s\n", argv[0], keyleds_get_error_str());
         }
     }
 
     }
-    keyleds_commit_leds(device, KEYLEDS_TARGET_DEFAULT);
+    keyleds_commit_leds(device, target);
 
-    keyleds_close(device);
+    release_device(device);
     free(options.directives);
     return EXIT_SUCCESS;
 }
 
 /****************************************************************************/
 
+/* Frames are read from standard input, either as text lines using set-leds
+ * directive syntax, or in binary form: a zero byte, then any number of
+ * (block_id, keys_nb, keys_nb times {id, red, green, blue}) records, closed
+ * by a zero block_id. Keys not mentioned in a frame keep their color.
+ */
+
+#define STREAM_LINE_MAX     (8192)
+
+struct stream_block {
+    keyleds_block_id_t          block_id;
+    unsigned                    keys_nb;
+    struct keyleds_key_color *  sent;           /* colors as last sent to device */
+    struct keyleds_key_color *  frame;          /* colors requested by current frame */
+    uint16_t                    index[256];     /* key id => position in block + 1 */
+};
+
+struct stream_state {
+    struct stream_block *   blocks;
+    unsigned                blocks_nb;
+    unsigned long           frames;             /* frames read */
+    unsigned long           commits;            /* frames that changed something */
+    unsigned long           updates;            /* keys sent */
+};
+
+static volatile sig_atomic_t stream_interrupted = 0;
+static void stream_interrupt(int signum) { (void)signum; stream_interrupted = 1; }
+
+struct stream_options {
+    const char *        device;
+};
+
+bool parse_stream_options(int argc, char * argv[], /*@out@*/ struct stream_options * options)
+{
+    int opt;
+    options->device = NULL;
+
+    reset_getopt(argc, argv, "-d:");
+    while((opt = getopt(argc, argv, "-d:")) != -1) {
+        switch(opt) {
+        case 'd':
+            if (options->device != NULL) {
+                fprintf(stderr, "%s: -d option can only be used once.\n", argv[0]);
+                return false;
+            }
+            options->device = optarg;
+            break;
+        case 1:
+            fprintf(stderr, "%s: unexpected argument -- '%s'\n", argv[0], optarg);
+            /* fall through */
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Loads block layouts and current colors, so the first frame is diffed too */
+static bool stream_init(Keyleds * device, uint8_t target, /*@out@*/ struct stream_state * state)
+{
+    struct keyleds_keyblocks_info * led_info;
+    unsigned idx, key, valid_nb;
+
+    state->blocks = NULL;
+    state->blocks_nb = 0;
+    if (!keyleds_get_block_info(device, target, &led_info)) {
+        fprintf(stderr, "Fetching led info failed: %s\n", keyleds_get_error_str());
+        return false;
+    }
+    state->blocks = calloc(led_info->length, sizeof(state->blocks[0]));
+    state->blocks_nb = led_info->length;
+    state->frames = state->commits = state->updates = 0;
+
+    for (idx = 0; idx < led_info->length; idx += 1) {
+        struct stream_block * block = &state->blocks[idx];
+        block->block_id = led_info->blocks[idx].block_id;
+        block->keys_nb = led_info->blocks[idx].nb_keys;
+        block->sent = malloc(block->keys_nb * sizeof(block->sent[0]));
+        block->frame = malloc(block->keys_nb * sizeof(block->frame[0]));
+
+        if (!keyleds_get_leds(device, target, block->block_id, block->sent, 0, block->keys_nb)) {
+            fprintf(stderr, "Failed to read led status: %s\n", keyleds_get_error_str());
+            keyleds_free_block_info(led_info);
+            return false;
+        }
+
+        /* Only keep positions holding an actual key */
+        for (key = valid_nb = 0; key < block->keys_nb; key += 1) {
+            if (block->sent[key].id != KEYLEDS_KEY_ID_INVALID) {
+                block->sent[valid_nb] = block->sent[key];
+                block->index[block->sent[key].id] = valid_nb + 1;
+                valid_nb += 1;
+            }
+        }
+        block->keys_nb = valid_nb;
+        memcpy(block->frame, block->sent, block->keys_nb * sizeof(block->frame[0]));
+    }
+    keyleds_free_block_info(led_info);
+    return true;
+}
+
+static void stream_free(struct stream_state * state)
+{
+    unsigned idx;
+    for (idx = 0; idx < state->blocks_nb; idx += 1) {
+        free(state->blocks[idx].sent);
+        free(state->blocks[idx].frame);
+    }
+    free(state->blocks);
+}
+
+static struct stream_block * stream_find_block(struct stream_state * state,
+                                               keyleds_block_id_t block_id)
+{
+    unsigned idx;
+    for (idx = 0; idx < state->blocks_nb; idx += 1) {
+        if (state->blocks[idx].block_id == block_id) { return &state->blocks[idx]; }
+    }
+    return NULL;
+}
+
+static void stream_set_key(struct stream_block * block, uint8_t id,
+                           uint8_t red, uint8_t green, uint8_t blue)
+{
+    unsigned idx;
+    if (id == KEYLEDS_KEY_ID_INVALID) {
+        for (idx = 0; idx < block->keys_nb; idx += 1) {
+            block->frame[idx].red = red;
+            block->frame[idx].green = green;
+            block->frame[idx].blue = blue;
+        }
+    } else if (block->index[id] > 0) {
+        idx = block->index[id] - 1;
+        block->frame[idx].red = red;
+        block->frame[idx].green = green;
+        block->frame[idx].blue = blue;
+    } else {
+        LOG(INFO, "Ignoring unknown key %02x in block %02x", id, block->block_id);
+    }
+}
+
+/* Parses one text line, invalid directives are reported and skipped */
+static bool stream_read_text(struct stream_state * state, const char * name)
+{
+    char line[STREAM_LINE_MAX];
+    char * token, * saveptr;
+    keyleds_block_id_t block_id = KEYLEDS_BLOCK_KEYS;
+    bool expect_block = false;
+
+    if (fgets(line, sizeof(line), stdin) == NULL) { return false; }
+    if (strchr(line, '\n') == NULL && !feof(stdin)) {
+        fprintf(stderr, "%s: frame line longer than %d bytes\n", name, STREAM_LINE_MAX - 1);
+        return false;
+    }
+
+    for (token = strtok_r(line, " \t\r\n", &saveptr); token != NULL;
+         token = strtok_r(NULL, " \t\r\n", &saveptr)) {
+        struct set_leds_directive directive;
+        struct stream_block * block;
+        const char * error;
+
+        if (expect_block) {
+            block_id = keyleds_string_id(keyleds_block_id_names, token);
+            if (block_id == (keyleds_block_id_t)KEYLEDS_STRING_INVALID) {
+                fprintf(stderr, "%s: invalid key block name -- '%s'\n", name, token);
+            }
+            expect_block = false;
+            continue;
+        }
+        if (strcmp(token, "-b") == 0) { expect_block = true; continue; }
+
+        error = parse_directive(token, block_id, &directive);
+        if (error != NULL) {
+            fprintf(stderr, "%s: %s in directive -- '%s'\n", name, error, token);
+            continue;
+        }
+        block = stream_find_block(state, directive.block_id);
+        if (block == NULL) {
+            fprintf(stderr, "%s: led block %02x not found\n", name, directive.block_id);
+            continue;
+        }
+        stream_set_key(block, directive.id, directive.color.red,
+                       directive.color.green, directive.color.blue);
+    }
+    return true;
+}
+
+/* Parses one binary frame, after its leading zero byte */
+static bool stream_read_binary(struct stream_state * state, const char * name)
+{
+    uint8_t header[2];
+    struct keyleds_key_color keys[256];
+    unsigned idx;
+
+    for (;;) {
+        struct stream_block * block;
+
+        if (fread(header, 1, 1, stdin) != 1) { goto err_truncated; }
+        if (header[0] == 0) { return true; }
+        if (fread(header + 1, 1, 1, stdin) != 1 ||
+            fread(keys, sizeof(keys[0]), header[1], stdin) != header[1]) {
+            goto err_truncated;
+        }
+
+        block = stream_find_block(state, header[0]);
+        if (block == NULL) {
+            fprintf(stderr, "%s: led block %02x not found\n", name, header[0]);
+            continue;
+        }
+        for (idx = 0; idx < header[1]; idx += 1) {
+            if (keys[idx].id == KEYLEDS_KEY_ID_INVALID) { continue; }
+            stream_set_key(block, keys[idx].id, keys[idx].red, keys[idx].green, keys[idx].blue);
+        }
+    }
+
+err_truncated:
+    if (!stream_interrupted) { fprintf(stderr, "%s: truncated binary frame\n", name); }
+    return false;
+}
+
+/* Sends keys of block that differ from what the device has, returns how many */
+static int stream_send_block(Keyleds * device, uint8_t target, struct stream_block * block)
+{
+    struct keyleds_key_color changes[block->keys_nb];
+    unsigned key, changed_nb = 0;
+    bool uniform = true;
+
+    for (key = 0; key < block->keys_nb; key += 1) {
+        if (memcmp(&block->frame[key], &block->sent[key], sizeof(block->frame[0])) == 0) {
+            continue;
+        }
+        changes[changed_nb] = block->frame[key];
+        uniform = uniform && (changed_nb == 0 ||
+                              (changes[changed_nb].red == changes[0].red &&
+                               changes[changed_nb].green == changes[0].green &&
+                               changes[changed_nb].blue == changes[0].blue));
+        changed_nb += 1;
+    }
+    if (changed_nb == 0) { return 0; }
+
+    /* A whole block going to a single color fits in one report */
+    if (changed_nb == block->keys_nb && uniform && changed_nb > 1) {
+        if (!keyleds_set_led_block(device, target, block->block_id,
+                                   changes[0].red, changes[0].green, changes[0].blue)) {
+            return -1;
+        }
+    } else if (!keyleds_set_leds(device, target, block->block_id, changes, changed_nb)) {
+        return -1;
+    }
+    memcpy(block->sent, block->frame, block->keys_nb * sizeof(block->sent[0]));
+    return (int)changed_nb;
+}
+
+/* Sends changes to all blocks, committing once if any */
+static bool stream_send(Keyleds * device, uint8_t target, struct stream_state * state)
+{
+    unsigned idx;
+    bool changed = false;
+
+    for (idx = 0; idx < state->blocks_nb; idx += 1) {
+        int sent;
+        if (state->blocks[idx].keys_nb == 0) { continue; }
+        sent = stream_send_block(device, target, &state->blocks[idx]);
+        if (sent < 0) { return false; }
+        state->updates += (unsigned)sent;
+        changed = changed || sent > 0;
+    }
+
+    if (changed) {
+        if (!keyleds_commit_leds(device, target)) { return false; }
+        state->commits += 1;
+    }
+    return true;
+}
+
+static double stream_elapsed(const struct timespec * start)
+{
+    struct timespec now;
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)(now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main_stream(int argc, char * argv[])
+{
+    struct stream_options options;
+    struct stream_state state;
+    struct sigaction action;
+    struct timespec start;
+    Keyleds * device;
+    uint8_t target;
+    unsigned long last_frames = 0;
+    double elapsed, last_report = 0.0;
+    int result = EXIT_SUCCESS;
+
+    if (!parse_stream_options(argc, argv, &options)) { return 1; }
+
+    device = auto_select_device(options.device, &target);
+    if (device == NULL) { return 2; }
+
+    if (!stream_init(device, target, &state)) {
+        stream_free(&state);
+        release_device(device);
+        return 3;
+    }
+
+    /* No SA_RESTART: interrupts a blocked read so statistics get printed */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stream_interrupt;
+    (void)sigemptyset(&action.sa_mask);
+    (void)sigaction(SIGINT, &action, NULL);
+    (void)sigaction(SIGTERM, &action, NULL);
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!stream_interrupted) {
+        int first = getc(stdin);
+        if (first == EOF) { break; }
+        if (first == 0) {
+            if (!stream_read_binary(&state, argv[0])) {
+                if (!stream_interrupted) { result = 1; }
+                break;
+            }
+        } else {
+            (void)ungetc(first, stdin);
+            if (!stream_read_text(&state, argv[0])) {
+                if (!stream_interrupted) { result = 1; }
+                break;
+            }
+        }
+        state.frames += 1;
+
+        if (!stream_send(device, target, &state)) {
+            fprintf(stderr, "%s: sending frame failed -- %s\n", argv[0], keyleds_get_error_str());
+            result = 4;
+            break;
+        }
+
+        elapsed = stream_elapsed(&start);
+        if (elapsed - last_report >= 1.0) {
+            LOG(INFO, "%.1f fps", (state.frames - last_frames) / (elapsed - last_report));
+            last_frames = state.frames;
+            last_report = elapsed;
+        }
+    }
+    if (ferror(stdin) && !stream_interrupted) {
+        fprintf(stderr, "%s: reading frames failed -- %s\n", argv[0], strerror(errno));
+        result = 1;
+    }
+
+    elapsed = stream_elapsed(&start);
+    (void)printf("%lu frames, %lu committed, %lu key updates in %.2fs: %.1f fps\n",
+                 state.frames, state.commits, state.updates, elapsed,
+                 elapsed > 0.0 ? state.frames / elapsed : 0.0);
+
+    stream_free(&state);
+    release_device(device);
+    return result;
+}
+
+/****************************************************************************/
+
+/* Each test times its call repeatedly. Calls that write leds send the colors
+ * read at startup, and those are restored and committed when done, so the
+ * keyboard looks unchanged afterwards.
+ */
+
+enum bench_kind {
+    BENCH_PING,
+    BENCH_SET_LEDS,             /* a single report's worth of keys */
+    BENCH_FRAME,                /* all keys of a block */
+    BENCH_COMMIT,
+    BENCH_LED_BLOCK,
+};
+
+struct bench_block {
+    keyleds_block_id_t          block_id;
+    unsigned                    keys_nb;
+    struct keyleds_key_color *  keys;           /* colors at startup */
+};
+
+struct bench_test {
+    enum bench_kind     kind;
+    const char *        name;
+    const struct bench_block * block;           /* block to write, or NULL */
+    unsigned            keys_nb;                /* keys to write */
+    unsigned            reports;                /* reports sent per call */
+
+    double              mean;                   /* results, in microseconds */
+    unsigned long       min, p50, p90, p99, max;
+};
+
+struct bench_options {
+    const char *        device;
+    unsigned            iterations;
+    unsigned            pipeline_depth;
+    bool                json;
+};
+
+bool parse_bench_options(int argc, char * argv[], /*@out@*/ struct bench_options * options)
+{
+    int opt;
+    char * endptr;
+    options->device = NULL;
+    options->iterations = 100;
+    options->pipeline_depth = 1;
+    options->json = false;
+
+    reset_getopt(argc, argv, "-d:jn:p:");
+    while((opt = getopt(argc, argv, "-d:jn:p:")) != -1) {
+        switch(opt) {
+        case 'd':
+            if (options->device != NULL) {
+                fprintf(stderr, "%s: -d option can only be used once.\n", argv[0]);
+                return false;
+            }
+            options->device = optarg;
+            break;
+        case 'j':
+            options->json = true;
+            break;
+        case 'n':
+            options->iterations = strtoul(optarg, &endptr, 10);
+            if (*endptr != '\0' || options->iterations == 0) {
+                fprintf(stderr, "%s: invalid iteration count -- '%s'\n", argv[0], optarg);
+                return false;
+            }
+            break;
+        case 'p':
+            options->pipeline_depth = strtoul(optarg, &endptr, 10);
+            if (*endptr != '\0' || options->pipeline_depth == 0) {
+                fprintf(stderr, "%s: invalid pipeline depth -- '%s'\n", argv[0], optarg);
+                return false;
+            }
+            break;
+        case 1:
+            fprintf(stderr, "%s: unexpected argument -- '%s'\n", argv[0], optarg);
+            /* fall through */
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool bench_call(Keyleds * device, uint8_t target, const struct bench_test * test)
+{
+    switch (test->kind) {
+    case BENCH_PING:
+        return keyleds_ping(device, target);
+    case BENCH_SET_LEDS:
+    case BENCH_FRAME:
+        /* Pipelined reports may still be in flight, their time belongs here */
+        return keyleds_set_leds(device, target, test->block->block_id,
+                                test->block->keys, test->keys_nb) &&
+               keyleds_wait_requests(device, target);
+    case BENCH_COMMIT:
+        return keyleds_commit_leds(device, target);
+    case BENCH_LED_BLOCK:
+        return keyleds_set_led_block(device, target, test->block->block_id,
+                                     test->block->keys[0].red, test->block->keys[0].green,
+                                     test->block->keys[0].blue);
+    }
+    return false;
+}
+
+static int bench_compare(const void * a, const void * b)
+{
+    const unsigned long lhs = *(const unsigned long *)a, rhs = *(const unsigned long *)b;
+    return lhs < rhs ? -1 : lhs > rhs ? 1 : 0;
+}
+
+/* Nearest-rank percentile of sorted samples */
+static unsigned long bench_percentile(const unsigned long * samples, unsigned count,
+                                      unsigned percent)
+{
+    unsigned rank = (count * percent + 99) / 100;
+    return samples[rank > 0 ? rank - 1 : 0];
+}
+
+static bool bench_run(Keyleds * device, uint8_t target, unsigned iterations,
+                      struct bench_test * test)
+{
+    unsigned long * samples = malloc(iterations * sizeof(samples[0]));
+    unsigned long long total = 0;
+    struct timespec start, end;
+    unsigned idx;
+
+    for (idx = 0; idx < iterations; idx += 1) {
+        (void)clock_gettime(CLOCK_MONOTONIC, &start);
+        if (!bench_call(device, target, test)) {
+            fprintf(stderr, "Benchmark %s failed: %s\n", test->name, keyleds_get_error_str());
+            free(samples);
+            return false;
+        }
+        (void)clock_gettime(CLOCK_MONOTONIC, &end);
+        samples[idx] = (unsigned long)((end.tv_sec - start.tv_sec) * 1000000L
+                                       + (end.tv_nsec - start.tv_nsec) / 1000);
+        total += samples[idx];
+    }
+
+    qsort(samples, iterations, sizeof(samples[0]), bench_compare);
+    test->mean = (double)total / iterations;
+    test->min = samples[0];
+    test->p50 = bench_percentile(samples, iterations, 50);
+    test->p90 = bench_percentile(samples, iterations, 90);
+    test->p99 = bench_percentile(samples, iterations, 99);
+    test->max = samples[iterations - 1];
+    free(samples);
+    return true;
+}
+
+static const char * bench_block_name(const struct bench_test * test)
+{
+    return test->kind == BENCH_FRAME
+         ? keyleds_lookup_string(keyleds_block_id_names, test->block->block_id) : NULL;
+}
+
+static void bench_print(const struct bench_options * options, unsigned per_report,
+                        const struct bench_test * tests, unsigned tests_nb)
+{
+    unsigned idx;
+
+    if (options->json) {
+        (void)printf("{\"iterations\": %u, \"pipeline_depth\": %u, \"leds_per_report\": %u, "
+                     "\"tests\": [", options->iterations, options->pipeline_depth, per_report);
+        for (idx = 0; idx < tests_nb; idx += 1) {
+            const struct bench_test * result = &tests[idx];
+            const char * block = bench_block_name(result);
+            (void)printf("%s\n  {\"name\": \"%s\", ", idx == 0 ? "" : ",", result->name);
+            if (block != NULL) { (void)printf("\"block\": \"%s\", ", block); }
+            (void)printf("\"reports\": %u, \"mean_us\": %.1f, \"min_us\": %lu, "
+                         "\"p50_us\": %lu, \"p90_us\": %lu, \"p99_us\": %lu, \"max_us\": %lu, "
+                         "\"per_second\": %.1f, \"reports_per_second\": %.1f}",
+                         result->reports, result->mean, result->min, result->p50,
+                         result->p90, result->p99, result->max,
+                         1e6 / result->mean, result->reports * 1e6 / result->mean);
+        }
+        (void)printf("\n]}\n");
+        return;
+    }
+
+    (void)printf("%u iterations, pipeline depth %u, %u leds per report\n",
+                 options->iterations, options->pipeline_depth, per_report);
+    (void)printf("test             reports    mean     min     p50     p90     p99     max (us)"
+                 "   calls/s reports/s\n");
+    for (idx = 0; idx < tests_nb; idx += 1) {
+        const struct bench_test * result = &tests[idx];
+        const char * block = bench_block_name(result);
+        char label[32];
+        (void)snprintf(label, sizeof(label), "%s %s", result->name, block != NULL ? block : "");
+        (void)printf("%-16s %7u %7.0f %7lu %7lu %7lu %7lu %7lu      %9.1f %9.1f\n",
+                     label, result->reports, result->mean, result->min, result->p50,
+                     result->p90, result->p99, result->max,
+                     1e6 / result->mean, result->reports * 1e6 / result->mean);
+    }
+}
+
+int main_bench(int argc, char * argv[])
+{
+    struct bench_options options;
+    Keyleds * device;
+    uint8_t target;
+    struct keyleds_keyblocks_info * led_info;
+    struct bench_block * blocks;
+    struct bench_test * tests;
+    unsigned blocks_nb, tests_nb = 0, per_report, idx, key, keys_nb;
+    int result = EXIT_SUCCESS;
+
+    if (!parse_bench_options(argc, argv, &options)) { return 1; }
+
+    device = auto_select_device(options.device, &target);
+    if (device == NULL) { return 2; }
+    keyleds_set_pipeline_depth(device, options.pipeline_depth);
+    per_report = keyleds_leds_per_report(device);
+
+    if (!keyleds_get_block_info(device, target, &led_info)) {
+        fprintf(stderr, "Fetching led info failed: %s\n", keyleds_get_error_str());
+        release_device(device);
+        return 3;
+    }
+    blocks_nb = led_info->length;
+    blocks = calloc(blocks_nb, sizeof(blocks[0]));
+    for (idx = 0; idx < blocks_nb; idx += 1) {
+        blocks[idx].block_id = led_info->blocks[idx].block_id;
+        blocks[idx].keys_nb = led_info->blocks[idx].nb_keys;
+        blocks[idx].keys = malloc(blocks[idx].keys_nb * sizeof(blocks[idx].keys[0]));
+        if (!keyleds_get_leds(device, target, blocks[idx].block_id,
+                              blocks[idx].keys, 0, blocks[idx].keys_nb)) {
+            fprintf(stderr, "Failed to read led status: %s\n", keyleds_get_error_str());
+            blocks_nb = idx + 1;
+            result = 3;
+            goto err_bench_free;
+        }
+        /* Only keep positions holding an actual key */
+        for (key = keys_nb = 0; key < blocks[idx].keys_nb; key += 1) {
+            if (blocks[idx].keys[key].id != KEYLEDS_KEY_ID_INVALID) {
+                blocks[idx].keys[keys_nb++] = blocks[idx].keys[key];
+            }
+        }
+        blocks[idx].keys_nb = keys_nb;
+    }
+    keyleds_free_block_info(led_info);
+    led_info = NULL;
+
+    /* Tests, in order: ping, set_leds, frame of each block, commit, set_led_block */
+    tests = calloc(4 + blocks_nb, sizeof(tests[0]));
+    tests[tests_nb++] = (struct bench_test){ .kind = BENCH_PING, .name = "ping", .reports = 1 };
+    if (blocks_nb > 0 && blocks[0].keys_nb > 0) {
+        tests[tests_nb++] = (struct bench_test){
+            .kind = BENCH_SET_LEDS, .name = "set_leds", .block = &blocks[0],
+            .keys_nb = blocks[0].keys_nb < per_report ? blocks[0].keys_nb : per_report,
+            .reports = 1
+        };
+    }
+    for (idx = 0; idx < blocks_nb; idx += 1) {
+        if (blocks[idx].keys_nb == 0) { continue; }
+        tests[tests_nb++] = (struct bench_test){
+            .kind = BENCH_FRAME, .name = "frame", .block = &blocks[idx],
+            .keys_nb = blocks[idx].keys_nb,
+            .reports = (blocks[idx].keys_nb + per_report - 1) / per_report
+        };
+    }
+    tests[tests_nb++] = (struct bench_test){ .kind = BENCH_COMMIT, .name = "commit", .reports = 1 };
+    if (blocks_nb > 0 && blocks[0].keys_nb > 0) {
+        tests[tests_nb++] = (struct bench_test){
+            .kind = BENCH_LED_BLOCK, .name = "set_led_block", .block = &blocks[0], .reports = 1
+        };
+    }
+
+    for (idx = 0; idx < tests_nb; idx += 1) {
+        if (!bench_run(device, target, options.iterations, &tests[idx])) {
+            result = 4;
+            goto err_bench_restore;
+        }
+    }
+
+    bench_print(&options, per_report, tests, tests_nb);
+
+err_bench_restore:
+    for (idx = 0; idx < blocks_nb; idx += 1) {
+        if (blocks[idx].keys_nb > 0 &&
+            !keyleds_set_leds(device, target, blocks[idx].block_id,
+                              blocks[idx].keys, blocks[idx].keys_nb)) {
+            fprintf(stderr, "Restoring leds failed: %s\n", keyleds_get_error_str());
+        }
+    }
+    (void)keyleds_commit_leds(device, target);
+    free(tests);
+err_bench_free:
+    for (idx = 0; idx < blocks_nb; idx += 1) { free(blocks[idx].keys); }
+    free(blocks);
+    if (led_info != NULL) { keyleds_free_block_info(led_info); }
+    release_device(device);
+    return result;
+}
+
+/****************************************************************************/
+
 struct gamemode_options {
     const char *        device;
     uint8_t *           key_ids;
@@ -656,22 +1337,23 @@ int main_gamemode(int argc, char * argv[])
 {
     struct gamemode_options options;
     Keyleds * device;
+    uint8_t target;
     int result = EXIT_SUCCESS;
 
     if (!parse_gamemode_options(argc, argv, &options)) { return 1; }
 
-    device = auto_select_device(options.device);
+    device = auto_select_device(options.device, &target);
     if (device == NULL) { return 2; }
 
-    if (!keyleds_gamemode_reset(device, KEYLEDS_TARGET_DEFAULT) ||
+    if (!keyleds_gamemode_reset(device, target) ||
         (options.key_ids_nb > 0 &&
-         !keyleds_gamemode_set(device, KEYLEDS_TARGET_DEFAULT,
+         !keyleds_gamemode_set(device, target,
                                options.key_ids, options.key_ids_nb))) {
         fprintf(stderr, "Clear all gamemode keys failed: %s\n", keyleds_get_error_str());
         result = 2;
     }
 
-    keyleds_close(device);
+    release_device(device);
     free(options.key_ids);
     return result;
 }
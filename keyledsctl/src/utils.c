@@ -241,3 +241,48 @@ bool parse_color(const char * str, struct color * color)
 
     return false;
 }
+
+/****************************************************************************/
+
+/* Upper bound of latency for given fraction of responses */
+static unsigned long stats_percentile(const struct keyleds_stats_entry * entry, unsigned percent)
+{
+    unsigned long threshold = (entry->responses * percent + 99) / 100, count = 0;
+    unsigned idx;
+
+    for (idx = 0; idx < KEYLEDS_STATS_BUCKETS - 1; idx += 1) {
+        count += entry->latency[idx];
+        if (count >= threshold) {
+            unsigned long limit = keyleds_stats_bucket_limit(idx);
+            return limit < entry->latency_max ? limit : entry->latency_max;
+        }
+    }
+    return entry->latency_max;
+}
+
+void print_stats(FILE * stream, const struct keyleds_stats * stats)
+{
+    unsigned idx;
+
+    (void)fprintf(stream, "target feature              fn requests timeouts errors "
+                          "   sent    recv   mean    p50    p99    max (us)\n");
+    for (idx = 0; idx < stats->length; idx += 1) {
+        const struct keyleds_stats_entry * entry = &stats->entries[idx];
+        const char * name = keyleds_lookup_string(keyleds_feature_names, entry->feature_id);
+
+        (void)fprintf(stream, "%02x     %04x %-15s %2u %8lu %8lu %6lu %7lu %7lu",
+                      entry->target_id, entry->feature_id, name != NULL ? name : "",
+                      entry->function, entry->requests, entry->timeouts, entry->errors,
+                      entry->bytes_sent, entry->bytes_received);
+        if (entry->responses > 0) {
+            (void)fprintf(stream, " %6lu %6lu %6lu %6lu\n",
+                          entry->latency_total / entry->responses,
+                          stats_percentile(entry, 50), stats_percentile(entry, 99),
+                          entry->latency_max);
+        } else {
+            (void)fprintf(stream, "      -      -      -      -\n");
+        }
+    }
+    (void)fprintf(stream, "discarded reports: %lu, untracked requests: %lu\n",
+                  stats->discarded, stats->untracked);
+}
@@ -0,0 +1,362 @@
+/* Keyleds -- Gaming keyboard tool
+ * Copyright (C) 2017 Julien Hartmann, juli1.hartmann@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Microbenchmark of color kernels
+ *
+ * Runs every compiled variant of the kernels from tools/accelerated.h
+ * directly, bypassing the runtime resolver, checks each against its plain
+ * version and reports nanoseconds per pixel.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "config.h"
+
+#define ALIGN_BYTES         64      /* as RenderTarget */
+#define DEFAULT_ITERATIONS  10000
+#define ROUNDS              5       /* best round is reported */
+
+/* Shipped layouts have 95 to 140 keys, smaller sizes match mice and headsets,
+ * larger ones several keyboards rendered together. Odd sizes exercise the
+ * vector tails. */
+static const unsigned sizes[] = { 20, 64, 97, 129, 137, 140, 150, 274, 548 };
+#define MAX_SIZE    548
+
+/****************************************************************************/
+/* Kernel variants
+ *
+ * All variants are called through a common signature, wrappers adapt
+ * kernels that do not take a source, or take a factor or a mask.
+ */
+
+typedef void (*kernel_fn)(uint8_t * dst, const uint8_t * src, const uint8_t * mask, unsigned length);
+
+#define LERP_FACTOR     96
+#define ALPHA_FACTOR    160
+
+#define BINARY_KERNEL(name, isa) \
+    void name##_##isa(uint8_t * restrict, const uint8_t * restrict, unsigned); \
+    static void bench_##name##_##isa(uint8_t * dst, const uint8_t * src, \
+                                     const uint8_t * mask, unsigned length) \
+        { (void)mask; name##_##isa(dst, src, length); }
+
+/* Diff writes its bitmask over the start of dst, so the check covers it */
+#define DIFF_KERNEL(isa) \
+    unsigned diff_##isa(const uint8_t * restrict, const uint8_t * restrict, unsigned, \
+                        uint32_t * restrict); \
+    static void bench_diff_##isa(uint8_t * dst, const uint8_t * src, \
+                                 const uint8_t * mask, unsigned length) \
+    { \
+        uint32_t bits[MAX_SIZE / 32 + 1]; \
+        (void)mask; \
+        diff_##isa(dst, src, length, bits); \
+        memcpy(dst, bits, sizeof(bits[0]) * ((length + 31) / 32)); \
+    }
+
+#define COMPOSITING_KERNELS(isa) \
+    BINARY_KERNEL(fill, isa) \
+    BINARY_KERNEL(blend_add, isa) \
+    BINARY_KERNEL(blend_multiply, isa) \
+    BINARY_KERNEL(blend_screen, isa) \
+    BINARY_KERNEL(blend_lighten, isa) \
+    void fill_masked_##isa(uint8_t * restrict, const uint8_t * restrict, \
+                           const uint8_t * restrict, unsigned); \
+    static void bench_fill_masked_##isa(uint8_t * dst, const uint8_t * src, \
+                                        const uint8_t * mask, unsigned length) \
+        { fill_masked_##isa(dst, src, mask, length); } \
+    void modulate_alpha_##isa(uint8_t * restrict, uint8_t, unsigned); \
+    static void bench_modulate_alpha_##isa(uint8_t * dst, const uint8_t * src, \
+                                           const uint8_t * mask, unsigned length) \
+        { (void)src; (void)mask; modulate_alpha_##isa(dst, ALPHA_FACTOR, length); } \
+    void lerp_##isa(uint8_t * restrict, const uint8_t * restrict, uint8_t, unsigned); \
+    static void bench_lerp_##isa(uint8_t * dst, const uint8_t * src, \
+                                 const uint8_t * mask, unsigned length) \
+        { (void)mask; lerp_##isa(dst, src, LERP_FACTOR, length); } \
+    DIFF_KERNEL(isa)
+
+BINARY_KERNEL(blend, plain)
+COMPOSITING_KERNELS(plain)
+#ifdef KEYLEDSD_USE_MMX
+BINARY_KERNEL(blend, mmx)
+#endif
+#ifdef KEYLEDSD_USE_SSE2
+BINARY_KERNEL(blend, sse2)
+COMPOSITING_KERNELS(sse2)
+#endif
+#ifdef KEYLEDSD_USE_AVX2
+BINARY_KERNEL(blend, avx2)
+COMPOSITING_KERNELS(avx2)
+#endif
+#ifdef KEYLEDSD_USE_AVX512
+BINARY_KERNEL(blend, avx512)
+#endif
+
+struct kernel {
+    const char *    name;
+    const char *    isa;
+    unsigned        channels;       /* channels defined after the operation */
+    kernel_fn       fn;
+    kernel_fn       reference;
+};
+
+#define KERNEL(name, isa, channels) \
+    { #name, #isa, channels, bench_##name##_##isa, bench_##name##_plain }
+#define COMPOSITING_ENTRIES(isa) \
+    KERNEL(fill, isa, 4), \
+    KERNEL(fill_masked, isa, 4), \
+    KERNEL(modulate_alpha, isa, 4), \
+    KERNEL(blend_add, isa, 3), \
+    KERNEL(blend_multiply, isa, 3), \
+    KERNEL(blend_screen, isa, 3), \
+    KERNEL(blend_lighten, isa, 3), \
+    KERNEL(lerp, isa, 4), \
+    KERNEL(diff, isa, 4)
+
+static const struct kernel kernels[] = {
+    KERNEL(blend, plain, 3),
+    COMPOSITING_ENTRIES(plain),
+#ifdef KEYLEDSD_USE_MMX
+    KERNEL(blend, mmx, 3),
+#endif
+#ifdef KEYLEDSD_USE_SSE2
+    KERNEL(blend, sse2, 3),
+    COMPOSITING_ENTRIES(sse2),
+#endif
+#ifdef KEYLEDSD_USE_AVX2
+    KERNEL(blend, avx2, 3),
+    COMPOSITING_ENTRIES(avx2),
+#endif
+#ifdef KEYLEDSD_USE_AVX512
+    KERNEL(blend, avx512, 3),
+#endif
+};
+#define KERNELS_NB  (sizeof(kernels) / sizeof(kernels[0]))
+#define SIZES_NB    (sizeof(sizes) / sizeof(sizes[0]))
+
+static bool isa_supported(const char * isa)
+{
+    if (strcmp(isa, "plain") == 0) { return true; }
+#ifdef HAVE_BUILTIN_CPU_SUPPORTS
+#  if defined __GNUC__ && !defined __clang__
+    __builtin_cpu_init();
+#  endif
+    if (strcmp(isa, "mmx") == 0) { return __builtin_cpu_supports("mmx"); }
+    if (strcmp(isa, "sse2") == 0) { return __builtin_cpu_supports("sse2"); }
+    if (strcmp(isa, "avx2") == 0) { return __builtin_cpu_supports("avx2"); }
+    if (strcmp(isa, "avx512") == 0) { return __builtin_cpu_supports("avx512bw"); }
+#endif
+    return false;
+}
+
+/****************************************************************************/
+/* Measurement */
+
+struct buffers {
+    uint8_t *       dst;            /* initial destination contents */
+    uint8_t *       src;
+    uint8_t *       mask;
+    uint8_t *       expected;
+    uint8_t *       actual;
+};
+
+struct result {
+    const struct kernel * kernel;
+    unsigned        pixels;
+    double          ns_per_call;
+    bool            exact;
+};
+
+static void fill_random(struct buffers * buffers)
+{
+    unsigned idx;
+    srand(1);
+    for (idx = 0; idx < 4 * MAX_SIZE; idx += 1) {
+        buffers->dst[idx] = (uint8_t)rand();
+        buffers->src[idx] = (uint8_t)rand();
+    }
+    for (idx = 0; idx < MAX_SIZE; idx += 1) {
+        /* Make fully transparent and fully opaque sources common */
+        switch (rand() % 4) {
+        case 0: buffers->src[4 * idx + 3] = 0; break;
+        case 1: buffers->src[4 * idx + 3] = 255; break;
+        default: break;
+        }
+        buffers->mask[idx] = (uint8_t)(rand() % 2);
+    }
+}
+
+static bool check_exact(const struct kernel * kernel, unsigned pixels,
+                        const struct buffers * buffers)
+{
+    unsigned idx;
+
+    memcpy(buffers->expected, buffers->dst, 4 * MAX_SIZE);
+    memcpy(buffers->actual, buffers->dst, 4 * MAX_SIZE);
+    kernel->reference(buffers->expected, buffers->src, buffers->mask, pixels);
+    kernel->fn(buffers->actual, buffers->src, buffers->mask, pixels);
+
+    for (idx = 0; idx < MAX_SIZE; idx += 1) {
+        unsigned channels = idx < pixels ? kernel->channels : 4;
+        if (memcmp(&buffers->expected[4 * idx], &buffers->actual[4 * idx], channels) != 0) {
+            fprintf(stderr, "%s_%s: mismatch at pixel %u of %u\n",
+                    kernel->name, kernel->isa, idx, pixels);
+            return false;
+        }
+    }
+    return true;
+}
+
+static double elapsed_ns(const struct timespec * start, const struct timespec * end)
+{
+    return (double)(end->tv_sec - start->tv_sec) * 1e9 + (double)(end->tv_nsec - start->tv_nsec);
+}
+
+static double measure(const struct kernel * kernel, unsigned pixels, unsigned iterations,
+                      const struct buffers * buffers)
+{
+    struct timespec start, end;
+    double best = 0.0;
+    unsigned round, idx;
+
+    for (round = 0; round < ROUNDS; round += 1) {
+        double total;
+        memcpy(buffers->actual, buffers->dst, 4 * MAX_SIZE);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (idx = 0; idx < iterations; idx += 1) {
+            kernel->fn(buffers->actual, buffers->src, buffers->mask, pixels);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        total = elapsed_ns(&start, &end) / iterations;
+        if (round == 0 || total < best) { best = total; }
+    }
+    return best;
+}
+
+/****************************************************************************/
+/* Output */
+
+static void print_results(bool json, unsigned iterations,
+                          const struct result * results, unsigned results_nb)
+{
+    unsigned idx;
+
+    if (json) {
+        (void)printf("{\"iterations\": %u, \"rounds\": %u, \"results\": [",
+                     iterations, ROUNDS);
+        for (idx = 0; idx < results_nb; idx += 1) {
+            const struct result * result = &results[idx];
+            (void)printf("%s\n  {\"kernel\": \"%s\", \"isa\": \"%s\", \"pixels\": %u, "
+                         "\"ns_per_call\": %.2f, \"ns_per_pixel\": %.4f, \"exact\": %s}",
+                         idx == 0 ? "" : ",", result->kernel->name, result->kernel->isa,
+                         result->pixels, result->ns_per_call,
+                         result->ns_per_call / result->pixels,
+                         result->exact ? "true" : "false");
+        }
+        (void)printf("\n]}\n");
+        return;
+    }
+
+    (void)printf("%u iterations, best of %u rounds\n", iterations, ROUNDS);
+    (void)printf("kernel           isa     pixels  ns/call  ns/pixel exact\n");
+    for (idx = 0; idx < results_nb; idx += 1) {
+        const struct result * result = &results[idx];
+        (void)printf("%-16s %-7s %6u %8.1f %9.3f %s\n",
+                     result->kernel->name, result->kernel->isa, result->pixels,
+                     result->ns_per_call, result->ns_per_call / result->pixels,
+                     result->exact ? "yes" : "NO");
+    }
+}
+
+/****************************************************************************/
+
+static void usage(const char * name)
+{
+    fprintf(stderr, "Usage: %s [-j] [-n iterations]\n", name);
+}
+
+int main(int argc, char * argv[])
+{
+    struct buffers buffers;
+    struct result * results;
+    unsigned results_nb = 0, iterations = DEFAULT_ITERATIONS, kidx, sidx;
+    bool json = false, exact = true;
+    char * endptr;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "jn:")) != -1) {
+        switch (opt) {
+        case 'j':
+            json = true;
+            break;
+        case 'n':
+            iterations = strtoul(optarg, &endptr, 10);
+            if (*endptr != '\0' || iterations == 0) {
+                fprintf(stderr, "%s: invalid iteration count -- '%s'\n", argv[0], optarg);
+                return 1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (posix_memalign((void **)&buffers.dst, ALIGN_BYTES, 4 * MAX_SIZE) != 0 ||
+        posix_memalign((void **)&buffers.src, ALIGN_BYTES, 4 * MAX_SIZE) != 0 ||
+        posix_memalign((void **)&buffers.expected, ALIGN_BYTES, 4 * MAX_SIZE) != 0 ||
+        posix_memalign((void **)&buffers.actual, ALIGN_BYTES, 4 * MAX_SIZE) != 0 ||
+        (buffers.mask = malloc(MAX_SIZE)) == NULL ||
+        (results = malloc(KERNELS_NB * SIZES_NB * sizeof(*results))) == NULL) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+    fill_random(&buffers);
+
+    for (kidx = 0; kidx < KERNELS_NB; kidx += 1) {
+        const struct kernel * kernel = &kernels[kidx];
+        if (!isa_supported(kernel->isa)) {
+            fprintf(stderr, "%s_%s: skipped, not supported by this CPU\n",
+                    kernel->name, kernel->isa);
+            continue;
+        }
+        for (sidx = 0; sidx < SIZES_NB; sidx += 1) {
+            struct result * result = &results[results_nb++];
+            result->kernel = kernel;
+            result->pixels = sizes[sidx];
+            result->exact = check_exact(kernel, sizes[sidx], &buffers);
+            result->ns_per_call = measure(kernel, sizes[sidx], iterations, &buffers);
+            exact = exact && result->exact;
+        }
+    }
+
+    print_results(json, iterations, results, results_nb);
+
+    free(results);
+    free(buffers.mask);
+    free(buffers.actual);
+    free(buffers.expected);
+    free(buffers.src);
+    free(buffers.dst);
+    return exact ? EXIT_SUCCESS : 2;
+}
@@ -41,12 +41,21 @@ public:
     class KeyGroup;
     class Profile;
 
+    /// Bounds within which render loops adapt their frame rate, in fps.
+    /// A zero value means the bound is unset and inherited from defaults.
+    struct FrameRate final
+    {
+        unsigned            minimum;        ///< Lowest rate the loop backs off to
+        unsigned            maximum;        ///< Highest rate the loop ramps up to
+    };
+
     using string_list = std::vector<std::string>;
     using path_list = std::vector<std::string>;
     using device_map = std::vector<std::pair<std::string, std::string>>;
     using key_group_list = std::vector<KeyGroup>;
     using effect_group_list = std::vector<EffectGroup>;
     using profile_list = std::vector<Profile>;
+    using frame_rate_map = std::vector<std::pair<std::string, FrameRate>>;
 private:
                             Configuration(std::string path,
                                           string_list plugins,
@@ -54,7 +63,9 @@ private:
                                           device_map devices,
                                           key_group_list groups,
                                           effect_group_list effectGroups,
-                                          profile_list profiles);
+                                          profile_list profiles,
+                                          FrameRate frameRate,
+                                          frame_rate_map deviceFrameRates);
 public:
                             Configuration() = default;
                             ~Configuration();
@@ -66,6 +77,12 @@ public:
     const key_group_list &  keyGroups() const { return m_keyGroups; }
     const effect_group_list & effectGroups() const { return m_effectGroups; }
     const profile_list&     profiles() const { return m_profiles; }
+    const FrameRate &       frameRate() const { return m_frameRate; }
+    const frame_rate_map &  deviceFrameRates() const { return m_deviceFrameRates; }
+
+    /// Returns frame rate bounds for a device, looked up by name then serial
+    FrameRate               frameRateFor(const std::string & name,
+                                         const std::string & serial) const;
 
 public:
     static std::unique_ptr<Configuration>   loadFile(const std::string & path);
@@ -78,6 +95,8 @@ private:
     key_group_list          m_keyGroups;    ///< Map of key group names to lists of key names
     effect_group_list       m_effectGroups; ///< Map of effect group names to configurations
     profile_list            m_profiles;     ///< List of profile configurations
+    FrameRate               m_frameRate = {0, 0}; ///< Default frame rate bounds
+    frame_rate_map          m_deviceFrameRates; ///< Per-device overrides of m_frameRate
 };
 
 /****************************************************************************/
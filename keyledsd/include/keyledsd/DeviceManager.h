@@ -96,6 +96,7 @@ public:
     auto                    getRenderTarget() const { return RenderLoop::renderTargetFor(m_device); }
 
           bool              paused() const { return m_renderLoop.paused(); }
+          auto              frameStats() const { return m_renderLoop.frameStats(); }
 
 public:
     void                    setConfiguration(const Configuration *);
@@ -107,7 +108,7 @@ public:
 
 private:
     // Static loaders, invoked once at manager creation to set it up
-    static std::string      getSerial(const ::device::Description &);
+    static std::string      getSerial(const ::device::Description &, const Device &);
     static std::string      getName(const Configuration &, const std::string & serial);
     static dev_list         findEventDevices(const ::device::Description &);
 
@@ -21,6 +21,7 @@
 #include <QList>
 #include <QObject>
 #include <QString>
+#include <QVariantMap>
 
 namespace keyleds { class DeviceManager; }
 
@@ -60,6 +61,7 @@ class DeviceManagerAdaptor final : public QDBusAbstractAdaptor
     Q_PROPERTY(QString firmware READ firmware)
     Q_PROPERTY(DBusDeviceKeyInfoList keys READ keys)
     Q_PROPERTY(bool paused READ paused WRITE setPaused)
+    Q_PROPERTY(QVariantMap frameStats READ frameStats)
 public:
                 DeviceManagerAdaptor(DeviceManager *parent);
 
@@ -74,6 +76,7 @@ public:         // Simple pass-through methods accessing the DeviceManager
     DBusDeviceKeyInfoList keys() const;
     bool        paused() const;
     void        setPaused(bool val);
+    QVariantMap frameStats() const;
 
 private:
     DeviceManager * parent() const;    ///< instance this adapter is attached to
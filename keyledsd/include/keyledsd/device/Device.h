@@ -18,6 +18,7 @@
 #define KEYLEDSD_KEYBOARD_H_F57B19AC
 
 #include <QObject>
+#include <chrono>
 #include <cstdint>
 #include <memory>
 #include <stdexcept>
@@ -44,6 +45,9 @@ namespace keyleds { namespace device {
  * Handles communication with the underlying device. This class is built as a
  * wrapper around libkeyleds, with additional checks and caching. It also
  * converts library errors into exceptions.
+ *
+ * Devices paired to a same receiver share its link. Each gets its own
+ * instance, they can be used from different threads.
  */
 class Device final
 {
@@ -52,6 +56,7 @@ public:
     enum class Type { Keyboard, Remote, NumPad, Mouse, TouchPad, TrackBall, Presenter, Receiver };
     using ColorDirective = struct keyleds_key_color;
     using color_directive_list = std::vector<ColorDirective>;
+    using target_id_type = uint8_t;
 
     // Data
     class KeyBlock;
@@ -74,16 +79,22 @@ private:
     using key_id_type = uint8_t;
     using block_list = std::vector<KeyBlock>;
     using key_list = std::vector<key_id_type>;
+    struct Link;
+    class Access;
 
 public:
-                        Device(std::string path);
+                        Device(std::string path);   ///< Opens first device found at path
                         Device(const Device &) = delete;
                         Device(Device &&) = default;
                         ~Device();
     Device &            operator=(const Device &) = delete;
     Device &            operator=(Device &&) = default;
 
+    /// Opens all devices found at path, eg all devices paired to a receiver
+    static std::vector<Device> openAll(std::string path);
+
     const std::string & path() const noexcept { return m_path; }
+    target_id_type      target() const noexcept { return m_target; }
 
     // Query
     Type                type() const { return m_type; }
@@ -94,30 +105,39 @@ public:
           bool          hasLayout() const;
           int           layout() const { return m_layout; }
     const block_list &  blocks() const { return m_blocks; }
+          unsigned      keysPerReport() const;   ///< Number of keys setColors sends per report
 
     std::string         resolveKey(key_block_id_type, key_id_type) const;
     int                 decodeKeyId(key_block_id_type, key_id_type) const;
 
     // Manipulate
     void                setTimeout(unsigned us);
+    void                setDeadline(std::chrono::steady_clock::time_point);
+    void                clearDeadline();
     void                flush();
     bool                resync() noexcept;
     void                fillColor(const KeyBlock & block, const RGBColor);
     void                setColors(const KeyBlock & block, const color_directive_list &);
     void                setColors(const KeyBlock & block, const ColorDirective[], size_t size);
     color_directive_list getColors(const KeyBlock & block);
+    color_directive_list getColors();       ///< All blocks, in blocks() order
     void                commitColors();
 
 private:
-    static std::unique_ptr<struct keyleds_device> openDevice(const std::string &);
-    static Type         getType(struct keyleds_device *);
-    static std::string  getName(struct keyleds_device *);
-    static block_list   getBlocks(struct keyleds_device *);
+                        Device(std::string path, std::shared_ptr<Link>, target_id_type);
+    static std::shared_ptr<Link> openLink(const std::string &);
+    static std::vector<target_id_type> getTargets(struct keyleds_device *);
+    static Type         getType(struct keyleds_device *, target_id_type);
+    static std::string  getName(struct keyleds_device *, target_id_type);
+    static block_list   getBlocks(struct keyleds_device *, target_id_type);
     void                cacheVersion();
 
 private:
     const std::string   m_path;             ///< Device node path
-    std::unique_ptr<struct keyleds_device> m_device;    ///< Underlying libkeyleds opaque handle
+    std::shared_ptr<Link> m_link;           ///< Underlying libkeyleds handle, shared by targets
+    target_id_type      m_target;           ///< HID++ device index of this device on link
+    bool                m_hasDeadline;      ///< Whether calls have a deadline
+    std::chrono::steady_clock::time_point m_deadline;   ///< Call deadline, if m_hasDeadline
     Type                m_type;             ///< The kind of libkeyleds device
     std::string         m_name;             ///< User-friendly name of the device, eg "Logitech G410"
     std::string         m_model;            ///< Model identification string, eg "c3300000"
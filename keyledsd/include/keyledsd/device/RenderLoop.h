@@ -17,7 +17,9 @@
 #ifndef KEYLEDS_RENDER_LOOP_H_D7E4709F
 #define KEYLEDS_RENDER_LOOP_H_D7E4709F
 
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
 #include <mutex>
 #include <utility>
 #include <vector>
@@ -34,14 +36,19 @@ namespace keyleds { namespace device {
  *
  * Holds RGBA color entries for all keys of a device. All key blocks are in the
  * same memory area. Each block is contiguous, but padding keys may be inserted
- * in between blocks so blocks are SSE2-aligned. The buffers is addressed through
+ * in between blocks so blocks are aligned for AVX-512. The buffers is addressed through
  * a 2-tuple containing the block index and key index within block. No ordering
  * is enforce on blocks or keys, but the for_device static method uses the same
  * order that is detected on the device by the keyleds::Device object.
+ *
+ * The target also tracks a dirty range: keys whose color may have changed since
+ * it was last marked clean. Functions below that modify a target extend its
+ * range. Code writing colors directly must call markDirty itself, or belong to
+ * a Renderer that does not claim to track dirty keys.
  */
 class RenderTarget final
 {
-    static constexpr std::size_t   align_bytes = 32;
+    static constexpr std::size_t   align_bytes = 64;     ///< one AVX-512 vector
     static constexpr std::size_t   align_colors = align_bytes / sizeof(RGBAColor);
 public:
     using value_type = RGBAColor;
@@ -71,22 +78,54 @@ public:
     reference                   operator[](size_type idx) { return m_colors[idx]; }
     const_reference             operator[](size_type idx) const { return m_colors[idx]; }
 
+    /// Dirty range accessors. Range is [dirtyBegin, dirtyEnd), empty when clean.
+    bool                        isDirty() const noexcept { return m_dirtyBegin < m_dirtyEnd; }
+    size_type                   dirtyBegin() const noexcept { return m_dirtyBegin; }
+    size_type                   dirtyEnd() const noexcept { return m_dirtyEnd; }
+    /// Extends the dirty range to cover keys [first, last)
+    void                        markDirty(size_type first, size_type last) noexcept
+    {
+        if (first >= last) { return; }
+        if (isDirty()) {
+            first = first < m_dirtyBegin ? first : m_dirtyBegin;
+            last = last > m_dirtyEnd ? last : m_dirtyEnd;
+        }
+        m_dirtyBegin = first;
+        m_dirtyEnd = last;
+    }
+    void                        markDirty(size_type idx) noexcept { markDirty(idx, idx + 1); }
+    void                        markDirty() noexcept { markDirty(0, m_nbColors); }
+    void                        markClean() noexcept { m_dirtyBegin = m_dirtyEnd = 0; }
+
 private:
     RGBAColor *                 m_colors;       ///< Color buffer. RGBAColor is a POD type
     std::size_t                 m_nbColors;     ///< Number of items in m_colors
+    std::size_t                 m_dirtyBegin;   ///< First key of dirty range
+    std::size_t                 m_dirtyEnd;     ///< One past last key of dirty range
 
     friend void swap(RenderTarget &, RenderTarget &) noexcept;
 };
 
 KEYLEDSD_EXPORT void swap(RenderTarget &, RenderTarget &) noexcept;
 KEYLEDSD_EXPORT void blend(RenderTarget &, const RenderTarget &);
+KEYLEDSD_EXPORT void blendAdd(RenderTarget &, const RenderTarget &);
+KEYLEDSD_EXPORT void blendMultiply(RenderTarget &, const RenderTarget &);
+KEYLEDSD_EXPORT void blendScreen(RenderTarget &, const RenderTarget &);
+KEYLEDSD_EXPORT void blendLighten(RenderTarget &, const RenderTarget &);
+KEYLEDSD_EXPORT void lerp(RenderTarget &, const RenderTarget &, uint8_t);
+KEYLEDSD_EXPORT void fill(RenderTarget &, RGBAColor);
+KEYLEDSD_EXPORT void fill(RenderTarget &, RGBAColor, const std::vector<uint8_t> & mask);
+KEYLEDSD_EXPORT void modulateAlpha(RenderTarget &, uint8_t);
 
 /****************************************************************************/
 
 /** Renderer interface
  *
  * The interface an object must expose should it want to draw within a
- * RenderLoop
+ * RenderLoop. Renderers redraw their whole contribution on every frame. Those
+ * that track dirty keys only mark dirty the keys where it differs from the
+ * previous frame; for others, the whole target is assumed to change. When no
+ * renderer marks anything, the frame is not sent to the device.
  */
 class Renderer
 {
@@ -94,7 +133,15 @@ protected:
     using RenderTarget = keyleds::device::RenderTarget;
 public:
     /// Modifies the target to reflect effect's display once the specified time has elapsed
+    /// since previous frame. Time is measured, so it varies from frame to frame.
     virtual void    render(unsigned long nanosec, RenderTarget & target) = 0;
+    /// Tells whether output cannot change until the renderer receives an event.
+    /// When all renderers are static, the loop stops until woken up.
+    virtual bool    isStatic() const { return false; }
+    /// Tells whether render marks the keys it changes, as opposed to drawing
+    /// without marking anything. Renderers must opt in, which lets the loop
+    /// skip unchanged keys and frames.
+    virtual bool    tracksDirty() const { return false; }
 protected:
     // Protect the destructor so we can leave it non-virtual
     ~Renderer() {}
@@ -108,6 +155,14 @@ protected:
  * RenderTarget state to a Device. It assumes entire control of the device.
  * That is, no other thread is allowed to call Device's manipulation methods
  * while a RenderLoop for it exists.
+ *
+ * Once a frame is on the device and all renderers report being static, the loop
+ * parks until wake() is called, which must follow any event given to renderers.
+ *
+ * The frame rate adapts to the device: the loop measures how many reports each
+ * frame sends and how long they take to round-trip, backs off when the link
+ * saturates and ramps up while frames leave enough headroom, within bounds
+ * given by setFrameRate.
  */
 class RenderLoop final : public tools::AnimationLoop
 {
@@ -126,6 +181,14 @@ public:
     /// calling their render method.
     renderer_list &     renderers() { return m_renderers; }
 
+    /// Makes next frame send all keys, for renderers that went away or changed
+    /// their output without marking it, such as after a reconfiguration.
+    /// A lock must be held.
+    void                invalidate() { m_invalidated = true; }
+
+    /// Sets the bounds within which the frame rate adapts. A lock must be held.
+    void                setFrameRate(unsigned minimum, unsigned maximum);
+
     /// Creates a new render target matching the layout of given device
     static RenderTarget renderTargetFor(const Device &);
 
@@ -136,16 +199,34 @@ private:
     /// Reads current device led state into the render target
     void                getDeviceState(RenderTarget & state);
 
+    /// Updates frame rate from the cost of last frame
+    void                adaptFrameRate(std::chrono::steady_clock::duration elapsed,
+                                       unsigned reports, unsigned minimum, unsigned maximum);
+    /// Switches to given frame rate
+    void                applyFrameRate(unsigned fps);
+
 private:
     Device &            m_device;               ///< The device to render to
     renderer_list       m_renderers;            ///< Current list of renderers (unowned)
-    std::mutex          m_mRenderers;           ///< Controls access to m_renderers
-
+    std::mutex          m_mRenderers;           ///< Controls access to m_renderers, m_minFps
+                                                ///  and m_maxFps
+    unsigned            m_minFps;               ///< Frame rate the loop backs off to at most
+    unsigned            m_maxFps;               ///< Frame rate the loop ramps up to at most
+
+    unsigned            m_fps;                  ///< Current frame rate
+    unsigned            m_reportTime;           ///< Smoothed round-trip time of a report, in us
+    unsigned            m_frameReports;         ///< Smoothed number of reports per frame
+    unsigned            m_headroomFrames;       ///< Consecutive frames that left enough headroom
+                                                ///  to ramp up
+
+    bool                m_invalidated;          ///< Next frame must send all keys. Protected
+                                                ///  by m_mRenderers
     RenderTarget        m_state;                ///< Current state of the device
-    RenderTarget        m_buffer;               ///< Buffer to render into, avoids re-creating it
-                                                ///  on every render
+    RenderTarget        m_buffer;               ///< Buffer to render into. Holds last rendered
+                                                ///  frame, equal to m_state out of dirty range
     std::vector<Device::ColorDirective> m_directives;   ///< Buffer of directives, avoids new/delete on
                                                         ///< every render
+    std::vector<uint32_t> m_changes;            ///< Bitmask of changed keys in current block
 };
 
 /****************************************************************************/
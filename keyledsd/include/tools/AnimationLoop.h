@@ -17,7 +17,9 @@
 #ifndef TOOLS_ANIM_LOOP_H_A32C4648
 #define TOOLS_ANIM_LOOP_H_A32C4648
 
+#include <atomic>
 #include <condition_variable>
+#include <cstdint>
 #include <mutex>
 #include <thread>
 
@@ -29,43 +31,87 @@ namespace tools {
 /** Generic thread-based animation loop
  *
  * Starts a thread that invokes a virtual method at a predefined frequency.
- * Supports asynchronous pausing and resuming, and synchronous stop().
+ * Supports asynchronous pausing and resuming, and synchronous stop(), both of
+ * which wake the thread immediately.
+ *
+ * Frames are scheduled on absolute monotonic deadlines, so late frames do not
+ * shift the following ones. Deadlines missed entirely are skipped. The render
+ * method receives the time that actually elapsed since previous frame.
+ *
+ * The period can be changed from within render, it applies from next frame on.
  *
  * The loop starts in paused state. That is, the run method starts immediately
  * but goes into sleep without calling render until setPaused(false) is called.
  *
+ * Render may also park the loop when it knows next frames would be identical.
+ * The loop then sleeps without any wakeup until wake() or setPaused is called.
+ *
  * The loop must be stopped before the object is deleted.
  */
 class AnimationLoop
 {
+public:
+    /// Frame timing statistics. Jitter is how late a frame started past its deadline.
+    struct FrameStats
+    {
+        unsigned long   frames;         ///< Frames rendered
+        unsigned long   skipped;        ///< Deadlines missed entirely, their frame was dropped
+        unsigned long   meanJitter;     ///< Smoothed jitter, in nanoseconds
+        unsigned long   maxJitter;      ///< Worst jitter seen, in nanoseconds
+    };
 public:
                     AnimationLoop(unsigned fps);
     virtual         ~AnimationLoop();
 
     bool            paused() const { return m_paused; }
+    unsigned        period() const { return m_period; }
     int             error() const { return m_error; }
+    FrameStats      frameStats() const;
 
     void            start();
     void            setPaused(bool paused);
     void            stop();
+    /// Resumes a parked loop, or prevents the current frame from parking it
+    void            wake();
 
 protected:
     virtual void    run();
+    /// Draws a frame, given time elapsed since previous one in nanoseconds
     virtual bool    render(unsigned long) = 0;
 
+    /// Changes the animation period, in milliseconds
+    void            setPeriod(unsigned period) { m_period = period; }
+    /// Stops calling render after current frame, until woken up. Only valid from render.
+    void            park();
+
 private:
     /// Simply calls the animation loop's run method
     static void     threadEntry(AnimationLoop &);
+    /// Sleeps until given monotonic time in nanoseconds, or until woken up
+    void            waitUntil(std::uint64_t deadline);
+    /// Interrupts waitUntil
+    void            wakeUp();
+    /// Accounts for a frame starting with given jitter, after skipping some deadlines
+    void            recordFrame(std::uint64_t jitter, unsigned long skipped);
 
 private:
-    std::mutex      m_mRunStatus;           ///< Controls access to m_cRunStats, m_paused and m_abort
-    std::condition_variable m_cRunStatus;   ///< Used to wait on m_paused and m_abort changes
+    std::mutex      m_mRunStatus;           ///< Controls access to m_cRunStats, m_paused, m_parked,
+                                            ///  m_wakePending and m_abort
+    std::condition_variable m_cRunStatus;   ///< Used to wait on m_paused, m_parked and m_abort changes
 
-    unsigned        m_period;               ///< Animation period in milliseconds
+    std::atomic<unsigned> m_period;         ///< Animation period in milliseconds
     bool            m_paused;               ///< If set, the animation loop thread goes into sleep
+    bool            m_parked;               ///< If set, the animation loop thread sleeps until woken
+    bool            m_wakePending;          ///< Set by wake, cancels next call to park
     bool            m_abort;                ///< If set, the animation loop thread exits
     int             m_error;                ///< Error code from animation loop thread, errno-style
 
+    int             m_timerFd;              ///< Fires on next frame deadline
+    int             m_wakeFd;               ///< Event signaled on m_paused and m_abort changes
+
+    mutable std::mutex m_mStats;            ///< Controls access to m_stats
+    FrameStats      m_stats;                ///< Timing statistics since loop creation
+
     std::thread     m_thread;               ///< Actual thread instance
 };
 
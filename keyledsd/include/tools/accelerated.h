@@ -32,15 +32,56 @@ extern "C" {
  * \end{align*}
  * The value of a's alpha channel after the blending is undefined.
  *
- * The blending operation uses SSE2 or MMX if available.
+ * The blending operation uses AVX-512BW, AVX2, SSE2 or MMX if available.
  *
  * @param[in|out] a An array of colors used as a destination. Must be 16-byte aligned.
  * @param b An array of colors used as a source. Must be 16-byte aligned.
- * @param length The number of colors in the arrays. Must be a multiple of 4.
+ * @param length The number of colors in the arrays.
  * @note Arrays must not overlap.
  */
 void blend(uint8_t * a, const uint8_t * b, unsigned length);
 
+/* Compositing kernels
+ *
+ * All of these operate on R8G8B8A8 color streams and use AVX2 or SSE2 if
+ * available. Alpha values act as a 0-1 weight. Arrays follow the same rules
+ * as blend: 16-byte aligned and not overlapping.
+ */
+
+/** Set all colors of a to color */
+void fill(uint8_t * a, const uint8_t * color, unsigned length);
+/** Set colors of a whose mask byte is non-zero to color */
+void fill_masked(uint8_t * a, const uint8_t * color, const uint8_t * mask, unsigned length);
+/** Scale a's alpha channel by alpha, leaving colors untouched */
+void modulate_alpha(uint8_t * a, uint8_t alpha, unsigned length);
+/** Add b, weighted by its alpha, to a, saturating */
+void blend_add(uint8_t * a, const uint8_t * b, unsigned length);
+/** Blend a with a*b, weighted by b's alpha */
+void blend_multiply(uint8_t * a, const uint8_t * b, unsigned length);
+/** Blend a with 1-(1-a)(1-b), weighted by b's alpha */
+void blend_screen(uint8_t * a, const uint8_t * b, unsigned length);
+/** Blend a with max(a, b), weighted by b's alpha */
+void blend_lighten(uint8_t * a, const uint8_t * b, unsigned length);
+/** Interpolate all four channels from a to b by factor t */
+void lerp(uint8_t * a, const uint8_t * b, uint8_t t, unsigned length);
+
+/* The value of a's alpha channel after blend_add, blend_multiply, blend_screen
+ * and blend_lighten is undefined, as it is for blend.
+ */
+
+/** Compare two R8G8B8A8 color streams, ignoring alpha
+ *
+ * Sets bit i%32 of mask[i/32] if colors a_i and b_i differ, clears it otherwise.
+ * Uses AVX2 or SSE2 if available. Arrays need no particular alignment.
+ *
+ * @param a An array of colors.
+ * @param b An array of colors.
+ * @param length The number of colors in the arrays.
+ * @param[out] mask Changed colors bitmask, must hold (length + 31) / 32 words.
+ * @return The number of differing colors, that is, the number of bits set.
+ */
+unsigned diff(const uint8_t * a, const uint8_t * b, unsigned length, uint32_t * mask);
+
 #ifdef __cplusplus
 }
 } } // namespace tools::accelerated
@@ -88,6 +88,8 @@ public:
     Configuration::key_group_list       m_keyGroups;
     Configuration::effect_group_list    m_effectGroups;
     Configuration::profile_list         m_profiles;
+    Configuration::FrameRate            m_frameRate = {0, 0};
+    Configuration::frame_rate_map       m_deviceFrameRates;
 
 private:
     std::stack<state_ptr, std::vector<state_ptr>>                m_state;
@@ -513,11 +515,112 @@ private:
 };
 
 
+/// Configuration builder state: within frame rate bounds
+class FrameRateState final : public MappingBuildState
+{
+    enum SubState : state_type { DeviceList };
+public:
+    using value_type = Configuration::FrameRate;
+    using device_map = Configuration::frame_rate_map;
+public:
+    FrameRateState(std::string name, bool allowDevices, state_type type = 0)
+      : MappingBuildState(type), m_name(std::move(name)), m_allowDevices(allowDevices),
+        m_value{0, 0} {}
+    void print(std::ostream & out) const override { out <<m_name; }
+
+    state_ptr mappingEntry(ConfigurationBuilder & builder, const std::string & key,
+                           const std::string & anchor) override;
+
+    void scalarEntry(ConfigurationBuilder & builder, const std::string & key,
+                     const std::string & value, const std::string & anchor) override
+    {
+        if (key == "min")       { m_value.minimum = parseRate(builder, value); }
+        else if (key == "max")  { m_value.maximum = parseRate(builder, value); }
+        else MappingBuildState::scalarEntry(builder, key, value, anchor);
+    }
+
+    void subStateEnd(ConfigurationBuilder & builder, BuildState & state) override;
+
+    value_type result(ConfigurationBuilder & builder) const
+    {
+        if (m_value.minimum != 0 && m_value.maximum != 0 && m_value.minimum > m_value.maximum) {
+            throw builder.makeError("minimum frame rate is above maximum");
+        }
+        return m_value;
+    }
+    device_map &&   devices() { return std::move(m_devices); }
+
+private:
+    static unsigned parseRate(ConfigurationBuilder & builder, const std::string & value)
+    {
+        char * end;
+        auto result = std::strtoul(value.c_str(), &end, 10);
+        if (value.empty() || *end != '\0' || result == 0 || result > 1000) {
+            throw builder.makeError("invalid frame rate '" + value + "'");
+        }
+        return unsigned(result);
+    }
+
+private:
+    std::string     m_name;
+    bool            m_allowDevices;     ///< Whether per-device bounds may be nested
+    value_type      m_value;
+    device_map      m_devices;
+};
+
+/// Configuration builder state: within per-device frame rate bounds
+class FrameRateListState final : public MappingBuildState
+{
+public:
+    using value_type = Configuration::frame_rate_map;
+public:
+    FrameRateListState(state_type type) : MappingBuildState(type) {}
+    void print(std::ostream & out) const override { out <<"devices"; }
+
+    state_ptr mappingEntry(ConfigurationBuilder &, const std::string & key, const std::string &) override
+    {
+        return std::make_unique<FrameRateState>(key, false);
+    }
+
+    void subStateEnd(ConfigurationBuilder & builder, BuildState & state) override
+    {
+        m_value.emplace_back(currentKey(), state.as<FrameRateState>().result(builder));
+        MappingBuildState::subStateEnd(builder, state);
+    }
+
+    value_type &&   result() { return std::move(m_value); }
+
+private:
+    value_type      m_value;
+};
+
+FrameRateState::state_ptr FrameRateState::mappingEntry(ConfigurationBuilder & builder,
+                                                       const std::string & key,
+                                                       const std::string & anchor)
+{
+    if (key == "devices" && m_allowDevices) {
+        return std::make_unique<FrameRateListState>(SubState::DeviceList);
+    }
+    return MappingBuildState::mappingEntry(builder, key, anchor);
+}
+
+void FrameRateState::subStateEnd(ConfigurationBuilder & builder, BuildState & state)
+{
+    switch (state.type()) {
+    case SubState::DeviceList:
+        m_devices = state.as<FrameRateListState>().result();
+        break;
+    }
+    MappingBuildState::subStateEnd(builder, state);
+}
+
+
 /// Configuration builder state: at document root
 class RootState final : public MappingBuildState
 {
     enum SubState : state_type {
-        Plugins, PluginPaths, Layouts, Devices, KeyGroups, EffectGroups, Profiles
+        Plugins, PluginPaths, Layouts, Devices, KeyGroups, EffectGroups, Profiles,
+        FrameRate
     };
 public:
     RootState() : MappingBuildState(0) {}
@@ -540,6 +643,9 @@ public:
         if (key == "groups")    { return std::make_unique<KeyGroupListState>(SubState::KeyGroups); }
         if (key == "effects")   { return std::make_unique<EffectGroupListState>(SubState::EffectGroups); }
         if (key == "profiles")  { return std::make_unique<ProfileListState>(SubState::Profiles); }
+        if (key == "frame-rate") {
+            return std::make_unique<FrameRateState>(key, true, SubState::FrameRate);
+        }
         return MappingBuildState::mappingEntry(builder, key, anchor);
     }
 
@@ -571,6 +677,10 @@ public:
         case SubState::Profiles:
             builder.m_profiles = state.as<ProfileListState>().result();
             break;
+        case SubState::FrameRate:
+            builder.m_frameRate = state.as<FrameRateState>().result(builder);
+            builder.m_deviceFrameRates = state.as<FrameRateState>().devices();
+            break;
         }
         MappingBuildState::subStateEnd(builder, state);
     }
@@ -673,18 +783,48 @@ Configuration::Configuration(std::string path,
                              device_map devices,
                              key_group_list keyGroups,
                              effect_group_list effectGroups,
-                             profile_list profiles)
+                             profile_list profiles,
+                             FrameRate frameRate,
+                             frame_rate_map deviceFrameRates)
  : m_path(std::move(path)),
    m_plugins(std::move(plugins)),
    m_pluginPaths(std::move(pluginPaths)),
    m_devices(std::move(devices)),
    m_keyGroups(std::move(keyGroups)),
    m_effectGroups(std::move(effectGroups)),
-   m_profiles(std::move(profiles))
+   m_profiles(std::move(profiles)),
+   m_frameRate(frameRate),
+   m_deviceFrameRates(std::move(deviceFrameRates))
 {}
 
 Configuration::~Configuration() {}
 
+Configuration::FrameRate Configuration::frameRateFor(const std::string & name,
+                                                     const std::string & serial) const
+{
+    auto result = m_frameRate;
+
+    auto it = std::find_if(m_deviceFrameRates.begin(), m_deviceFrameRates.end(),
+                           [&name](const auto & item) { return item.first == name; });
+    if (it == m_deviceFrameRates.end()) {
+        it = std::find_if(m_deviceFrameRates.begin(), m_deviceFrameRates.end(),
+                          [&serial](const auto & item) { return item.first == serial; });
+    }
+    if (it != m_deviceFrameRates.end()) {
+        if (it->second.minimum != 0) { result.minimum = it->second.minimum; }
+        if (it->second.maximum != 0) { result.maximum = it->second.maximum; }
+    }
+
+    // Fill unset bounds with defaults, without contradicting explicit ones
+    if (result.minimum == 0) {
+        result.minimum = KEYLEDSD_RENDER_FPS_MIN;
+        if (result.maximum != 0) { result.minimum = std::min(result.minimum, result.maximum); }
+    }
+    if (result.maximum == 0) { result.maximum = std::max(KEYLEDSD_RENDER_FPS_MAX, result.minimum); }
+    if (result.maximum < result.minimum) { result.maximum = result.minimum; }
+    return result;
+}
+
 std::unique_ptr<Configuration> Configuration::loadFile(const std::string & path)
 {
     using tools::paths::XDG;
@@ -709,7 +849,9 @@ std::unique_ptr<Configuration> Configuration::loadFile(const std::string & path)
         std::move(builder.m_devices),
         std::move(builder.m_keyGroups),
         std::move(builder.m_effectGroups),
-        std::move(builder.m_profiles)
+        std::move(builder.m_profiles),
+        builder.m_frameRate,
+        std::move(builder.m_deviceFrameRates)
     ));
 }
 
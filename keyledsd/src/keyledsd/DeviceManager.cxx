@@ -21,6 +21,7 @@
 #include <cassert>
 #include "tools/Paths.h"
 #include "config.h"
+#include "keyleds.h"
 #include "logging.h"
 
 LOGGING("dev-manager");
@@ -48,7 +49,7 @@ DeviceManager::DeviceManager(EffectManager & effectManager, FileWatcher & fileWa
       m_effectManager(effectManager),
       m_configuration(nullptr),
       m_sysPath(description.sysPath()),
-      m_serial(getSerial(description)),
+      m_serial(getSerial(description, device)),
       m_eventDevices(findEventDevices(description)),
       m_device(std::move(device)),
       m_fileWatcherSub(fileWatcher.subscribe(description.devNode(), FileWatcher::event::Attrib,
@@ -77,6 +78,11 @@ void DeviceManager::setConfiguration(const Configuration * conf)
 
     m_configuration = conf;
     m_name = getName(*conf, m_serial);
+
+    const auto frameRate = conf->frameRateFor(m_name, m_serial);
+    m_renderLoop.setFrameRate(frameRate.minimum, frameRate.maximum);
+    m_renderLoop.invalidate();
+    m_renderLoop.wake();
 }
 
 
@@ -91,6 +97,8 @@ void DeviceManager::setContext(const string_map & context)
         static_cast<Effect *>(effect)->handleContextChange(context);
     }
     m_renderLoop.renderers() = std::move(effects);
+    m_renderLoop.invalidate();
+    m_renderLoop.wake();
 }
 
 void DeviceManager::handleFileEvent(FileWatcher::event, uint32_t, std::string)
@@ -105,6 +113,7 @@ void DeviceManager::handleGenericEvent(const string_map & context)
     for (auto * effect : m_renderLoop.renderers()) {
         static_cast<Effect *>(effect)->handleGenericEvent(context);
     }
+    m_renderLoop.wake();
 }
 
 void DeviceManager::handleKeyEvent(int keyCode, bool press)
@@ -121,6 +130,7 @@ void DeviceManager::handleKeyEvent(int keyCode, bool press)
     for (const auto & effect : m_renderLoop.renderers()) {
         static_cast<Effect *>(effect)->handleKeyEvent(*it, press);
     }
+    m_renderLoop.wake();
     DEBUG("key ", it->name, " ", press ? "pressed" : "released", " on device ", m_serial);
 }
 
@@ -129,7 +139,8 @@ void DeviceManager::setPaused(bool val)
     m_renderLoop.setPaused(val);
 }
 
-std::string DeviceManager::getSerial(const ::device::Description & description)
+std::string DeviceManager::getSerial(const ::device::Description & description,
+                                     const Device & device)
 {
     // Serial is stored on master USB device, so we walk up the hierarchy
     const auto & usbDevDescription = description.parentWithType("usb", "usb_device");
@@ -140,6 +151,10 @@ std::string DeviceManager::getSerial(const ::device::Description & description)
     if (it == usbDevDescription.attributes().end()) {
         throw std::runtime_error("Device " + description.sysPath() + " has no serial");
     }
+    // Devices paired to a receiver share its USB serial, tell them apart by their own
+    if (device.target() != KEYLEDS_TARGET_DEFAULT) {
+        return it->second + '_' + device.serial();
+    }
     return it->second;
 }
 
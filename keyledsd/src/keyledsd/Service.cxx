@@ -198,23 +198,25 @@ void Service::onDeviceAdded(const ::device::Description & description)
 {
     VERBOSE("device added: ", description.devNode());
     try {
-        auto device = Device(description.devNode());
-        auto manager = std::make_unique<DeviceManager>(
-            m_effectManager, m_fileWatcher,
-            description, std::move(device), m_configuration.get()
-        );
-        manager->setContext(m_context);
-
-        emit deviceManagerAdded(*manager);
-
-        INFO("opened device ", description.devNode(),
-             " [", manager->name(), ']',
-             ", model ", manager->device().model(),
-             " firmware ", manager->device().firmware(),
-             ", <", manager->device().name(), ">");
-
-        manager->setPaused(false);
-        m_devices.emplace_back(std::move(manager));
+        // Receivers give one device per paired target, all sharing the node
+        for (auto & device : Device::openAll(description.devNode())) {
+            auto manager = std::make_unique<DeviceManager>(
+                m_effectManager, m_fileWatcher,
+                description, std::move(device), m_configuration.get()
+            );
+            manager->setContext(m_context);
+
+            emit deviceManagerAdded(*manager);
+
+            INFO("opened device ", description.devNode(),
+                 " [", manager->name(), ']',
+                 ", model ", manager->device().model(),
+                 " firmware ", manager->device().firmware(),
+                 ", <", manager->device().name(), ">");
+
+            manager->setPaused(false);
+            m_devices.emplace_back(std::move(manager));
+        }
 
     } catch (Device::error & error) {
         // Suppress hid version error, it just means it's not the kind of device we want
@@ -229,11 +231,14 @@ void Service::onDeviceAdded(const ::device::Description & description)
 
 void Service::onDeviceRemoved(const ::device::Description & description)
 {
-    auto it = std::find_if(m_devices.begin(), m_devices.end(),
-                           [&description](const auto & device) {
-                               return device->sysPath() == description.sysPath();
-                           });
-    if (it != m_devices.end()) {
+    // All devices behind a receiver go away with it
+    for (;;) {
+        auto it = std::find_if(m_devices.begin(), m_devices.end(),
+                               [&description](const auto & device) {
+                                   return device->sysPath() == description.sysPath();
+                               });
+        if (it == m_devices.end()) { break; }
+
         std::unique_ptr<DeviceManager> manager = std::move(*it);
         std::iter_swap(it, m_devices.end() - 1);
         m_devices.pop_back();
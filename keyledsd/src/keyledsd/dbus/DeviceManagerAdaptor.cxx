@@ -138,3 +138,14 @@ void DeviceManagerAdaptor::setPaused(bool val)
 {
     parent()->setPaused(val);
 }
+
+QVariantMap DeviceManagerAdaptor::frameStats() const
+{
+    const auto stats = parent()->frameStats();
+    QVariantMap result;
+    result["frames"] = qulonglong(stats.frames);
+    result["skipped"] = qulonglong(stats.skipped);
+    result["meanJitterNs"] = qulonglong(stats.meanJitter);
+    result["maxJitterNs"] = qulonglong(stats.maxJitter);
+    return result;
+}
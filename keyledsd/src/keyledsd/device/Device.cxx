@@ -21,8 +21,10 @@
 #include <cstdlib>
 #include <iomanip>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include "tools/Paths.h"
 #include "keyleds.h"
 #include "logging.h"
 #include "config.h"
@@ -46,34 +48,106 @@ namespace std {
 
 /****************************************************************************/
 
+/// A libkeyleds handle, possibly shared by several targets behind a receiver
+struct Device::Link final
+{
+    std::unique_ptr<struct keyleds_device> device;
+    std::mutex                              mutex;      ///< Serializes access from render loops
+};
+
+/// Exclusive access to the link for the duration of a call, with the calling
+/// device's deadline applied, as libkeyleds keeps only one per handle.
+class Device::Access final
+{
+public:
+    explicit    Access(const Device & device)
+        : m_lock(device.m_link->mutex), m_device(device.m_link->device.get())
+    {
+        if (device.m_hasDeadline) {
+            // libstdc++ implements steady_clock on top of CLOCK_MONOTONIC, as does libkeyleds
+            using std::chrono::duration_cast;
+            auto ns = duration_cast<std::chrono::nanoseconds>(
+                device.m_deadline.time_since_epoch()).count();
+            const struct timespec value = { time_t(ns / 1000000000), long(ns % 1000000000) };
+            keyleds_set_deadline(m_device, &value);
+        } else {
+            keyleds_set_deadline(m_device, nullptr);
+        }
+    }
+                operator struct keyleds_device *() const { return m_device; }
+private:
+    std::lock_guard<std::mutex> m_lock;
+    struct keyleds_device *     m_device;
+};
+
+/****************************************************************************/
+
 Device::Device(std::string path)
+    : Device(path, openLink(path), 0)   // no device uses index 0, it selects the first one
+{}
+
+Device::Device(std::string path, std::shared_ptr<Link> link, target_id_type target)
     : m_path(std::move(path)),
-      m_device(openDevice(m_path)),
-      m_type(getType(m_device.get())),
-      m_name(getName(m_device.get())),
-      m_layout(keyleds_keyboard_layout(m_device.get(), KEYLEDS_TARGET_DEFAULT)),
-      m_blocks(getBlocks(m_device.get()))
+      m_link(std::move(link)),
+      m_target(target != 0 ? target : getTargets(m_link->device.get()).front()),
+      m_hasDeadline(false),
+      m_type(getType(m_link->device.get(), m_target)),
+      m_name(getName(m_link->device.get(), m_target)),
+      m_layout(keyleds_keyboard_layout(m_link->device.get(), m_target)),
+      m_blocks(getBlocks(m_link->device.get(), m_target))
 {
     cacheVersion();
 }
 
 Device::~Device() {}
 
-std::unique_ptr<struct keyleds_device> Device::openDevice(const std::string & path)
+std::vector<Device> Device::openAll(std::string path)
 {
+    // Devices are not shared yet, no need to lock the link while setting them up
+    auto link = openLink(path);
+    std::vector<Device> devices;
+    for (auto target : getTargets(link->device.get())) {
+        devices.push_back(Device(path, link, target));
+    }
+    return devices;
+}
+
+std::shared_ptr<Device::Link> Device::openLink(const std::string & path)
+{
+    // Feature tables are cached so that hotplugged devices light up sooner
+    const auto & cacheDirs = tools::paths::getPaths(tools::paths::XDG::Cache, false);
+    const auto cacheDir = cacheDirs.empty() ? std::string()
+                                            : cacheDirs.front() + "/" KEYLEDSD_DATA_PREFIX;
+
     auto device = std::unique_ptr<struct keyleds_device>(
-        keyleds_open(path.c_str(), KEYLEDSD_APP_ID)
+        keyleds_open_cached(path.c_str(), KEYLEDSD_APP_ID,
+                            cacheDir.empty() ? nullptr : cacheDir.c_str())
     );
     if (device == nullptr) {
         throw error(keyleds_get_error_str(), keyleds_get_errno());
     }
-    return device;
+    keyleds_set_pipeline_depth(device.get(), KEYLEDSD_PIPELINE_DEPTH);
+
+    auto link = std::make_shared<Link>();
+    link->device = std::move(device);
+    return link;
 }
 
-Device::Type Device::getType(struct keyleds_device * device)
+std::vector<Device::target_id_type> Device::getTargets(struct keyleds_device * device)
+{
+    std::vector<target_id_type> targets(KEYLEDS_TARGET_PAIRED_MAX - KEYLEDS_TARGET_PAIRED_MIN + 1);
+    auto count = keyleds_get_targets(device, targets.data(), targets.size());
+    if (count == 0) {
+        throw error(keyleds_get_error_str(), keyleds_get_errno());
+    }
+    targets.resize(std::min<std::size_t>(count, targets.size()));
+    return targets;
+}
+
+Device::Type Device::getType(struct keyleds_device * device, target_id_type target)
 {
     keyleds_device_type_t type;
-    if (!keyleds_get_device_type(device, KEYLEDS_TARGET_DEFAULT, &type)) {
+    if (!keyleds_get_device_type(device, target, &type)) {
         throw error(keyleds_get_error_str(), keyleds_get_errno());
     }
     switch(type) {
@@ -89,10 +163,10 @@ Device::Type Device::getType(struct keyleds_device * device)
     throw std::logic_error("Invalid device type");
 }
 
-std::string Device::getName(struct keyleds_device * device)
+std::string Device::getName(struct keyleds_device * device, target_id_type target)
 {
     char * name;
-    if (!keyleds_get_device_name(device, KEYLEDS_TARGET_DEFAULT, &name)) {
+    if (!keyleds_get_device_name(device, target, &name)) {
         throw error(keyleds_get_error_str(), keyleds_get_errno());
     }
     // Wrap the pointer in a smart pointer in case string creation throws
@@ -103,7 +177,7 @@ std::string Device::getName(struct keyleds_device * device)
 void Device::cacheVersion()
 {
     struct keyleds_device_version * version;
-    if (!keyleds_get_device_version(m_device.get(), KEYLEDS_TARGET_DEFAULT, &version)) {
+    if (!keyleds_get_device_version(m_link->device.get(), m_target, &version)) {
         throw error(keyleds_get_error_str(), keyleds_get_errno());
     }
     // Wrap retrieved data in a smart pointer so it is freed if something throws
@@ -142,29 +216,35 @@ void Device::cacheVersion()
     }
 }
 
-Device::block_list Device::getBlocks(struct keyleds_device * device)
+Device::block_list Device::getBlocks(struct keyleds_device * device, target_id_type target)
 {
     struct keyleds_keyblocks_info * info;
-    if (!keyleds_get_block_info(device, KEYLEDS_TARGET_DEFAULT, &info)) {
+    if (!keyleds_get_block_info(device, target, &info)) {
         throw error(keyleds_get_error_str(), keyleds_get_errno());
     }
     // Wrap retrieved data in a smart pointer so it is freed if something throws
     auto blockinfo_p = std::unique_ptr<struct keyleds_keyblocks_info>(info);
 
+    // Read all blocks in one go, to learn which keys they hold
+    std::vector<std::vector<struct keyleds_key_color>> keys(info->length);
+    std::vector<struct keyleds_leds_query> queries;
+    queries.reserve(info->length);
+    for (unsigned i = 0; i < info->length; i += 1) {
+        keys[i].resize(info->blocks[i].nb_keys);
+        queries.push_back({info->blocks[i].block_id, 0, info->blocks[i].nb_keys, keys[i].data()});
+    }
+    if (!keyleds_get_leds_batch(device, target, queries.data(), queries.size())) {
+        throw error(keyleds_get_error_str(), keyleds_get_errno());
+    }
+
     block_list blocks;
     for (unsigned i = 0; i < info->length; i += 1) {
         const auto & block = info->blocks[i];
 
-        struct keyleds_key_color keys[block.nb_keys];
-        if (!keyleds_get_leds(device, KEYLEDS_TARGET_DEFAULT, block.block_id,
-                              keys, 0, block.nb_keys)) {
-            throw error(keyleds_get_error_str(), keyleds_get_errno());
-        }
-
         key_list key_ids;
         key_ids.reserve(block.nb_keys);
-        for (unsigned key_idx = 0; key_idx < block.nb_keys; key_idx += 1) {
-            if (keys[key_idx].id != 0) { key_ids.push_back(keys[key_idx].id); }
+        for (const auto & key : keys[i]) {
+            if (key.id != 0) { key_ids.push_back(key.id); }
         }
 
         blocks.emplace_back(
@@ -194,6 +274,11 @@ std::string Device::resolveKey(key_block_id_type blockId, key_id_type keyId) con
     return name;
 }
 
+unsigned Device::keysPerReport() const
+{
+    return keyleds_leds_per_report(m_link->device.get());
+}
+
 int Device::decodeKeyId(key_block_id_type blockId, key_id_type keyId) const
 {
     if (blockId != KEYLEDS_BLOCK_KEYS) {
@@ -206,12 +291,25 @@ int Device::decodeKeyId(key_block_id_type blockId, key_id_type keyId) const
 
 void Device::setTimeout(unsigned us)
 {
-    keyleds_set_timeout(m_device.get(), us);
+    std::lock_guard<std::mutex> lock(m_link->mutex);
+    keyleds_set_timeout(m_link->device.get(), us);
+}
+
+void Device::setDeadline(std::chrono::steady_clock::time_point deadline)
+{
+    m_hasDeadline = true;
+    m_deadline = deadline;
+}
+
+void Device::clearDeadline()
+{
+    m_hasDeadline = false;
 }
 
 void Device::flush()
 {
-    if (!keyleds_flush_fd(m_device.get())) {
+    Access device(*this);
+    if (!keyleds_flush_fd(device)) {
         throw error(keyleds_get_error_str(), keyleds_get_errno());
     }
 }
@@ -221,13 +319,15 @@ bool Device::resync() noexcept
     // Note this method does not throw in case of failure. As it is used in error
     // recovery, it is a normal outcome for it to be enable to resync device
     // communications.
-    return keyleds_flush_fd(m_device.get()) &&
-           keyleds_ping(m_device.get(), KEYLEDS_TARGET_DEFAULT);
+    m_hasDeadline = false;
+    Access device(*this);
+    return keyleds_flush_fd(device) && keyleds_ping(device, m_target);
 }
 
 void Device::fillColor(const KeyBlock & block, const RGBColor color)
 {
-    if (!keyleds_set_led_block(m_device.get(), KEYLEDS_TARGET_DEFAULT, keyleds_block_id_t(block.id()),
+    Access device(*this);
+    if (!keyleds_set_led_block(device, m_target, keyleds_block_id_t(block.id()),
                                color.red, color.green, color.blue)) {
         throw error(keyleds_get_error_str(), keyleds_get_errno());
     }
@@ -235,7 +335,8 @@ void Device::fillColor(const KeyBlock & block, const RGBColor color)
 
 void Device::setColors(const KeyBlock & block, const color_directive_list & colors)
 {
-    if (!keyleds_set_leds(m_device.get(), KEYLEDS_TARGET_DEFAULT, keyleds_block_id_t(block.id()),
+    Access device(*this);
+    if (!keyleds_set_leds(device, m_target, keyleds_block_id_t(block.id()),
                           colors.data(), colors.size())) {
         throw error(keyleds_get_error_str(), keyleds_get_errno());
     }
@@ -243,7 +344,8 @@ void Device::setColors(const KeyBlock & block, const color_directive_list & colo
 
 void Device::setColors(const KeyBlock & block, const ColorDirective colors[], size_t size)
 {
-    if (!keyleds_set_leds(m_device.get(), KEYLEDS_TARGET_DEFAULT, keyleds_block_id_t(block.id()),
+    Access device(*this);
+    if (!keyleds_set_leds(device, m_target, keyleds_block_id_t(block.id()),
                           colors, size)) {
         throw error(keyleds_get_error_str(), keyleds_get_errno());
     }
@@ -252,16 +354,39 @@ void Device::setColors(const KeyBlock & block, const ColorDirective colors[], si
 Device::color_directive_list Device::getColors(const KeyBlock & block)
 {
     color_directive_list result(block.keys().size());
-    if (!keyleds_get_leds(m_device.get(), KEYLEDS_TARGET_DEFAULT, keyleds_block_id_t(block.id()),
+    Access device(*this);
+    if (!keyleds_get_leds(device, m_target, keyleds_block_id_t(block.id()),
                           result.data(), 0, result.size())) {
         throw error(keyleds_get_error_str(), keyleds_get_errno());
     }
     return result;
 }
 
+Device::color_directive_list Device::getColors()
+{
+    std::size_t total = 0;
+    for (const auto & block : m_blocks) { total += block.keys().size(); }
+
+    color_directive_list result(total);
+    std::vector<struct keyleds_leds_query> queries;
+    queries.reserve(m_blocks.size());
+
+    auto it = result.data();
+    for (const auto & block : m_blocks) {
+        queries.push_back({keyleds_block_id_t(block.id()), 0, unsigned(block.keys().size()), it});
+        it += block.keys().size();
+    }
+    Access device(*this);
+    if (!keyleds_get_leds_batch(device, m_target, queries.data(), queries.size())) {
+        throw error(keyleds_get_error_str(), keyleds_get_errno());
+    }
+    return result;
+}
+
 void Device::commitColors()
 {
-    if (!keyleds_commit_leds(m_device.get(), KEYLEDS_TARGET_DEFAULT)) {
+    Access device(*this);
+    if (!keyleds_commit_leds(device, m_target)) {
         throw error(keyleds_get_error_str(), keyleds_get_errno());
     }
 }
@@ -43,11 +43,59 @@ static std::size_t align(std::size_t value, std::size_t alignment)
     return (value + alignment - 1) & ~(alignment - 1);
 }
 
+/// Number of reports needed to send given number of key directives
+static std::size_t reportsFor(std::size_t keys, std::size_t keysPerReport)
+{
+    return (keys + keysPerReport - 1) / keysPerReport;
+}
+
+/// Finds the most frequent color in a range, returning its number of occurrences.
+/// Uses Misra-Gries heavy hitters so it does not allocate. Colors appearing in
+/// less than an eighth of the keys may be missed, but those never make a block
+/// fill worthwhile anyway.
+static std::size_t dominantColor(const keyleds::RGBAColor * begin, const keyleds::RGBAColor * end,
+                                 keyleds::RGBAColor * color)
+{
+    constexpr std::size_t numSlots = 8;
+    keyleds::RGBAColor candidates[numSlots];
+    std::size_t counts[numSlots] = {};
+
+    for (auto it = begin; it != end; ++it) {
+        std::size_t freeSlot = numSlots, idx;
+        for (idx = 0; idx < numSlots; ++idx) {
+            if (counts[idx] > 0 && candidates[idx] == *it) { break; }
+            if (counts[idx] == 0 && freeSlot == numSlots) { freeSlot = idx; }
+        }
+        if (idx < numSlots) {
+            ++counts[idx];
+        } else if (freeSlot < numSlots) {
+            candidates[freeSlot] = *it;
+            counts[freeSlot] = 1;
+        } else {
+            for (auto & count : counts) { --count; }
+        }
+    }
+
+    // Counts above are lower bounds, get exact values for surviving candidates
+    std::size_t best = 0;
+    for (std::size_t idx = 0; idx < numSlots; ++idx) {
+        if (counts[idx] == 0) { continue; }
+        auto count = std::size_t(std::count(begin, end, candidates[idx]));
+        if (count > best) {
+            best = count;
+            *color = candidates[idx];
+        }
+    }
+    return best;
+}
+
 /****************************************************************************/
 
 RenderTarget::RenderTarget(size_type numKeys)
  : m_colors(nullptr),
-   m_nbColors(numKeys)
+   m_nbColors(numKeys),
+   m_dirtyBegin(0),
+   m_dirtyEnd(numKeys)
 {
     numKeys = align(numKeys, align_colors);
 
@@ -58,7 +106,9 @@ RenderTarget::RenderTarget(size_type numKeys)
 
 RenderTarget::RenderTarget(RenderTarget && other) noexcept
  : m_colors(nullptr),
-   m_nbColors(other.m_nbColors)
+   m_nbColors(other.m_nbColors),
+   m_dirtyBegin(other.m_dirtyBegin),
+   m_dirtyEnd(other.m_dirtyEnd)
 {
     using std::swap;
     swap(m_colors, other.m_colors);
@@ -83,22 +133,109 @@ void keyleds::device::swap(RenderTarget & lhs, RenderTarget & rhs) noexcept
     using std::swap;
     swap(lhs.m_colors, rhs.m_colors);
     swap(lhs.m_nbColors, rhs.m_nbColors);
+    swap(lhs.m_dirtyBegin, rhs.m_dirtyBegin);
+    swap(lhs.m_dirtyEnd, rhs.m_dirtyEnd);
 }
 
 void keyleds::device::blend(RenderTarget & lhs, const RenderTarget & rhs)
 {
     assert(lhs.size() == rhs.size());
+    lhs.markDirty(rhs.dirtyBegin(), rhs.dirtyEnd());
     tools::accelerated::blend(
         reinterpret_cast<uint8_t*>(lhs.data()),
         reinterpret_cast<const uint8_t*>(rhs.data()), rhs.size()
     );
 }
 
+void keyleds::device::blendAdd(RenderTarget & lhs, const RenderTarget & rhs)
+{
+    assert(lhs.size() == rhs.size());
+    lhs.markDirty(rhs.dirtyBegin(), rhs.dirtyEnd());
+    tools::accelerated::blend_add(
+        reinterpret_cast<uint8_t*>(lhs.data()),
+        reinterpret_cast<const uint8_t*>(rhs.data()), rhs.size()
+    );
+}
+
+void keyleds::device::blendMultiply(RenderTarget & lhs, const RenderTarget & rhs)
+{
+    assert(lhs.size() == rhs.size());
+    lhs.markDirty(rhs.dirtyBegin(), rhs.dirtyEnd());
+    tools::accelerated::blend_multiply(
+        reinterpret_cast<uint8_t*>(lhs.data()),
+        reinterpret_cast<const uint8_t*>(rhs.data()), rhs.size()
+    );
+}
+
+void keyleds::device::blendScreen(RenderTarget & lhs, const RenderTarget & rhs)
+{
+    assert(lhs.size() == rhs.size());
+    lhs.markDirty(rhs.dirtyBegin(), rhs.dirtyEnd());
+    tools::accelerated::blend_screen(
+        reinterpret_cast<uint8_t*>(lhs.data()),
+        reinterpret_cast<const uint8_t*>(rhs.data()), rhs.size()
+    );
+}
+
+void keyleds::device::blendLighten(RenderTarget & lhs, const RenderTarget & rhs)
+{
+    assert(lhs.size() == rhs.size());
+    lhs.markDirty(rhs.dirtyBegin(), rhs.dirtyEnd());
+    tools::accelerated::blend_lighten(
+        reinterpret_cast<uint8_t*>(lhs.data()),
+        reinterpret_cast<const uint8_t*>(rhs.data()), rhs.size()
+    );
+}
+
+void keyleds::device::lerp(RenderTarget & lhs, const RenderTarget & rhs, uint8_t t)
+{
+    assert(lhs.size() == rhs.size());
+    if (t > 0) { lhs.markDirty(); }
+    tools::accelerated::lerp(
+        reinterpret_cast<uint8_t*>(lhs.data()),
+        reinterpret_cast<const uint8_t*>(rhs.data()), t, rhs.size()
+    );
+}
+
+void keyleds::device::fill(RenderTarget & target, RGBAColor color)
+{
+    target.markDirty();
+    tools::accelerated::fill(
+        reinterpret_cast<uint8_t*>(target.data()),
+        reinterpret_cast<const uint8_t*>(&color), target.size()
+    );
+}
+
+void keyleds::device::fill(RenderTarget & target, RGBAColor color, const std::vector<uint8_t> & mask)
+{
+    assert(mask.size() == target.size());
+    target.markDirty();
+    tools::accelerated::fill_masked(
+        reinterpret_cast<uint8_t*>(target.data()),
+        reinterpret_cast<const uint8_t*>(&color), mask.data(), target.size()
+    );
+}
+
+void keyleds::device::modulateAlpha(RenderTarget & target, uint8_t alpha)
+{
+    target.markDirty();
+    tools::accelerated::modulate_alpha(
+        reinterpret_cast<uint8_t*>(target.data()), alpha, target.size()
+    );
+}
+
 /****************************************************************************/
 
 RenderLoop::RenderLoop(Device & device, unsigned fps)
     : AnimationLoop(fps),
       m_device(device),
+      m_minFps(fps),
+      m_maxFps(fps),
+      m_fps(fps),
+      m_reportTime(0),
+      m_frameReports(0),
+      m_headroomFrames(0),
+      m_invalidated(true),
       m_state(renderTargetFor(device)),
       m_buffer(renderTargetFor(device))
 {
@@ -108,6 +245,7 @@ RenderLoop::RenderLoop(Device & device, unsigned fps)
         max = std::max(max, block.keys().size());
     }
     m_directives.reserve(max);
+    m_changes.resize((max + 31) / 32);
 }
 
 RenderLoop::~RenderLoop()
@@ -118,6 +256,13 @@ std::unique_lock<std::mutex> RenderLoop::lock()
     return std::unique_lock<std::mutex>(m_mRenderers);
 }
 
+void RenderLoop::setFrameRate(unsigned minimum, unsigned maximum)
+{
+    assert(0 < minimum && minimum <= maximum);
+    m_minFps = minimum;
+    m_maxFps = maximum;
+}
+
 RenderTarget RenderLoop::renderTargetFor(const Device & device)
 {
     return RenderTarget(std::accumulate(
@@ -129,50 +274,123 @@ RenderTarget RenderLoop::renderTargetFor(const Device & device)
 bool RenderLoop::render(unsigned long nanosec)
 {
     // Run all renderers
-    bool hasRenderers;
+    bool hasRenderers, allStatic = true;
+    unsigned minFps, maxFps;
     {
         std::lock_guard<std::mutex> lock(m_mRenderers);
+        minFps = m_minFps;
+        maxFps = m_maxFps;
         hasRenderers = !m_renderers.empty();
+        if (m_invalidated) {
+            m_buffer.markDirty();
+            m_invalidated = false;
+        }
         for (const auto & effect : m_renderers) {
+            if (!effect->tracksDirty()) { m_buffer.markDirty(); }
             effect->render(nanosec, m_buffer);
+            allStatic = allStatic && effect->isStatic();
         }
     }
 
-    if (hasRenderers) {
+    if (m_fps < minFps || m_fps > maxFps) {
+        applyFrameRate(std::min(std::max(m_fps, minFps), maxFps));
+    }
+
+    // Renderers marked nothing, so output is the same as what the device shows
+    if (hasRenderers && m_buffer.isDirty()) {
+        // Device communication must fit within the frame, so a slow device
+        // delays next frame at most, instead of stalling on every call.
+        const auto start = std::chrono::steady_clock::now();
+        m_device.setDeadline(start + std::chrono::milliseconds(period()));
+        unsigned reports = 0;
+
         m_device.flush();   // Ensure another program using the device did not fill
                             // The inbound report queue.
 
-        // Compute diff
+        // Encode diff, picking the cheapest strategy for each block
+        const std::size_t keysPerReport = m_device.keysPerReport();
+        const std::size_t dirtyBegin = m_buffer.dirtyBegin();
+        const std::size_t dirtyEnd = m_buffer.dirtyEnd();
         bool hasChanges = false;
-        auto oldKeyIt = m_state.cbegin();
-        auto newKeyIt = m_buffer.cbegin();
+        std::size_t offset = 0;
+        const RGBAColor * oldKeys = m_state.data();
+        const RGBAColor * newKeys = m_buffer.data();
 
         for (const auto & block : m_device.blocks()) {
             const size_t numBlockKeys = block.keys().size();
-            m_directives.clear();
 
-            for (size_t kIdx = 0; kIdx < numBlockKeys; ++kIdx) {
-                if (*oldKeyIt != *newKeyIt) {
-                    m_directives.push_back({
-                        block.keys()[kIdx], newKeyIt->red, newKeyIt->green, newKeyIt->blue
-                    });
-                }
-                ++oldKeyIt;
-                ++newKeyIt;
+            // Only keys within dirty range can differ
+            const size_t first = std::min(std::max(dirtyBegin, offset) - offset, numBlockKeys);
+            const size_t last = std::max(std::min(dirtyEnd, offset + numBlockKeys), offset) - offset;
+
+            size_t numChanged = 0;
+            if (first < last) {
+                numChanged = tools::accelerated::diff(
+                    reinterpret_cast<const uint8_t*>(oldKeys + first),
+                    reinterpret_cast<const uint8_t*>(newKeys + first),
+                    unsigned(last - first), m_changes.data()
+                );
             }
-            if (!m_directives.empty()) {
-                m_device.setColors(block, m_directives.data(), m_directives.size());
+
+            if (numChanged > 0) {
+                // A block fill is one report, then keys that differ from it are overridden
+                RGBAColor fill;
+                bool useFill = false;
+                const auto perKeyCost = reportsFor(numChanged, keysPerReport);
+                if (perKeyCost > 1) {
+                    auto numFill = dominantColor(newKeys, newKeys + numBlockKeys, &fill);
+                    useFill = 1 + reportsFor(numBlockKeys - numFill, keysPerReport) < perKeyCost;
+                }
+
+                m_directives.clear();
+                if (useFill) {
+                    m_device.fillColor(block, RGBColor(fill.red, fill.green, fill.blue));
+                    ++reports;
+                    for (size_t kIdx = 0; kIdx < numBlockKeys; ++kIdx) {
+                        if (newKeys[kIdx] != fill) {
+                            m_directives.push_back({block.keys()[kIdx], newKeys[kIdx].red,
+                                                    newKeys[kIdx].green, newKeys[kIdx].blue});
+                        }
+                    }
+                } else {
+                    for (size_t word = 0; 32 * word < last - first; ++word) {
+                        for (auto bits = m_changes[word]; bits != 0; bits &= bits - 1) {
+                            const size_t kIdx = first + 32 * word + size_t(__builtin_ctz(bits));
+                            m_directives.push_back({block.keys()[kIdx], newKeys[kIdx].red,
+                                                    newKeys[kIdx].green, newKeys[kIdx].blue});
+                        }
+                    }
+                }
+                if (!m_directives.empty()) {
+                    m_device.setColors(block, m_directives.data(), m_directives.size());
+                    reports += reportsFor(m_directives.size(), keysPerReport);
+                }
                 hasChanges = true;
             }
+            oldKeys += numBlockKeys;
+            newKeys += numBlockKeys;
+            offset += numBlockKeys;
         }
 
         // Commit color changes
-        if (hasChanges) { m_device.commitColors(); }
+        if (hasChanges) {
+            m_device.commitColors();
+            ++reports;
+        }
+        m_device.clearDeadline();
 
-        using std::swap;
-        swap(m_state, m_buffer);
+        if (reports > 0) {
+            adaptFrameRate(std::chrono::steady_clock::now() - start, reports, minFps, maxFps);
+        }
+
+        // Device now matches buffer, which is kept as a base for next frame
+        std::copy(m_buffer.begin() + dirtyBegin, m_buffer.begin() + dirtyEnd,
+                  m_state.begin() + dirtyBegin);
+        m_buffer.markClean();
     }
 
+    // Nothing will change until an event comes, no need to wake up for every frame
+    if (allStatic && (!hasRenderers || !m_buffer.isDirty())) { park(); }
     return true;
 }
 
@@ -180,6 +398,7 @@ void RenderLoop::run()
 {
     try {
         getDeviceState(m_state);
+        std::copy(m_state.begin(), m_state.end(), m_buffer.begin());
     } catch (Device::error & error) {
         ERROR("device error: ", error.what());
         return;
@@ -197,6 +416,12 @@ void RenderLoop::run()
                     throw;  // recovering from system errors is not an option
                 }
 
+                // A frame that overran its deadline means the link is saturated,
+                // next frame brings the rate back within bounds if needed
+                if (error.code() == KEYLEDS_ERROR_TIMEDOUT) {
+                    applyFrameRate(std::max(m_fps / 2, 1u));
+                }
+
                 // Recover from error, giving some delay to the device
                 WARNING("error on device: ", error.what(), " re-syncing device");
                 unsigned attempt;
@@ -219,20 +444,70 @@ void RenderLoop::run()
     }
 }
 
-void RenderLoop::getDeviceState(RenderTarget & state)
+/* Frame rate control is additive-increase, multiplicative-decrease on the share
+ * of the frame period spent talking to the device:
+ *  - a frame that used over 3/4 of its period means reports are queuing up on
+ *    the link, so the rate drops by a quarter at once.
+ *  - once frames have stayed under half their period for about a second, the
+ *    rate grows by an eighth, as long as the smoothed frame cost, that is
+ *    report round-trip time times reports per frame, still fits in half the
+ *    new period.
+ */
+void RenderLoop::adaptFrameRate(std::chrono::steady_clock::duration elapsed,
+                                unsigned reports, unsigned minimum, unsigned maximum)
 {
-    auto kit = state.begin();
+    using std::chrono::duration_cast;
+    using std::chrono::microseconds;
+    const auto frameTime = unsigned(duration_cast<microseconds>(elapsed).count());
+    const auto periodTime = 1000u * period();
+
+    // Smooth measurements, so a single slow frame does not make the rate bounce
+    const auto reportTime = frameTime / reports;
+    if (m_frameReports == 0) {
+        m_reportTime = reportTime;
+        m_frameReports = reports;
+    } else {
+        m_reportTime = (3 * m_reportTime + reportTime) / 4;
+        m_frameReports = (3 * m_frameReports + reports + 3) / 4;
+    }
 
-    for (const auto & block : m_device.blocks()) {
-        auto colors = m_device.getColors(block);
-
-        assert(block.keys().size() == colors.size());
-        for (const auto & color : colors) {
-            kit->red = color.red;
-            kit->green = color.green;
-            kit->blue = color.blue;
-            kit->alpha = 255;
-            ++kit;
+    if (4 * frameTime > 3 * periodTime) {
+        m_headroomFrames = 0;
+        if (m_fps > minimum) {
+            applyFrameRate(std::max(3 * m_fps / 4, minimum));
         }
+    } else if (2 * frameTime < periodTime) {
+        if (++m_headroomFrames >= m_fps && m_fps < maximum) {
+            m_headroomFrames = 0;
+            const auto cost = std::max(m_reportTime * m_frameReports, 1u);
+            const auto sustainable = 1000000u / (2 * cost);
+            const auto fps = std::min({m_fps + std::max(m_fps / 8, 1u), sustainable, maximum});
+            if (fps > m_fps) { applyFrameRate(fps); }
+        }
+    } else {
+        m_headroomFrames = 0;
+    }
+}
+
+void RenderLoop::applyFrameRate(unsigned fps)
+{
+    DEBUG("loop ", this, " frame rate ", m_fps, " -> ", fps, " fps (report round-trip ",
+          m_reportTime, "us, ", m_frameReports, " reports per frame)");
+    m_fps = fps;
+    setPeriod(1000 / fps);
+}
+
+void RenderLoop::getDeviceState(RenderTarget & state)
+{
+    const auto colors = m_device.getColors();
+    assert(colors.size() == state.size());
+
+    auto kit = state.begin();
+    for (const auto & color : colors) {
+        kit->red = color.red;
+        kit->green = color.green;
+        kit->blue = color.blue;
+        kit->alpha = 255;
+        ++kit;
     }
 }
@@ -16,62 +16,76 @@
  */
 #include <algorithm>
 #include <cmath>
+#include <vector>
 #include "keyledsd/effect/PluginHelper.h"
 
 static constexpr float pi = 3.14159265358979f;
+static constexpr unsigned long long nsPerMs = 1000000;
 
 /****************************************************************************/
 
 class BreateEffect final : public plugin::Effect
 {
-    using KeyGroup = KeyDatabase::KeyGroup;
 public:
     BreateEffect(EffectService & service)
      : m_buffer(service.createRenderTarget()),
-       m_keys(nullptr),
+       m_color(255, 255, 255, 255),
+       m_lastAlpha(0),
        m_time(0), m_period(10000)
     {
-        auto color = RGBAColor(255, 255, 255, 255);
-        service.parseColor(service.getConfig("color"), &color);
-        m_alpha = color.alpha;
-        color.alpha = 0;
+        service.parseColor(service.getConfig("color"), &m_color);
+        m_alpha = m_color.alpha;
+        m_color.alpha = 0;
 
         const auto & groupStr = service.getConfig("group");
         if (!groupStr.empty()) {
             auto git = std::find_if(
                 service.keyGroups().begin(), service.keyGroups().end(),
                 [groupStr](const auto & group) { return group.name() == groupStr; });
-            if (git != service.keyGroups().end()) { m_keys = &*git; }
+            if (git != service.keyGroups().end()) {
+                m_mask.resize(m_buffer->size(), 0);
+                for (const auto & key : *git) { m_mask[key.index] = 1; }
+            }
         }
 
         service.parseNumber(service.getConfig("period"), &m_period);
 
-        std::fill(m_buffer->begin(), m_buffer->end(), color);
+        std::fill(m_buffer->begin(), m_buffer->end(), m_color);
     }
 
-    void render(unsigned long ms, RenderTarget & target) override
+    bool tracksDirty() const override { return true; }
+
+    void render(unsigned long nanosec, RenderTarget & target) override
     {
-        m_time += ms;
-        if (m_time >= m_period) { m_time -= m_period; }
+        const auto period = nsPerMs * std::max(m_period, 1u);
+        m_time = (m_time + nanosec) % period;
 
-        float t = float(m_time) / float(m_period);
+        float t = float(m_time) / float(period);
         float alphaf = -std::cos(2.0f * pi * t);
         uint8_t alpha = m_alpha * (unsigned(128.0f * alphaf) + 128) / 256;
 
-        if (m_keys) {
-            for (const auto & key : *m_keys) { (*m_buffer)[key.index].alpha = alpha; }
-        } else {
-            for (auto & key : *m_buffer) { key.alpha = alpha; }
+        if (alpha != m_lastAlpha) {
+            auto color = m_color;
+            color.alpha = alpha;
+            if (!m_mask.empty()) {
+                fill(*m_buffer, color, m_mask);
+            } else {
+                fill(*m_buffer, color);
+            }
+            m_lastAlpha = alpha;
         }
         blend(target, *m_buffer);
+        m_buffer->markClean();
     }
 
 private:
     RenderTarget *  m_buffer;       ///< this plugin's rendered state
-    const KeyGroup* m_keys;         ///< what keys the effect applies to. Empty for whole keyboard.
+    RGBAColor       m_color;        ///< breathing color, alpha is set every frame
+    std::vector<uint8_t> m_mask;    ///< what keys the effect applies to. Empty for whole keyboard.
     uint8_t         m_alpha;        ///< peak alpha value through the breathing cycle
+    uint8_t         m_lastAlpha;    ///< alpha value currently in m_buffer
 
-    unsigned        m_time;         ///< time in milliseconds since beginning of current cycle
+    unsigned long long m_time;      ///< time in nanoseconds since beginning of current cycle
     unsigned        m_period;       ///< total duration of a cycle in milliseconds
 };
 
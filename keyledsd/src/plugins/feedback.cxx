@@ -14,9 +14,12 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <algorithm>
 #include <vector>
 #include "keyledsd/effect/PluginHelper.h"
 
+static constexpr unsigned long long nsPerMs = 1000000;
+
 /****************************************************************************/
 
 class FeedbackEffect final : public plugin::Effect
@@ -24,7 +27,7 @@ class FeedbackEffect final : public plugin::Effect
     struct KeyPress
     {
         const KeyDatabase::Key *    key;    ///< Entry in the database
-        unsigned                    age;    ///< How long ago the press happened in ms
+        unsigned long long          age;    ///< How long ago the press happened in ns
     };
 
 public:
@@ -42,19 +45,21 @@ public:
         std::fill(m_buffer->begin(), m_buffer->end(), RGBAColor{0, 0, 0, 0});
     }
 
-    void render(unsigned long ms, RenderTarget & target) override
+    void render(unsigned long nanosec, RenderTarget & target) override
     {
-        const auto lifetime = m_sustain + m_decay;
+        const auto decay = nsPerMs * m_decay;
+        const auto lifetime = nsPerMs * m_sustain + decay;
 
         for (auto & keyPress : m_presses) {
-            keyPress.age += ms;
+            keyPress.age += nanosec;
             if (keyPress.age > lifetime) { keyPress.age = lifetime; }
             (*m_buffer)[keyPress.key->index] = RGBAColor(
                 m_color.red,
                 m_color.green,
                 m_color.blue,
-                m_color.alpha * std::min(lifetime - keyPress.age, m_decay) / m_decay
+                RGBAColor::channel_type(m_color.alpha * std::min(lifetime - keyPress.age, decay) / decay)
             );
+            m_buffer->markDirty(keyPress.key->index);
         }
         m_presses.erase(
             std::remove_if(m_presses.begin(), m_presses.end(),
@@ -62,8 +67,12 @@ public:
             m_presses.end()
         );
         blend(target, *m_buffer);
+        m_buffer->markClean();
     }
 
+    bool isStatic() const override { return m_presses.empty(); }
+    bool tracksDirty() const override { return true; }
+
     void handleKeyEvent(const KeyDatabase::Key & key, bool) override
     {
         for (auto & keyPress : m_presses) {
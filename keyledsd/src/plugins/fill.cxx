@@ -56,6 +56,9 @@ public:
         }
     }
 
+    bool isStatic() const override { return true; }
+    bool tracksDirty() const override { return true; }  // output only changes with config
+
     void render(unsigned long, RenderTarget & target) override
     {
         if (m_fill.alpha > 0) {
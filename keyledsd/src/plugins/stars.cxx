@@ -19,6 +19,8 @@
 #include <vector>
 #include "keyledsd/effect/PluginHelper.h"
 
+static constexpr unsigned long long nsPerMs = 1000000;
+
 /****************************************************************************/
 
 class StarsEffect final : public plugin::Effect
@@ -29,7 +31,7 @@ class StarsEffect final : public plugin::Effect
     {
         const KeyDatabase::Key *    key;
         RGBAColor                   color;
-        unsigned                    age;
+        unsigned long long          age;    ///< time since star was born, in ns
     };
 
 public:
@@ -68,24 +70,29 @@ public:
         for (std::size_t idx = 0; idx < m_stars.size(); ++idx) {
             auto & star = m_stars[idx];
             rebirth(star);
-            star.age = idx * m_duration / m_stars.size();
+            star.age = nsPerMs * m_duration * idx / m_stars.size();
         }
     }
 
-    void render(unsigned long ms, RenderTarget & target) override
+    bool tracksDirty() const override { return true; }
+
+    void render(unsigned long nanosec, RenderTarget & target) override
     {
+        const auto duration = nsPerMs * m_duration;
         for (auto & star : m_stars) {
-            star.age += ms;
-            if (star.age >= m_duration) { rebirth(star); }
+            star.age += nanosec;
+            if (star.age >= duration) { rebirth(star); }
             (*m_buffer)[star.key->index] = RGBAColor(
                 star.color.red,
                 star.color.green,
                 star.color.blue,
-                star.color.alpha * (m_duration - star.age) / m_duration
+                RGBAColor::channel_type(star.color.alpha * (duration - star.age) / duration)
             );
+            m_buffer->markDirty(star.key->index);
         }
 
         blend(target, *m_buffer);
+        m_buffer->markClean();
     }
 
     void rebirth(Star & star)
@@ -94,6 +101,7 @@ public:
 
         if (star.key != nullptr) {
             (*m_buffer)[star.key->index] = RGBAColor{0, 0, 0, 0};
+            m_buffer->markDirty(star.key->index);
         }
         if (m_keys) {
             star.key = &(*m_keys)[distribution(0, m_keys->size() - 1)(m_random)];
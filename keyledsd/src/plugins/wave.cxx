@@ -14,6 +14,7 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstddef>
@@ -22,6 +23,7 @@
 
 static constexpr float pi = 3.14159265358979f;
 static constexpr int accuracy = 1024;
+static constexpr unsigned long long nsPerMs = 1000000;
 
 static_assert(accuracy && ((accuracy & (accuracy - 1)) == 0),
               "accuracy must be a power of two");
@@ -68,12 +70,14 @@ public:
         std::fill(m_buffer->begin(), m_buffer->end(), RGBAColor{0, 0, 0, 0});
     }
 
-    void render(unsigned long ms, RenderTarget & target) override
+    bool tracksDirty() const override { return true; }
+
+    void render(unsigned long nanosec, RenderTarget & target) override
     {
-        m_time += ms;
-        if (m_time >= m_period) { m_time -= m_period; }
+        const auto period = nsPerMs * std::max(m_period, 1u);
+        m_time = (m_time + nanosec) % period;
 
-        int t = accuracy * m_time / m_period;
+        int t = int(accuracy * m_time / period);
 
         if (m_keys) {
             assert(m_keys->size() == m_phases.size());
@@ -92,7 +96,9 @@ public:
                 (*m_buffer)[idx] = m_colors[tphi];
             }
         }
+        m_buffer->markDirty();
         blend(target, *m_buffer);
+        m_buffer->markClean();
     }
 
 private:
@@ -175,7 +181,7 @@ private:
                                         ///< From 0 (no phase shift) to 1000 (2*pi shift)
     std::vector<RGBAColor>  m_colors;   ///< pre-computed color samples, build by generateColorTable.
 
-    unsigned            m_time;         ///< time in milliseconds since beginning of current cycle.
+    unsigned long long  m_time;         ///< time in nanoseconds since beginning of current cycle.
     unsigned            m_period;       ///< total duration of a cycle in milliseconds.
     unsigned            m_length;       ///< wave length, in keyboard 1000th.
     unsigned            m_direction;    ///< wave propagation direction, compass style (0 for North).
@@ -16,27 +16,67 @@
  */
 #include "tools/AnimationLoop.h"
 
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
 #include <cerrno>
 #include <chrono>
 #include <functional>
+#include <system_error>
 #include "logging.h"
 
 LOGGING("anim-loop");
 
 using tools::AnimationLoop;
 
+static constexpr std::uint64_t nsPerMs = 1000000;
+static constexpr std::uint64_t nsPerSecond = 1000000000;
+
+/// Current time on the monotonic clock, in nanoseconds
+static std::uint64_t monotonicNow()
+{
+    struct timespec now;
+    ::clock_gettime(CLOCK_MONOTONIC, &now);
+    return std::uint64_t(now.tv_sec) * nsPerSecond + std::uint64_t(now.tv_nsec);
+}
+
 /****************************************************************************/
 
 AnimationLoop::AnimationLoop(unsigned fps)
     : m_period(1000 / fps),
       m_paused(true),
+      m_parked(false),
+      m_wakePending(false),
       m_abort(false),
-      m_error(0)
+      m_error(0),
+      m_timerFd(-1),
+      m_wakeFd(-1),
+      m_stats{0, 0, 0, 0}
 {
+    if ((m_timerFd = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+    if ((m_wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        auto error = errno;
+        ::close(m_timerFd);
+        throw std::system_error(error, std::generic_category());
+    }
 }
 
 AnimationLoop::~AnimationLoop()
-{}
+{
+    ::close(m_wakeFd);
+    ::close(m_timerFd);
+}
+
+AnimationLoop::FrameStats AnimationLoop::frameStats() const
+{
+    std::lock_guard<std::mutex> lock(m_mStats);
+    return m_stats;
+}
 
 void AnimationLoop::start()
 {
@@ -53,6 +93,7 @@ void AnimationLoop::stop()
         m_abort = true;
         m_cRunStatus.notify_one();
     }
+    wakeUp();
 
     m_thread.join();
 #ifndef NDEBUG
@@ -66,10 +107,39 @@ void AnimationLoop::stop()
 void AnimationLoop::setPaused(bool paused)
 {
     if (paused != m_paused) {
+        {
+            std::lock_guard<std::mutex> lock(m_mRunStatus);
+            m_paused = paused;
+            m_parked = false;
+            m_cRunStatus.notify_one();
+        }
+        wakeUp();
+    }
+}
+
+void AnimationLoop::wake()
+{
+    {
         std::lock_guard<std::mutex> lock(m_mRunStatus);
-        m_paused = paused;
+        if (!m_parked) {
+            m_wakePending = true;
+            return;
+        }
+        m_parked = false;
         m_cRunStatus.notify_one();
     }
+    wakeUp();
+}
+
+/* A wake() racing with the frame that parks must not be lost, as the event
+ * it reports may have come after renderers were checked. So it cancels the
+ * next park instead, costing at most one extra frame.
+ */
+void AnimationLoop::park()
+{
+    std::lock_guard<std::mutex> lock(m_mRunStatus);
+    m_parked = !m_wakePending;
+    m_wakePending = false;
 }
 
 /* Some assumptions are made in this loop regarding runstatus:
@@ -77,47 +147,99 @@ void AnimationLoop::setPaused(bool paused)
  *    once it has been set to true.
  * 2) m_paused does not require precise timing. Its purpose
  *    is only to halt the loop after current iteration.
+ *
+ * Time spent paused or parked does not count as elapsed: the first frame
+ * after resuming is given one period, as is the very first frame.
  */
 void AnimationLoop::run()
 {
     DEBUG("AnimationLoop(", this, ") started");
-    auto now = std::chrono::steady_clock::now();
-    auto nextDraw = now;
-    const auto period = std::chrono::milliseconds(m_period);
+    std::uint64_t lastDraw = 0;
+    std::uint64_t nextDraw = monotonicNow();
 
     std::unique_lock<std::mutex> lock(m_mRunStatus);
     for (;;) {
-        while (m_paused || now < nextDraw) {
-            if (m_abort) {
-                DEBUG("AnimationLoop(", this, ") stopped");
-                return;
-            }
-            if (m_paused) {
-                DEBUG("AnimationLoop(", this, ") paused");
-                m_cRunStatus.wait(lock);
-                DEBUG("AnimationLoop(", this, ") resumed");
-            } else {
-                // Work around libstdc++ bug:
-                //    https://gcc.gnu.org/bugzilla/show_bug.cgi?id=41861
-                // Actual intention here would be:
-                //     m_cRunStatus.wait_until(lock, nextDraw);
-                lock.unlock();
-                std::this_thread::sleep_for(nextDraw - std::chrono::steady_clock::now());
-                lock.lock();
-            }
-            now = std::chrono::steady_clock::now();
+        if (m_abort) {
+            DEBUG("AnimationLoop(", this, ") stopped");
+            return;
+        }
+        if (m_paused || m_parked) {
+            DEBUG("AnimationLoop(", this, ") ", m_paused ? "paused" : "parked");
+            m_cRunStatus.wait(lock);
+            DEBUG("AnimationLoop(", this, ") resumed");
+            lastDraw = 0;
+            nextDraw = monotonicNow();
+            continue;
         }
 
         lock.unlock();
-        if (!render(m_period)) { break; }
-        lock.lock();
+        const auto now = monotonicNow();
+        if (now < nextDraw) {
+            waitUntil(nextDraw);
+            lock.lock();
+            continue;       // check run status again
+        }
+
+        const auto elapsed = lastDraw != 0 ? now - lastDraw : m_period * nsPerMs;
+        lastDraw = now;
+        if (!render(static_cast<unsigned long>(elapsed))) { break; }
 
+        // Stay on the grid of deadlines, skipping those already gone
+        const auto period = m_period * nsPerMs;     // render may change it
+        const auto jitter = now - nextDraw;
+        const auto end = monotonicNow();
+        unsigned long skipped = 0;
         nextDraw += period;
-        if (nextDraw <= now) { nextDraw = now + period; }
+        if (nextDraw <= end) {
+            skipped = static_cast<unsigned long>((end - nextDraw) / period + 1);
+            nextDraw += skipped * period;
+        }
+        recordFrame(jitter, skipped);
+        lock.lock();
     }
     DEBUG("AnimationLoop(", this, ") exiting");
 }
 
+void AnimationLoop::waitUntil(std::uint64_t deadline)
+{
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = static_cast<time_t>(deadline / nsPerSecond);
+    spec.it_value.tv_nsec = static_cast<long>(deadline % nsPerSecond);
+    if (::timerfd_settime(m_timerFd, TFD_TIMER_ABSTIME, &spec, nullptr) < 0) {
+        throw std::system_error(errno, std::generic_category());
+    }
+
+    struct pollfd fds[2] = { { m_timerFd, POLLIN, 0 }, { m_wakeFd, POLLIN, 0 } };
+    while (::poll(fds, 2, -1) < 0) {
+        if (errno != EINTR) { throw std::system_error(errno, std::generic_category()); }
+    }
+
+    // Both are non-blocking, consume whichever fired. Failure only means
+    // there was nothing to consume.
+    std::uint64_t count;
+    if ((fds[0].revents & POLLIN) && ::read(m_timerFd, &count, sizeof(count)) < 0) {}
+    if ((fds[1].revents & POLLIN) && ::read(m_wakeFd, &count, sizeof(count)) < 0) {}
+}
+
+void AnimationLoop::wakeUp()
+{
+    // Only fails if the counter would overflow, which still wakes the loop up
+    const std::uint64_t one = 1;
+    if (::write(m_wakeFd, &one, sizeof(one)) < 0) {}
+}
+
+void AnimationLoop::recordFrame(std::uint64_t jitter, unsigned long skipped)
+{
+    std::lock_guard<std::mutex> lock(m_mStats);
+    m_stats.frames += 1;
+    m_stats.skipped += skipped;
+    // Exponential moving average over about 16 frames
+    m_stats.meanJitter = static_cast<unsigned long>(
+        (15 * std::uint64_t(m_stats.meanJitter) + jitter) / 16
+    );
+    m_stats.maxJitter = std::max(m_stats.maxJitter, static_cast<unsigned long>(jitter));
+}
+
 void AnimationLoop::threadEntry(AnimationLoop & loop)
 {
     loop.run();
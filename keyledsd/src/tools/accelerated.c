@@ -21,6 +21,8 @@
 /****************************************************************************/
 /* blend */
 
+void blend_avx512(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length);
+void blend_avx2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length);
 void blend_sse2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length);
 void blend_mmx(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length);
 void blend_plain(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length);
@@ -31,6 +33,12 @@ static void (*resolve_blend(void))(uint8_t * restrict dst, const uint8_t * restr
 #  if defined __GNUC__ && !defined __clang__
     __builtin_cpu_init();
 #  endif
+#  ifdef KEYLEDSD_USE_AVX512
+    if (__builtin_cpu_supports("avx512bw")) { return blend_avx512; }
+#  endif
+#  ifdef KEYLEDSD_USE_AVX2
+    if (__builtin_cpu_supports("avx2")) { return blend_avx2; }
+#  endif
 #  ifdef KEYLEDSD_USE_SSE2
     if (__builtin_cpu_supports("sse2")) { return blend_sse2; }
 #  endif
@@ -55,3 +63,125 @@ void blend(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length
 void blend(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length)
     { blend_plain(dst, src, length); }
 #endif
+
+/****************************************************************************/
+/* Compositing kernels
+ *
+ * Those come in AVX2, SSE2 and plain flavors only. Each gets a resolver, as
+ * blend does, generated by ACCELERATED_KERNEL.
+ */
+
+#ifdef KEYLEDSD_USE_AVX2
+#  define RESOLVE_AVX2(name)    if (__builtin_cpu_supports("avx2")) { return name##_avx2; }
+#else
+#  define RESOLVE_AVX2(name)
+#endif
+#ifdef KEYLEDSD_USE_SSE2
+#  define RESOLVE_SSE2(name)    if (__builtin_cpu_supports("sse2")) { return name##_sse2; }
+#else
+#  define RESOLVE_SSE2(name)
+#endif
+
+#if defined __GNUC__ && !defined __clang__
+#  define RESOLVE_INIT()        __builtin_cpu_init()
+#else
+#  define RESOLVE_INIT()
+#endif
+
+#ifdef HAVE_BUILTIN_CPU_SUPPORTS
+#  ifdef HAVE_IFUNC_ATTRIBUTE
+#    define ACCELERATED_DISPATCH(name, params, args) \
+    void name params __attribute__((ifunc("resolve_" #name)));
+#  else
+#    define ACCELERATED_DISPATCH(name, params, args) \
+    static name##_fn resolved_##name; \
+    void name params \
+    { \
+        if (resolved_##name == 0) { resolved_##name = resolve_##name(); } \
+        (*resolved_##name) args; \
+    }
+#  endif
+#  define ACCELERATED_KERNEL(name, params, args) \
+    typedef void (*name##_fn) params; \
+    void name##_avx2 params; \
+    void name##_sse2 params; \
+    void name##_plain params; \
+    static name##_fn resolve_##name(void) \
+    { \
+        RESOLVE_INIT(); \
+        RESOLVE_AVX2(name) \
+        RESOLVE_SSE2(name) \
+        return name##_plain; \
+    } \
+    ACCELERATED_DISPATCH(name, params, args)
+#else
+#  define ACCELERATED_KERNEL(name, params, args) \
+    void name##_plain params; \
+    void name params { name##_plain args; }
+#endif
+
+ACCELERATED_KERNEL(fill,
+    (uint8_t * restrict dst, const uint8_t * restrict color, unsigned length),
+    (dst, color, length))
+ACCELERATED_KERNEL(fill_masked,
+    (uint8_t * restrict dst, const uint8_t * restrict color,
+     const uint8_t * restrict mask, unsigned length),
+    (dst, color, mask, length))
+ACCELERATED_KERNEL(modulate_alpha,
+    (uint8_t * restrict dst, uint8_t alpha, unsigned length),
+    (dst, alpha, length))
+ACCELERATED_KERNEL(blend_add,
+    (uint8_t * restrict dst, const uint8_t * restrict src, unsigned length),
+    (dst, src, length))
+ACCELERATED_KERNEL(blend_multiply,
+    (uint8_t * restrict dst, const uint8_t * restrict src, unsigned length),
+    (dst, src, length))
+ACCELERATED_KERNEL(blend_screen,
+    (uint8_t * restrict dst, const uint8_t * restrict src, unsigned length),
+    (dst, src, length))
+ACCELERATED_KERNEL(blend_lighten,
+    (uint8_t * restrict dst, const uint8_t * restrict src, unsigned length),
+    (dst, src, length))
+ACCELERATED_KERNEL(lerp,
+    (uint8_t * restrict dst, const uint8_t * restrict src, uint8_t t, unsigned length),
+    (dst, src, t, length))
+
+/****************************************************************************/
+/* diff */
+
+unsigned diff_avx2(const uint8_t * restrict a, const uint8_t * restrict b, unsigned length,
+                   uint32_t * restrict mask);
+unsigned diff_sse2(const uint8_t * restrict a, const uint8_t * restrict b, unsigned length,
+                   uint32_t * restrict mask);
+unsigned diff_plain(const uint8_t * restrict a, const uint8_t * restrict b, unsigned length,
+                    uint32_t * restrict mask);
+
+#ifdef HAVE_BUILTIN_CPU_SUPPORTS
+static unsigned (*resolve_diff(void))(const uint8_t * restrict a, const uint8_t * restrict b,
+                                      unsigned length, uint32_t * restrict mask)
+{
+    RESOLVE_INIT();
+    RESOLVE_AVX2(diff)
+    RESOLVE_SSE2(diff)
+    return diff_plain;
+}
+
+#  ifdef HAVE_IFUNC_ATTRIBUTE
+unsigned diff(const uint8_t * restrict a, const uint8_t * restrict b, unsigned length,
+              uint32_t * restrict mask)
+    __attribute__((ifunc("resolve_diff")));
+#  else
+static unsigned (*resolved_diff)(const uint8_t * restrict a, const uint8_t * restrict b,
+                                 unsigned length, uint32_t * restrict mask);
+unsigned diff(const uint8_t * restrict a, const uint8_t * restrict b, unsigned length,
+              uint32_t * restrict mask)
+{
+    if (resolved_diff == 0) { resolved_diff = resolve_diff(); }
+    return (*resolved_diff)(a, b, length, mask);
+}
+#  endif
+#else
+unsigned diff(const uint8_t * restrict a, const uint8_t * restrict b, unsigned length,
+              uint32_t * restrict mask)
+    { return diff_plain(a, b, length, mask); }
+#endif
@@ -0,0 +1,263 @@
+/* Keyleds -- Gaming keyboard tool
+ * Copyright (C) 2017 Julien Hartmann, juli1.hartmann@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <immintrin.h>
+#include "config.h"
+
+void blend_avx2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi16(1);
+    const __m256i max = _mm256_set1_epi16(256);
+    unsigned idx;
+
+    assert((uintptr_t)dst % 16 == 0);
+    assert((uintptr_t)src % 16 == 0);
+
+    for (idx = 0; idx < length; idx += 8) {
+        __m256i packed_dst, packed_src;
+        __m256i mask = zero;
+
+        /* Tail is loaded and stored through a mask, lanes past the end are left alone */
+        if (length - idx >= 8) {
+            packed_dst = _mm256_loadu_si256((const __m256i *)(dst + idx * 4));
+            packed_src = _mm256_loadu_si256((const __m256i *)(src + idx * 4));
+        } else {
+            mask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)(length - idx)),
+                                      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+            packed_dst = _mm256_maskload_epi32((const int *)(dst + idx * 4), mask);
+            packed_src = _mm256_maskload_epi32((const int *)(src + idx * 4), mask);
+        }
+
+        /* Unpacking works within 128-bit lanes, packing back restores the order */
+        __m256i dst0 = _mm256_unpacklo_epi8(packed_dst, zero); /* pixels 0, 1, 4, 5 */
+        __m256i dst1 = _mm256_unpackhi_epi8(packed_dst, zero); /* pixels 2, 3, 6, 7 */
+        __m256i src0 = _mm256_unpacklo_epi8(packed_src, zero);
+        __m256i src1 = _mm256_unpackhi_epi8(packed_src, zero);
+
+        __m256i alpha0 = _mm256_shufflelo_epi16(_mm256_shufflehi_epi16(src0, 0xff), 0xff);
+        alpha0 = _mm256_add_epi16(alpha0, _mm256_add_epi16(_mm256_cmpeq_epi16(alpha0, zero), one));
+        __m256i alpha1 = _mm256_shufflelo_epi16(_mm256_shufflehi_epi16(src1, 0xff), 0xff);
+        alpha1 = _mm256_add_epi16(alpha1, _mm256_add_epi16(_mm256_cmpeq_epi16(alpha1, zero), one));
+
+        __m256i weighted_dst0 = _mm256_mullo_epi16(dst0, _mm256_sub_epi16(max, alpha0));
+        __m256i weighted_dst1 = _mm256_mullo_epi16(dst1, _mm256_sub_epi16(max, alpha1));
+        __m256i weighted_src0 = _mm256_mullo_epi16(src0, alpha0);
+        __m256i weighted_src1 = _mm256_mullo_epi16(src1, alpha1);
+
+        __m256i final_dst0 = _mm256_srli_epi16(_mm256_add_epi16(weighted_dst0, weighted_src0), 8);
+        __m256i final_dst1 = _mm256_srli_epi16(_mm256_add_epi16(weighted_dst1, weighted_src1), 8);
+        __m256i result = _mm256_packus_epi16(final_dst0, final_dst1);
+
+        if (length - idx >= 8) {
+            _mm256_storeu_si256((__m256i *)(dst + idx * 4), result);
+        } else {
+            _mm256_maskstore_epi32((int *)(dst + idx * 4), mask, result);
+        }
+    }
+}
+
+/****************************************************************************/
+/* Compositing kernels, tails are left to plain versions */
+
+void fill_plain(uint8_t * restrict a, const uint8_t * restrict color, unsigned length);
+void fill_masked_plain(uint8_t * restrict a, const uint8_t * restrict color,
+                       const uint8_t * restrict mask, unsigned length);
+void modulate_alpha_plain(uint8_t * restrict a, uint8_t alpha, unsigned length);
+void blend_add_plain(uint8_t * restrict a, const uint8_t * restrict b, unsigned length);
+void blend_multiply_plain(uint8_t * restrict a, const uint8_t * restrict b, unsigned length);
+void blend_screen_plain(uint8_t * restrict a, const uint8_t * restrict b, unsigned length);
+void blend_lighten_plain(uint8_t * restrict a, const uint8_t * restrict b, unsigned length);
+void lerp_plain(uint8_t * restrict a, const uint8_t * restrict b, uint8_t t, unsigned length);
+
+enum composite_mode { COMPOSITE_ADD, COMPOSITE_MULTIPLY, COMPOSITE_SCREEN, COMPOSITE_LIGHTEN };
+typedef void (*composite_fn)(uint8_t * restrict, const uint8_t * restrict, unsigned);
+
+static inline uint32_t load_color(const uint8_t * color)
+{
+    uint32_t value;
+    memcpy(&value, color, sizeof(value));
+    return value;
+}
+
+/* Source alpha as a 0-256 weight for 16-bit pixels, broadcast to their channels */
+static inline __m256i weights_avx2(__m256i src)
+{
+    __m256i alpha = _mm256_shufflelo_epi16(_mm256_shufflehi_epi16(src, 0xff), 0xff);
+    return _mm256_add_epi16(alpha, _mm256_add_epi16(_mm256_cmpeq_epi16(alpha, _mm256_setzero_si256()),
+                                                _mm256_set1_epi16(1)));
+}
+
+/* (dst * (256 - alpha) + value * alpha) / 256 */
+static inline __m256i mix_avx2(__m256i dst, __m256i value, __m256i alpha)
+{
+    return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(dst, _mm256_sub_epi16(_mm256_set1_epi16(256), alpha)),
+                                        _mm256_mullo_epi16(value, alpha)), 8);
+}
+
+static inline __m256i composite_pixels_avx2(enum composite_mode mode, __m256i dst, __m256i src, __m256i alpha)
+{
+    __m256i product;
+    switch (mode) {
+    case COMPOSITE_ADD:
+        return _mm256_add_epi16(dst, _mm256_srli_epi16(_mm256_mullo_epi16(src, alpha), 8));
+    case COMPOSITE_MULTIPLY:
+        product = _mm256_srli_epi16(_mm256_mullo_epi16(dst, _mm256_add_epi16(src, _mm256_set1_epi16(1))), 8);
+        return mix_avx2(dst, product, alpha);
+    case COMPOSITE_SCREEN:
+        product = _mm256_srli_epi16(_mm256_mullo_epi16(dst, _mm256_add_epi16(src, _mm256_set1_epi16(1))), 8);
+        return mix_avx2(dst, _mm256_sub_epi16(_mm256_add_epi16(dst, src), product), alpha);
+    case COMPOSITE_LIGHTEN:
+        return mix_avx2(dst, _mm256_max_epi16(dst, src), alpha);
+    }
+    return dst;
+}
+
+static inline void composite_avx2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length,
+                                  enum composite_mode mode, composite_fn tail)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned count = length / 8;
+
+    while (count-- > 0) {
+        __m256i packed_dst = _mm256_loadu_si256((__m256i *)dst);
+        __m256i packed_src = _mm256_loadu_si256((const __m256i *)src);
+
+        __m256i dst0 = _mm256_unpacklo_epi8(packed_dst, zero);
+        __m256i dst1 = _mm256_unpackhi_epi8(packed_dst, zero);
+        __m256i src0 = _mm256_unpacklo_epi8(packed_src, zero);
+        __m256i src1 = _mm256_unpackhi_epi8(packed_src, zero);
+
+        __m256i final_dst0 = composite_pixels_avx2(mode, dst0, src0, weights_avx2(src0));
+        __m256i final_dst1 = composite_pixels_avx2(mode, dst1, src1, weights_avx2(src1));
+
+        _mm256_storeu_si256((__m256i *)dst, _mm256_packus_epi16(final_dst0, final_dst1));
+        dst += 4 * 8;
+        src += 4 * 8;
+    }
+    tail(dst, src, length % 8);
+}
+
+void blend_add_avx2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length)
+    { composite_avx2(dst, src, length, COMPOSITE_ADD, blend_add_plain); }
+void blend_multiply_avx2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length)
+    { composite_avx2(dst, src, length, COMPOSITE_MULTIPLY, blend_multiply_plain); }
+void blend_screen_avx2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length)
+    { composite_avx2(dst, src, length, COMPOSITE_SCREEN, blend_screen_plain); }
+void blend_lighten_avx2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length)
+    { composite_avx2(dst, src, length, COMPOSITE_LIGHTEN, blend_lighten_plain); }
+
+void fill_avx2(uint8_t * restrict dst, const uint8_t * restrict color, unsigned length)
+{
+    const __m256i value = _mm256_set1_epi32((int)load_color(color));
+    unsigned count = length / 8;
+
+    while (count-- > 0) {
+        _mm256_storeu_si256((__m256i *)dst, value);
+        dst += 4 * 8;
+    }
+    fill_plain(dst, color, length % 8);
+}
+
+void fill_masked_avx2(uint8_t * restrict dst, const uint8_t * restrict color,
+                       const uint8_t * restrict mask, unsigned length)
+{
+    const __m256i value = _mm256_set1_epi32((int)load_color(color));
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned count = length / 8;
+
+    while (count-- > 0) {
+        __m256i selector = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)mask));
+        __m256i keep = _mm256_cmpeq_epi32(selector, zero);
+        __m256i packed_dst = _mm256_loadu_si256((__m256i *)dst);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_or_si256(_mm256_and_si256(keep, packed_dst),
+                                          _mm256_andnot_si256(keep, value)));
+        dst += 4 * 8;
+        mask += 8;
+    }
+    fill_masked_plain(dst, color, mask, length % 8);
+}
+
+void modulate_alpha_avx2(uint8_t * restrict dst, uint8_t alpha, unsigned length)
+{
+    const __m256i scale = _mm256_set1_epi32(alpha != 0 ? alpha + 1 : 0);
+    const __m256i colors = _mm256_set1_epi32(0x00ffffff);
+    unsigned count = length / 8;
+
+    while (count-- > 0) {
+        __m256i packed_dst = _mm256_loadu_si256((__m256i *)dst);
+        /* Alpha times scale fits the low 16 bits of each 32-bit pixel */
+        __m256i alphas = _mm256_srli_epi32(_mm256_mullo_epi16(_mm256_srli_epi32(packed_dst, 24), scale), 8);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_or_si256(_mm256_and_si256(packed_dst, colors),
+                                          _mm256_slli_epi32(alphas, 24)));
+        dst += 4 * 8;
+    }
+    modulate_alpha_plain(dst, alpha, length % 8);
+}
+
+void lerp_avx2(uint8_t * restrict dst, const uint8_t * restrict src, uint8_t t, unsigned length)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i scale = _mm256_set1_epi16(t != 0 ? t + 1 : 0);
+    unsigned count = length / 8;
+
+    while (count-- > 0) {
+        __m256i packed_dst = _mm256_loadu_si256((__m256i *)dst);
+        __m256i packed_src = _mm256_loadu_si256((const __m256i *)src);
+
+        __m256i final_dst0 = mix_avx2(_mm256_unpacklo_epi8(packed_dst, zero),
+                                   _mm256_unpacklo_epi8(packed_src, zero), scale);
+        __m256i final_dst1 = mix_avx2(_mm256_unpackhi_epi8(packed_dst, zero),
+                                   _mm256_unpackhi_epi8(packed_src, zero), scale);
+
+        _mm256_storeu_si256((__m256i *)dst, _mm256_packus_epi16(final_dst0, final_dst1));
+        dst += 4 * 8;
+        src += 4 * 8;
+    }
+    lerp_plain(dst, src, t, length % 8);
+}
+
+/****************************************************************************/
+/* Frame diff, one mask word per 32 colors */
+
+unsigned diff_plain(const uint8_t * restrict a, const uint8_t * restrict b, unsigned length,
+                    uint32_t * restrict mask);
+
+unsigned diff_avx2(const uint8_t * restrict a, const uint8_t * restrict b, unsigned length,
+                   uint32_t * restrict mask)
+{
+    const __m256i colors = _mm256_set1_epi32(0x00ffffff);
+    const __m256i zero = _mm256_setzero_si256();
+    unsigned words = length / 32, changed = 0, idx;
+
+    while (words-- > 0) {
+        uint32_t bits = 0;
+        for (idx = 0; idx < 32; idx += 8) {
+            __m256i delta = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)a),
+                                             _mm256_loadu_si256((const __m256i *)b));
+            __m256i same = _mm256_cmpeq_epi32(_mm256_and_si256(delta, colors), zero);
+            bits |= (uint32_t)(~_mm256_movemask_ps(_mm256_castsi256_ps(same)) & 0xff) << idx;
+            a += 32;
+            b += 32;
+        }
+        *mask++ = bits;
+        changed += (unsigned)__builtin_popcount(bits);
+    }
+    return changed + diff_plain(a, b, length % 32, mask);
+}
@@ -0,0 +1,60 @@
+/* Keyleds -- Gaming keyboard tool
+ * Copyright (C) 2017 Julien Hartmann, juli1.hartmann@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <stdint.h>
+#include <immintrin.h>
+#include "config.h"
+
+void blend_avx512(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i one = _mm512_set1_epi16(1);
+    const __m512i max = _mm512_set1_epi16(256);
+    unsigned idx;
+
+    assert((uintptr_t)dst % 16 == 0);
+    assert((uintptr_t)src % 16 == 0);
+
+    for (idx = 0; idx < length; idx += 16) {
+        /* Tail is loaded and stored through a mask, lanes past the end are left alone */
+        const __mmask16 mask = length - idx >= 16 ? (__mmask16)0xffff
+                                                  : (__mmask16)((1u << (length - idx)) - 1);
+        __m512i packed_dst = _mm512_maskz_loadu_epi32(mask, dst + idx * 4);
+        __m512i packed_src = _mm512_maskz_loadu_epi32(mask, src + idx * 4);
+
+        /* Unpacking works within 128-bit lanes, packing back restores the order */
+        __m512i dst0 = _mm512_unpacklo_epi8(packed_dst, zero);
+        __m512i dst1 = _mm512_unpackhi_epi8(packed_dst, zero);
+        __m512i src0 = _mm512_unpacklo_epi8(packed_src, zero);
+        __m512i src1 = _mm512_unpackhi_epi8(packed_src, zero);
+
+        __m512i alpha0 = _mm512_shufflelo_epi16(_mm512_shufflehi_epi16(src0, 0xff), 0xff);
+        alpha0 = _mm512_mask_add_epi16(alpha0, _mm512_test_epi16_mask(alpha0, alpha0), alpha0, one);
+        __m512i alpha1 = _mm512_shufflelo_epi16(_mm512_shufflehi_epi16(src1, 0xff), 0xff);
+        alpha1 = _mm512_mask_add_epi16(alpha1, _mm512_test_epi16_mask(alpha1, alpha1), alpha1, one);
+
+        __m512i weighted_dst0 = _mm512_mullo_epi16(dst0, _mm512_sub_epi16(max, alpha0));
+        __m512i weighted_dst1 = _mm512_mullo_epi16(dst1, _mm512_sub_epi16(max, alpha1));
+        __m512i weighted_src0 = _mm512_mullo_epi16(src0, alpha0);
+        __m512i weighted_src1 = _mm512_mullo_epi16(src1, alpha1);
+
+        __m512i final_dst0 = _mm512_srli_epi16(_mm512_add_epi16(weighted_dst0, weighted_src0), 8);
+        __m512i final_dst1 = _mm512_srli_epi16(_mm512_add_epi16(weighted_dst1, weighted_src1), 8);
+
+        _mm512_mask_storeu_epi32(dst + idx * 4, mask, _mm512_packus_epi16(final_dst0, final_dst1));
+    }
+}
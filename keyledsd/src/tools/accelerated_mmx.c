@@ -19,6 +19,8 @@
 #include <mmintrin.h>
 #include "config.h"
 
+void blend_plain(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length);
+
 void blend_mmx(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length)
 {
     __m64 * restrict dstv = (__m64 *)__builtin_assume_aligned(dst, 16);
@@ -30,11 +32,9 @@ void blend_mmx(uint8_t * restrict dst, const uint8_t * restrict src, unsigned le
 
     assert((uintptr_t)dst % 16 == 0);
     assert((uintptr_t)src % 16 == 0);
-    assert(length % 4 == 0);
-
-    length /= 2;
+    unsigned count = length / 2;
 
-    do {
+    while (count-- > 0) {
         __m64 packed_dst = *dstv;
         __m64 packed_src = *srcv;
 
@@ -43,11 +43,14 @@ void blend_mmx(uint8_t * restrict dst, const uint8_t * restrict src, unsigned le
         __m64 src0 = _mm_unpacklo_pi8(packed_src, zero); /* A0B0G0R0 */
         __m64 src1 = _mm_unpackhi_pi8(packed_src, zero); /* A1B1G1R1 */
 
-        __m64 alpha0 = _mm_or_si64(src0, _mm_srli_si64(src0, 16));
-        alpha0 = _mm_or_si64(alpha0, _mm_srli_si64(alpha0, 32));
+        /* Broadcast alpha from the top word, without SSE's pshufw */
+        __m64 alpha0 = _mm_srli_si64(src0, 48);
+        alpha0 = _mm_or_si64(alpha0, _mm_slli_si64(alpha0, 16));
+        alpha0 = _mm_or_si64(alpha0, _mm_slli_si64(alpha0, 32));
         alpha0 = _mm_add_pi16(alpha0, _mm_add_pi16(_mm_cmpeq_pi16(alpha0, zero), one));
-        __m64 alpha1 = _mm_or_si64(src1, _mm_srli_si64(src1, 16));
-        alpha1 = _mm_or_si64(alpha1, _mm_srli_si64(alpha1, 32));
+        __m64 alpha1 = _mm_srli_si64(src1, 48);
+        alpha1 = _mm_or_si64(alpha1, _mm_slli_si64(alpha1, 16));
+        alpha1 = _mm_or_si64(alpha1, _mm_slli_si64(alpha1, 32));
         alpha1 = _mm_add_pi16(alpha1, _mm_add_pi16(_mm_cmpeq_pi16(alpha1, zero), one));
 
         __m64 weighted_dst0 = _mm_mullo_pi16(dst0, _mm_sub_pi16(max, alpha0));
@@ -71,7 +74,7 @@ void blend_mmx(uint8_t * restrict dst, const uint8_t * restrict src, unsigned le
         *dstv = _mm_packs_pu16(final_dst0, final_dst1);
         srcv += 1;
         dstv += 1;
-    } while (--length > 0);
-
+    }
     _mm_empty();
+    blend_plain((uint8_t *)dstv, (const uint8_t *)srcv, length % 2);
 }
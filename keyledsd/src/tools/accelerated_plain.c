@@ -14,19 +14,12 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include <assert.h>
 #include <stdint.h>
 #include "config.h"
 
+/* Also finishes the tail of vector implementations, so takes any alignment */
 void blend_plain(uint8_t * __restrict a, const uint8_t * __restrict b, unsigned length)
 {
-    a = (uint8_t*)__builtin_assume_aligned(a, 16);
-    b = (const uint8_t*)__builtin_assume_aligned(b, 16);
-
-    assert((uintptr_t)a % 16 == 0);
-    assert((uintptr_t)b % 16 == 0);
-    assert(length % 16 == 0);
-
     while (length-- > 0) {
         uint16_t alpha = b[3];
         if (alpha != 0) { alpha += 1; }
@@ -37,3 +30,123 @@ void blend_plain(uint8_t * __restrict a, const uint8_t * __restrict b, unsigned
         b += 4;
     }
 }
+
+/* Source alpha as a 0-256 weight, so full opacity is an exact shift */
+static inline unsigned weight(uint8_t alpha) { return alpha != 0 ? alpha + 1u : 0u; }
+
+void fill_plain(uint8_t * __restrict a, const uint8_t * __restrict color, unsigned length)
+{
+    while (length-- > 0) {
+        a[0] = color[0];
+        a[1] = color[1];
+        a[2] = color[2];
+        a[3] = color[3];
+        a += 4;
+    }
+}
+
+void fill_masked_plain(uint8_t * __restrict a, const uint8_t * __restrict color,
+                       const uint8_t * __restrict mask, unsigned length)
+{
+    while (length-- > 0) {
+        if (*mask++ != 0) {
+            a[0] = color[0];
+            a[1] = color[1];
+            a[2] = color[2];
+            a[3] = color[3];
+        }
+        a += 4;
+    }
+}
+
+void modulate_alpha_plain(uint8_t * __restrict a, uint8_t alpha, unsigned length)
+{
+    const unsigned scale = weight(alpha);
+    while (length-- > 0) {
+        a[3] = (uint8_t)((a[3] * scale) >> 8);
+        a += 4;
+    }
+}
+
+void blend_add_plain(uint8_t * __restrict a, const uint8_t * __restrict b, unsigned length)
+{
+    unsigned channel;
+    while (length-- > 0) {
+        const unsigned alpha = weight(b[3]);
+        for (channel = 0; channel < 3; ++channel) {
+            const unsigned value = a[channel] + ((b[channel] * alpha) >> 8);
+            a[channel] = (uint8_t)(value > 255 ? 255 : value);
+        }
+        a += 4;
+        b += 4;
+    }
+}
+
+void blend_multiply_plain(uint8_t * __restrict a, const uint8_t * __restrict b, unsigned length)
+{
+    unsigned channel;
+    while (length-- > 0) {
+        const unsigned alpha = weight(b[3]);
+        for (channel = 0; channel < 3; ++channel) {
+            const unsigned value = (a[channel] * (b[channel] + 1u)) >> 8;
+            a[channel] = (uint8_t)((a[channel] * (256 - alpha) + value * alpha) >> 8);
+        }
+        a += 4;
+        b += 4;
+    }
+}
+
+void blend_screen_plain(uint8_t * __restrict a, const uint8_t * __restrict b, unsigned length)
+{
+    unsigned channel;
+    while (length-- > 0) {
+        const unsigned alpha = weight(b[3]);
+        for (channel = 0; channel < 3; ++channel) {
+            const unsigned value = a[channel] + b[channel] - ((a[channel] * (b[channel] + 1u)) >> 8);
+            a[channel] = (uint8_t)((a[channel] * (256 - alpha) + value * alpha) >> 8);
+        }
+        a += 4;
+        b += 4;
+    }
+}
+
+void blend_lighten_plain(uint8_t * __restrict a, const uint8_t * __restrict b, unsigned length)
+{
+    unsigned channel;
+    while (length-- > 0) {
+        const unsigned alpha = weight(b[3]);
+        for (channel = 0; channel < 3; ++channel) {
+            const unsigned value = a[channel] > b[channel] ? a[channel] : b[channel];
+            a[channel] = (uint8_t)((a[channel] * (256 - alpha) + value * alpha) >> 8);
+        }
+        a += 4;
+        b += 4;
+    }
+}
+
+void lerp_plain(uint8_t * __restrict a, const uint8_t * __restrict b, uint8_t t, unsigned length)
+{
+    const unsigned scale = weight(t);
+    length *= 4;
+    while (length-- > 0) {
+        *a = (uint8_t)((*a * (256 - scale) + *b * scale) >> 8);
+        a += 1;
+        b += 1;
+    }
+}
+
+unsigned diff_plain(const uint8_t * __restrict a, const uint8_t * __restrict b, unsigned length,
+                    uint32_t * __restrict mask)
+{
+    unsigned changed = 0, idx;
+    for (idx = 0; idx < length; ++idx) {
+        if (idx % 32 == 0) { mask[idx / 32] = 0; }
+        if (a[0] != b[0] || a[1] != b[1] || a[2] != b[2]) {
+            mask[idx / 32] |= UINT32_C(1) << (idx % 32);
+            changed += 1;
+        }
+        a += 4;
+        b += 4;
+    }
+    return changed;
+}
@@ -16,9 +16,12 @@
  */
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 #include <emmintrin.h>
 #include "config.h"
 
+void blend_plain(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length);
+
 void blend_sse2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length)
 {
     __m128i * restrict dstv = (__m128i *)__builtin_assume_aligned(dst, 16);
@@ -30,10 +33,9 @@ void blend_sse2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned l
 
     assert((uintptr_t)dst % 16 == 0);
     assert((uintptr_t)src % 16 == 0);
-    assert(length % 4 == 0);
-    length /= 4;
+    unsigned count = length / 4;
 
-    do {
+    while (count-- > 0) {
         __m128i packed_dst = _mm_load_si128(dstv);
         __m128i packed_src = _mm_load_si128(srcv);
 
@@ -59,5 +61,196 @@ void blend_sse2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned l
         _mm_store_si128(dstv, _mm_packus_epi16(final_dst0, final_dst1));
         srcv += 1;
         dstv += 1;
-    } while (--length > 0);
+    }
+    blend_plain((uint8_t *)dstv, (const uint8_t *)srcv, length % 4);
+}
+
+/****************************************************************************/
+/* Compositing kernels, tails are left to plain versions */
+
+void fill_plain(uint8_t * restrict a, const uint8_t * restrict color, unsigned length);
+void fill_masked_plain(uint8_t * restrict a, const uint8_t * restrict color,
+                       const uint8_t * restrict mask, unsigned length);
+void modulate_alpha_plain(uint8_t * restrict a, uint8_t alpha, unsigned length);
+void blend_add_plain(uint8_t * restrict a, const uint8_t * restrict b, unsigned length);
+void blend_multiply_plain(uint8_t * restrict a, const uint8_t * restrict b, unsigned length);
+void blend_screen_plain(uint8_t * restrict a, const uint8_t * restrict b, unsigned length);
+void blend_lighten_plain(uint8_t * restrict a, const uint8_t * restrict b, unsigned length);
+void lerp_plain(uint8_t * restrict a, const uint8_t * restrict b, uint8_t t, unsigned length);
+
+enum composite_mode { COMPOSITE_ADD, COMPOSITE_MULTIPLY, COMPOSITE_SCREEN, COMPOSITE_LIGHTEN };
+typedef void (*composite_fn)(uint8_t * restrict, const uint8_t * restrict, unsigned);
+
+static inline uint32_t load_color(const uint8_t * color)
+{
+    uint32_t value;
+    memcpy(&value, color, sizeof(value));
+    return value;
+}
+
+/* Source alpha as a 0-256 weight for 16-bit pixels, broadcast to their channels */
+static inline __m128i weights_sse2(__m128i src)
+{
+    __m128i alpha = _mm_shufflelo_epi16(_mm_shufflehi_epi16(src, 0xff), 0xff);
+    return _mm_add_epi16(alpha, _mm_add_epi16(_mm_cmpeq_epi16(alpha, _mm_setzero_si128()),
+                                                _mm_set1_epi16(1)));
+}
+
+/* (dst * (256 - alpha) + value * alpha) / 256 */
+static inline __m128i mix_sse2(__m128i dst, __m128i value, __m128i alpha)
+{
+    return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(dst, _mm_sub_epi16(_mm_set1_epi16(256), alpha)),
+                                        _mm_mullo_epi16(value, alpha)), 8);
+}
+
+static inline __m128i composite_pixels_sse2(enum composite_mode mode, __m128i dst, __m128i src, __m128i alpha)
+{
+    __m128i product;
+    switch (mode) {
+    case COMPOSITE_ADD:
+        return _mm_add_epi16(dst, _mm_srli_epi16(_mm_mullo_epi16(src, alpha), 8));
+    case COMPOSITE_MULTIPLY:
+        product = _mm_srli_epi16(_mm_mullo_epi16(dst, _mm_add_epi16(src, _mm_set1_epi16(1))), 8);
+        return mix_sse2(dst, product, alpha);
+    case COMPOSITE_SCREEN:
+        product = _mm_srli_epi16(_mm_mullo_epi16(dst, _mm_add_epi16(src, _mm_set1_epi16(1))), 8);
+        return mix_sse2(dst, _mm_sub_epi16(_mm_add_epi16(dst, src), product), alpha);
+    case COMPOSITE_LIGHTEN:
+        return mix_sse2(dst, _mm_max_epi16(dst, src), alpha);
+    }
+    return dst;
+}
+
+static inline void composite_sse2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length,
+                                  enum composite_mode mode, composite_fn tail)
+{
+    const __m128i zero = _mm_setzero_si128();
+    unsigned count = length / 4;
+
+    while (count-- > 0) {
+        __m128i packed_dst = _mm_loadu_si128((__m128i *)dst);
+        __m128i packed_src = _mm_loadu_si128((const __m128i *)src);
+
+        __m128i dst0 = _mm_unpacklo_epi8(packed_dst, zero);
+        __m128i dst1 = _mm_unpackhi_epi8(packed_dst, zero);
+        __m128i src0 = _mm_unpacklo_epi8(packed_src, zero);
+        __m128i src1 = _mm_unpackhi_epi8(packed_src, zero);
+
+        __m128i final_dst0 = composite_pixels_sse2(mode, dst0, src0, weights_sse2(src0));
+        __m128i final_dst1 = composite_pixels_sse2(mode, dst1, src1, weights_sse2(src1));
+
+        _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(final_dst0, final_dst1));
+        dst += 4 * 4;
+        src += 4 * 4;
+    }
+    tail(dst, src, length % 4);
+}
+
+void blend_add_sse2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length)
+    { composite_sse2(dst, src, length, COMPOSITE_ADD, blend_add_plain); }
+void blend_multiply_sse2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length)
+    { composite_sse2(dst, src, length, COMPOSITE_MULTIPLY, blend_multiply_plain); }
+void blend_screen_sse2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length)
+    { composite_sse2(dst, src, length, COMPOSITE_SCREEN, blend_screen_plain); }
+void blend_lighten_sse2(uint8_t * restrict dst, const uint8_t * restrict src, unsigned length)
+    { composite_sse2(dst, src, length, COMPOSITE_LIGHTEN, blend_lighten_plain); }
+
+void fill_sse2(uint8_t * restrict dst, const uint8_t * restrict color, unsigned length)
+{
+    const __m128i value = _mm_set1_epi32((int)load_color(color));
+    unsigned count = length / 4;
+
+    while (count-- > 0) {
+        _mm_storeu_si128((__m128i *)dst, value);
+        dst += 4 * 4;
+    }
+    fill_plain(dst, color, length % 4);
+}
+
+void fill_masked_sse2(uint8_t * restrict dst, const uint8_t * restrict color,
+                       const uint8_t * restrict mask, unsigned length)
+{
+    const __m128i value = _mm_set1_epi32((int)load_color(color));
+    const __m128i zero = _mm_setzero_si128();
+    unsigned count = length / 4;
+
+    while (count-- > 0) {
+        __m128i selector = _mm_cvtsi32_si128((int)load_color(mask));
+        selector = _mm_unpacklo_epi16(_mm_unpacklo_epi8(selector, zero), zero);
+        __m128i keep = _mm_cmpeq_epi32(selector, zero);
+        __m128i packed_dst = _mm_loadu_si128((__m128i *)dst);
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(keep, packed_dst),
+                                          _mm_andnot_si128(keep, value)));
+        dst += 4 * 4;
+        mask += 4;
+    }
+    fill_masked_plain(dst, color, mask, length % 4);
+}
+
+void modulate_alpha_sse2(uint8_t * restrict dst, uint8_t alpha, unsigned length)
+{
+    const __m128i scale = _mm_set1_epi32(alpha != 0 ? alpha + 1 : 0);
+    const __m128i colors = _mm_set1_epi32(0x00ffffff);
+    unsigned count = length / 4;
+
+    while (count-- > 0) {
+        __m128i packed_dst = _mm_loadu_si128((__m128i *)dst);
+        /* Alpha times scale fits the low 16 bits of each 32-bit pixel */
+        __m128i alphas = _mm_srli_epi32(_mm_mullo_epi16(_mm_srli_epi32(packed_dst, 24), scale), 8);
+        _mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(packed_dst, colors),
+                                          _mm_slli_epi32(alphas, 24)));
+        dst += 4 * 4;
+    }
+    modulate_alpha_plain(dst, alpha, length % 4);
+}
+
+void lerp_sse2(uint8_t * restrict dst, const uint8_t * restrict src, uint8_t t, unsigned length)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i scale = _mm_set1_epi16(t != 0 ? t + 1 : 0);
+    unsigned count = length / 4;
+
+    while (count-- > 0) {
+        __m128i packed_dst = _mm_loadu_si128((__m128i *)dst);
+        __m128i packed_src = _mm_loadu_si128((const __m128i *)src);
+
+        __m128i final_dst0 = mix_sse2(_mm_unpacklo_epi8(packed_dst, zero),
+                                   _mm_unpacklo_epi8(packed_src, zero), scale);
+        __m128i final_dst1 = mix_sse2(_mm_unpackhi_epi8(packed_dst, zero),
+                                   _mm_unpackhi_epi8(packed_src, zero), scale);
+
+        _mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(final_dst0, final_dst1));
+        dst += 4 * 4;
+        src += 4 * 4;
+    }
+    lerp_plain(dst, src, t, length % 4);
+}
+
+/****************************************************************************/
+/* Frame diff, one mask word per 32 colors */
+
+unsigned diff_plain(const uint8_t * restrict a, const uint8_t * restrict b, unsigned length,
+                    uint32_t * restrict mask);
+
+unsigned diff_sse2(const uint8_t * restrict a, const uint8_t * restrict b, unsigned length,
+                   uint32_t * restrict mask)
+{
+    const __m128i colors = _mm_set1_epi32(0x00ffffff);
+    const __m128i zero = _mm_setzero_si128();
+    unsigned words = length / 32, changed = 0, idx;
+
+    while (words-- > 0) {
+        uint32_t bits = 0;
+        for (idx = 0; idx < 32; idx += 4) {
+            __m128i delta = _mm_xor_si128(_mm_loadu_si128((const __m128i *)a),
+                                          _mm_loadu_si128((const __m128i *)b));
+            __m128i same = _mm_cmpeq_epi32(_mm_and_si128(delta, colors), zero);
+            bits |= (uint32_t)(~_mm_movemask_ps(_mm_castsi128_ps(same)) & 0xf) << idx;
+            a += 16;
+            b += 16;
+        }
+        *mask++ = bits;
+        changed += (unsigned)__builtin_popcount(bits);
+    }
+    return changed + diff_plain(a, b, length % 32, mask);
 }
@@ -20,13 +20,24 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Thread safety:
+ *  - a Keyleds handle must only be used by one thread at a time, different
+ *    handles may be used concurrently from different threads;
+ *  - error state is kept per thread: keyleds_get_errno and keyleds_get_error_str
+ *    report the last error of a call made from the calling thread;
+ *  - g_keyleds_debug_* variables should be set before any thread uses libkeyleds.
+ */
+
 #define LOGITECH_VENDOR_ID  ((uint16_t)0x046d)
 #define KEYLEDS_TARGET_DEFAULT ((uint8_t)0xff)
+#define KEYLEDS_TARGET_PAIRED_MIN ((uint8_t)0x01)   /* device slots behind a receiver */
+#define KEYLEDS_TARGET_PAIRED_MAX ((uint8_t)0x06)
 
 typedef struct keyleds_device Keyleds;
 
@@ -35,12 +46,99 @@ typedef struct keyleds_device Keyleds;
 
 #define KEYLEDS_APP_ID_MIN  ((uint8_t)0x0)
 #define KEYLEDS_APP_ID_MAX  ((uint8_t)0xf)
+#define KEYLEDS_PIPELINE_DEPTH_MAX  (8)
 
 Keyleds * keyleds_open(const char * path, uint8_t app_id);
+Keyleds * keyleds_open_cached(const char * path, uint8_t app_id,
+                              /*@null@*/ const char * cache_dir);  /* persist feature table */
+bool keyleds_cache_mkdir(const char * dir);     /* with missing parents, sets errno on failure */
 void keyleds_close(Keyleds * device);
-void keyleds_set_timeout(Keyleds * device, unsigned us);
-int keyleds_device_fd(Keyleds * device);
-bool keyleds_flush_fd(Keyleds * device);
+bool keyleds_probe(const char * path, uint8_t app_id, unsigned timeout_us,
+                   /*@null@*/ unsigned * version);  /* bounded by timeout, 0 version if no answer */
+void keyleds_set_timeout(Keyleds * device, unsigned us);              /* per call, 0 to disable */
+unsigned keyleds_get_timeout(Keyleds * device);
+void keyleds_set_deadline(Keyleds * device,                             /* CLOCK_MONOTONIC time */
+                          /*@null@*/ const struct timespec * deadline); /* NULL to disable */
+void keyleds_set_pipeline_depth(Keyleds * device, unsigned depth);  /* set_leds window, 1 disables */
+bool keyleds_wait_requests(Keyleds * device, uint8_t target_id);    /* until none in flight */
+int keyleds_device_fd(Keyleds * device);                            /* non-blocking */
+bool keyleds_flush_fd(Keyleds * device);                            /* keeps requests in flight */
+bool keyleds_capture_start(Keyleds * device, const char * path);    /* record all reports */
+void keyleds_capture_stop(Keyleds * device);                        /* replay with replay://path */
+
+struct keyleds_syscall_counts {
+    unsigned long   read;
+    unsigned long   write;
+    unsigned long   poll;
+};
+void keyleds_get_syscall_counts(Keyleds * device,           /* totals since device was opened */
+                                /*@out@*/ struct keyleds_syscall_counts * counts);
+
+/****************************************************************************/
+/* Request statistics
+ *
+ * Opt-in instrumentation of every request sent to the device, tracked per
+ * target, feature and function. Latency runs from the request being written
+ * to its response being read, and is bucketed into a log-linear histogram:
+ * four buckets per power of two, the last one catching everything above.
+ * Recording does not allocate, requests beyond KEYLEDS_STATS_ENTRIES distinct
+ * functions are only counted as untracked. */
+
+#define KEYLEDS_STATS_ENTRIES   (64)
+#define KEYLEDS_STATS_BUCKETS   (64)
+
+struct keyleds_stats_entry {
+    uint8_t         target_id;
+    uint8_t         feature_idx;
+    uint16_t        feature_id;             /* 0 if it could not be resolved */
+    uint8_t         function;
+    unsigned long   requests;               /* requests sent */
+    unsigned long   responses;              /* responses received, including errors */
+    unsigned long   errors;                 /* error responses */
+    unsigned long   timeouts;               /* requests given up on */
+    unsigned long   bytes_sent;
+    unsigned long   bytes_received;
+    unsigned long   latency_total;          /* sum of latencies, in microseconds */
+    unsigned long   latency_max;            /* in microseconds */
+    uint32_t        latency[KEYLEDS_STATS_BUCKETS]; /* responses by latency bucket */
+};
+
+struct keyleds_stats {
+    unsigned long   discarded;              /* unrelated reports read and dropped */
+    unsigned long   untracked;              /* requests sent while table was full */
+    unsigned        length;
+    struct keyleds_stats_entry entries[KEYLEDS_STATS_ENTRIES];
+};
+
+bool keyleds_stats_enable(Keyleds * device, bool enable);       /* resets statistics */
+bool keyleds_get_stats(Keyleds * device, /*@out@*/ struct keyleds_stats * stats);
+unsigned long keyleds_stats_bucket_limit(unsigned bucket);      /* upper bound, microseconds */
+
+/****************************************************************************/
+/* Asynchronous requests
+ *
+ * Submitted requests complete when keyleds_process_events() reads their
+ * response, typically after keyleds_device_fd() polls readable. At most
+ * KEYLEDS_PIPELINE_DEPTH_MAX requests can be in flight, further submissions
+ * fail with errno set to EAGAIN. Synchronous calls first wait for pending
+ * requests to the same target, invoking their callbacks; requests to other
+ * targets stay in flight, and keyleds_flush_fd() completes those whose
+ * response it reads. If communication with the device fails, all pending
+ * requests are failed through their callbacks with the error that caused it.
+ * Requests still unanswered after the call timeout fail with
+ * KEYLEDS_ERROR_TIMEDOUT in the next keyleds_process_events(). */
+
+typedef unsigned keyleds_request_t;         /* 0 is never a valid request */
+typedef void (*keyleds_completion_cb)(Keyleds * device, keyleds_request_t request,
+                                      bool success, /* on failure, check keyleds_get_errno() */
+                                      const uint8_t * data, size_t length, void * userdata);
+
+keyleds_request_t keyleds_submit(Keyleds * device, uint8_t target_id, uint16_t feature_id,
+                                 uint8_t function, size_t length, const uint8_t * data,
+                                 /*@null@*/ keyleds_completion_cb callback,
+                                 /*@null@*/ void * userdata);
+int keyleds_process_events(Keyleds * device);     /* returns completed requests, -1 on error */
+unsigned keyleds_pending_requests(Keyleds * device);
 
 /****************************************************************************/
 /* Basic device communication */
@@ -55,9 +153,13 @@ typedef enum {
 bool keyleds_get_protocol(Keyleds * device, uint8_t target_id,
                           unsigned * version, keyleds_device_handler_t * handler);
 bool keyleds_ping(Keyleds * device, uint8_t target_id); /* re-sync with device after error */
+unsigned keyleds_get_targets(Keyleds * device, /*@out@*/ uint8_t * targets,
+                             unsigned max);         /* HID++ 2.0 targets reachable through device */
 unsigned keyleds_get_feature_count(Keyleds * dev, uint8_t target_id);
 uint16_t keyleds_get_feature_id(Keyleds * dev, uint8_t target_id, uint8_t feature_idx);
 uint8_t keyleds_get_feature_index(Keyleds * dev, uint8_t target_id, uint16_t feature_id);
+unsigned keyleds_get_feature_ids(Keyleds * dev, uint8_t target_id,
+                                 /*@out@*/ uint16_t * ids, unsigned max); /* ids[0] is index 1 */
 
 /****************************************************************************/
 /* Device information */
@@ -164,8 +266,18 @@ bool keyleds_get_block_info(Keyleds * device, uint8_t target_id,
 void keyleds_free_block_info(/*@only@*/ /*@out@*/ struct keyleds_keyblocks_info * info);
 bool keyleds_get_leds(Keyleds * device, uint8_t target_id, keyleds_block_id_t block_id,
                       struct keyleds_key_color * keys, uint16_t offset, unsigned keys_nb);
+
+struct keyleds_leds_query {
+    keyleds_block_id_t block_id;
+    uint16_t    offset;         /* index of first key to read in block */
+    unsigned    keys_nb;        /* number of keys to read */
+    struct keyleds_key_color * keys;    /* receives keys_nb entries */
+};
+bool keyleds_get_leds_batch(Keyleds * device, uint8_t target_id,
+                            struct keyleds_leds_query * queries, unsigned queries_nb);
 bool keyleds_set_leds(Keyleds * device, uint8_t target_id, keyleds_block_id_t block_id,
                       const struct keyleds_key_color * keys, unsigned keys_nb);
+unsigned keyleds_leds_per_report(Keyleds * device);     /* keys sent per set_leds report */
 bool keyleds_set_led_block(Keyleds * device, uint8_t target_id, keyleds_block_id_t block_id,
                            uint8_t red, uint8_t green, uint8_t blue);
 bool keyleds_commit_leds(Keyleds * device, uint8_t target_id);
@@ -0,0 +1,53 @@
+/* Keyleds -- Gaming keyboard tool
+ * Copyright (C) 2017 Julien Hartmann, juli1.hartmann@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KEYLEDS_CAPTURE_H
+#define KEYLEDS_CAPTURE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct keyleds_device;
+struct keyleds_device_reports;
+
+#define KEYLEDS_REPLAY_PREFIX   "replay://"
+#define KEYLEDS_CAPTURE_ENV     "KEYLEDS_CAPTURE_DIR"   /* capture all devices from open */
+
+/* Capture file format, all integers little-endian:
+ *   header:    8 bytes magic "KLDSCAP1"
+ *              1 byte number of report types N
+ *              N times: 1 byte report id, 1 byte report size (without id)
+ *   records:   4 bytes microseconds elapsed since previous record
+ *              1 byte direction (KEYLEDS_CAPTURE_*)
+ *              report, including report id, size given by header
+ */
+#define KEYLEDS_CAPTURE_MAGIC   "KLDSCAP1"
+#define KEYLEDS_CAPTURE_SENT        (0)
+#define KEYLEDS_CAPTURE_RECEIVED    (1)
+
+void keyleds_capture_from_env(struct keyleds_device * device, const char * device_path);
+void keyleds_capture_report(struct keyleds_device * device, unsigned direction,
+                            const uint8_t * report, size_t size);
+
+/* Path format: replay://<capture file>[?fast]
+ * Responses are sent with their original delay after the request that
+ * preceded them, or immediately if fast is given. */
+bool keyleds_replay_match(const char * path);
+int keyleds_replay_open(const char * path, struct keyleds_device_reports ** reports,
+                        unsigned * max_report_size);
+
+#endif
@@ -17,7 +17,14 @@
 #ifndef KEYLEDS_DEVICE_H
 #define KEYLEDS_DEVICE_H
 
+#include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "keyleds/error.h"
+
+struct keyleds_stats_state;
 
 struct keyleds_device_reports {
     uint8_t     id;
@@ -25,25 +32,70 @@ struct keyleds_device_reports {
 };
 #define DEVICE_REPORT_INVALID   (0xff)
 
-struct keyleds_device_feature {
+#define KEYLEDS_FEATURE_SLOTS   (256)           /* max feature index is 255 */
+#define KEYLEDS_FEATURE_FLAG_RESERVED   (1<<5)
+#define KEYLEDS_FEATURE_FLAG_HIDDEN     (1<<6)
+#define KEYLEDS_FEATURE_FLAG_OBSOLETE   (1<<7)
+
+struct keyleds_feature_table {
+    uint8_t     target_id;
+    bool        complete;                       /* all features known, misses are final */
+    unsigned    count;                          /* number of features, excluding root */
+    uint16_t    ids[KEYLEDS_FEATURE_SLOTS];     /* feature id by index, 0 if unknown */
+    uint8_t     flags[KEYLEDS_FEATURE_SLOTS];   /* feature flags by index */
+    uint8_t     buckets[KEYLEDS_FEATURE_SLOTS]; /* hashed feature id to index, 0 if empty */
+};
+
+struct keyleds_feature_cache {
+    const char * dir;                           /* cache directory */
+    char        path[PATH_MAX];                 /* feature table file for the device model */
+    char        firmware[256];                  /* firmware versions the table is valid for */
+};
+
+struct keyleds_pending_request {
     uint8_t     target_id;
-    uint16_t    id;
-    uint8_t     index;
-    bool        reserved;
-    bool        hidden;
-    bool        obsolete;
+    uint8_t     feature_idx;
+    uint8_t     function;
+    uint8_t     sw_id;                          /* software id the request was tagged with */
+    keyleds_request_t handle;                   /* 0 for internal pipelined requests */
+    keyleds_completion_cb callback;
+    void *      userdata;
+    struct timespec sent;                       /* when request was written, if recording stats */
+    bool        has_expiry;                     /* asynchronous requests only */
+    struct timespec expiry;                     /* when to give up on the response */
 };
 
 struct keyleds_device {
     int         fd;                             /* device file descriptor */
     uint8_t     app_id;                         /* our application identifier */
     uint8_t     ping_seq;                       /* using for resyncing after errors */
+    bool        receiver;                       /* targets are paired devices, not the default */
     unsigned    timeout;                        /* read timeout in microseconds */
+    bool        has_deadline;                   /* whether deadline is set */
+    struct timespec deadline;                   /* absolute CLOCK_MONOTONIC call deadline */
 
     struct keyleds_device_reports * reports;    /* list of device-supported hid reports */
     unsigned    max_report_size;                /* maximum number of bytes in a report */
 
-    struct keyleds_device_feature * features;   /* feature index cache */
+    struct keyleds_feature_table * feature_tables;  /* feature index cache, one per target */
+    unsigned    feature_tables_nb;
+
+    unsigned    pipeline_depth;                 /* max number of requests kept in flight */
+    uint8_t     next_sw_id;                     /* next software id for pipelined requests */
+    keyleds_request_t next_handle;              /* next handle for asynchronous requests */
+    unsigned    pending_nb;                     /* number of requests currently in flight */
+    struct keyleds_pending_request pending[KEYLEDS_PIPELINE_DEPTH_MAX];  /* oldest first */
+    struct keyleds_error_state target_errors[KEYLEDS_TARGET_PAIRED_MAX + 1];
+                                                /* pipelined failures collected by a caller
+                                                 * busy with another target, by target slot */
+
+    uint8_t *   out_buffer;                     /* report being sent, zeroed past out_length */
+    size_t      out_length;                     /* payload length of last report sent */
+    struct keyleds_syscall_counts syscalls;     /* I/O system calls made on fd */
+    /*@null@*/ struct keyleds_stats_state * stats;  /* request statistics, if enabled */
+
+    /*@null@*/ FILE * capture;                  /* traffic capture file, if capturing */
+    struct timespec capture_last;               /* time of last captured report */
 };
 
 /****************************************************************************/
@@ -53,10 +105,37 @@ bool keyleds_send(Keyleds * device, uint8_t target_id, uint8_t feature_idx,
                   uint8_t function, size_t length, const uint8_t * data);
 bool keyleds_receive(Keyleds * device, uint8_t target_id, uint8_t feature_idx,
                      uint8_t * message, size_t * size);
+bool keyleds_send_tagged(Keyleds * device, uint8_t target_id, uint8_t feature_idx,
+                         uint8_t function, uint8_t sw_id, size_t length, const uint8_t * data);
 int keyleds_call(Keyleds * device, /*@null@*/ /*@out@*/ uint8_t * result, size_t result_len,
                  uint8_t target_id, uint16_t feature_id, uint8_t function,
                  size_t length, const uint8_t * data);
 
+/****************************************************************************/
+/* Pipelined requests */
+
+bool keyleds_pipeline_submit(Keyleds * device, uint8_t target_id, uint8_t feature_idx,
+                             uint8_t function, size_t length, const uint8_t * data,
+                             keyleds_request_t handle, keyleds_completion_cb callback,
+                             void * userdata);
+unsigned keyleds_pipeline_pending(const Keyleds * device, uint8_t target_id);
+bool keyleds_pipeline_wait(Keyleds * device, uint8_t target_id, unsigned max_pending);
+bool keyleds_pipeline_drain(Keyleds * device, uint8_t target_id);
+void keyleds_pipeline_abort(Keyleds * device,    /* fail all with current error */
+                            int owner_id);      /* target told about it, -1 if none */
+
+/****************************************************************************/
+/* Feature table */
+
+bool keyleds_discover_features(Keyleds * device, uint8_t target_id);
+bool keyleds_feature_cache_key(Keyleds * device, uint8_t target_id, const char * cache_dir,
+                               struct keyleds_feature_cache * cache);
+bool keyleds_load_features(Keyleds * device, uint8_t target_id,
+                           const struct keyleds_feature_cache * cache);
+bool keyleds_save_features(Keyleds * device, uint8_t target_id,
+                           const struct keyleds_feature_cache * cache);
+void keyleds_free_features(Keyleds * device);
+
 /****************************************************************************/
 /* Helpers */
 
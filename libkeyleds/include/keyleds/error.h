@@ -18,9 +18,17 @@
 #define KEYLEDS_ERROR_H
 
 const char * keyleds_get_error_str();
+const char * keyleds_strerror(int errnum);      /* thread-safe strerror */
 
 void keyleds_set_error_errno();
 void keyleds_set_error_hidpp(uint8_t code);
 void keyleds_set_error(keyleds_error_t err);
 
+struct keyleds_error_state {                    /* an error, set aside for later */
+    keyleds_error_t error;
+    int         detail;                         /* errno or device error code */
+};
+void keyleds_save_error(/*@out@*/ struct keyleds_error_state * state);
+void keyleds_restore_error(const struct keyleds_error_state * state);
+
 #endif
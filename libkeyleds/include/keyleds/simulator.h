@@ -0,0 +1,40 @@
+/* Keyleds -- Gaming keyboard tool
+ * Copyright (C) 2017 Julien Hartmann, juli1.hartmann@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KEYLEDS_SIMULATOR_H
+#define KEYLEDS_SIMULATOR_H
+
+#include <stdbool.h>
+
+struct keyleds_device_reports;
+
+#define KEYLEDS_SIM_PREFIX  "sim://"
+
+/* Path format: sim://<model>[?option=value[&option=value...]]
+ *   model:     g410, g610, g810, g910 or a 12-digit hex model code
+ *   options:   latency=<us>    delay before each response is sent
+ *              jitter=<us>     random variation of latency, in both directions
+ *              layout=<n>      layout code reported by the device
+ *              layouts=<dir>   where to look for layout description files
+ *              seed=<n>        seed for jitter generation
+ *              paired=<n>      act as a receiver with n identical devices paired,
+ *                              at targets 1 to n; they share their state
+ */
+bool keyleds_sim_match(const char * path);
+int keyleds_sim_open(const char * path, struct keyleds_device_reports ** reports,
+                     unsigned * max_report_size);
+
+#endif
@@ -0,0 +1,45 @@
+/* Keyleds -- Gaming keyboard tool
+ * Copyright (C) 2017 Julien Hartmann, juli1.hartmann@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef KEYLEDS_STATS_H
+#define KEYLEDS_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include "keyleds.h"
+
+struct keyleds_device;
+
+struct keyleds_stats_state {
+    struct keyleds_stats    stats;          /* what keyleds_get_stats returns, but feature ids */
+    struct timespec         last_sent;      /* when last request was written */
+    uint8_t                 last_function;  /* function of last request, for sync timeouts */
+};
+
+/* Callers check device->stats is not NULL first, so disabled statistics cost
+ * nothing but that test */
+void keyleds_stats_sent(struct keyleds_device * device, uint8_t target_id,
+                        uint8_t feature_idx, uint8_t function, size_t size);
+void keyleds_stats_received(struct keyleds_device * device, uint8_t target_id,
+                            uint8_t feature_idx, uint8_t function,
+                            const struct timespec * sent, size_t size, bool error);
+void keyleds_stats_timeout(struct keyleds_device * device, uint8_t target_id,
+                           uint8_t feature_idx, uint8_t function);
+void keyleds_stats_discarded(struct keyleds_device * device);
+
+#endif
@@ -0,0 +1,439 @@
+/* Keyleds -- Gaming keyboard tool
+ * Copyright (C) 2017 Julien Hartmann, juli1.hartmann@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#define _GNU_SOURCE /* for ppoll */
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "keyleds.h"
+#include "keyleds/capture.h"
+#include "keyleds/device.h"
+#include "keyleds/error.h"
+#include "keyleds/logging.h"
+
+#define CAPTURE_MAGIC_LENGTH    (sizeof(KEYLEDS_CAPTURE_MAGIC) - 1)
+#define CAPTURE_MAX_REPORTS     (16)
+#define CAPTURE_MAX_REPORT_SIZE (255)
+#define REPLAY_HISTORY          (16)    /* requests remembered to patch responses */
+
+/****************************************************************************/
+/* Capture */
+
+static bool capture_write_header(FILE * file, const struct keyleds_device_reports * reports)
+{
+    unsigned count = 0, idx;
+
+    while (reports[count].id != DEVICE_REPORT_INVALID) { count += 1; }
+    if (count > CAPTURE_MAX_REPORTS) { count = CAPTURE_MAX_REPORTS; }
+
+    if (fwrite(KEYLEDS_CAPTURE_MAGIC, CAPTURE_MAGIC_LENGTH, 1, file) != 1) { return false; }
+    if (fputc((int)count, file) == EOF) { return false; }
+    for (idx = 0; idx < count; idx += 1) {
+        if (fputc(reports[idx].id, file) == EOF) { return false; }
+        if (fputc(reports[idx].size, file) == EOF) { return false; }
+    }
+    return true;
+}
+
+KEYLEDS_EXPORT bool keyleds_capture_start(Keyleds * device, const char * path)
+{
+    FILE * file;
+
+    assert(device != NULL);
+    assert(path != NULL);
+
+    keyleds_capture_stop(device);
+    if ((file = fopen(path, "wbe")) == NULL) {
+        keyleds_set_error_errno();
+        return false;
+    }
+    if (!capture_write_header(file, device->reports)) {
+        keyleds_set_error_errno();
+        fclose(file);
+        return false;
+    }
+    device->capture = file;
+    clock_gettime(CLOCK_MONOTONIC, &device->capture_last);
+    KEYLEDS_LOG(INFO, "Capturing traffic on fd %d to %s", device->fd, path);
+    return true;
+}
+
+KEYLEDS_EXPORT void keyleds_capture_stop(Keyleds * device)
+{
+    assert(device != NULL);
+    if (device->capture == NULL) { return; }
+    if (fclose(device->capture) != 0) {
+        KEYLEDS_LOG(WARNING, "Capture on fd %d could not be completed: %s",
+                    device->fd, keyleds_strerror(errno));
+    }
+    device->capture = NULL;
+}
+
+/* Start capturing if the environment asks for it. Capture file is named after
+ * the device path, so several devices can be captured at once. */
+void keyleds_capture_from_env(Keyleds * device, const char * device_path)
+{
+    const char * dir = getenv(KEYLEDS_CAPTURE_ENV);
+    const char * name;
+    char path[PATH_MAX];
+    int length;
+
+    if (dir == NULL || dir[0] == '\0') { return; }
+
+    name = strrchr(device_path, '/');
+    name = name != NULL && name[1] != '\0' ? name + 1 : device_path;
+    length = snprintf(path, sizeof(path), "%s/", dir);
+    for (; *name != '\0' && length < (int)sizeof(path) - 6; name += 1) {
+        path[length++] = isalnum((unsigned char)*name) ? *name : '_';
+    }
+    strcpy(path + length, ".kcap");
+
+    if (!keyleds_capture_start(device, path)) {
+        KEYLEDS_LOG(WARNING, "Cannot capture to %s: %s", path, keyleds_get_error_str());
+    }
+}
+
+/* Append a report to capture file. Failures stop the capture, so a full disk
+ * does not break device communication. */
+void keyleds_capture_report(Keyleds * device, unsigned direction,
+                            const uint8_t * report, size_t size)
+{
+    struct timespec now;
+    int64_t elapsed;
+    uint8_t header[5];
+
+    assert(device != NULL);
+    assert(device->capture != NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = ((int64_t)(now.tv_sec - device->capture_last.tv_sec) * 1000000000
+               + (now.tv_nsec - device->capture_last.tv_nsec)) / 1000;
+    if (elapsed > UINT32_MAX) {
+        elapsed = UINT32_MAX;
+        device->capture_last = now;
+    } else {
+        /* Only advance by whole microseconds, so rounding errors do not accumulate */
+        device->capture_last.tv_sec += (time_t)(elapsed / 1000000);
+        device->capture_last.tv_nsec += (long)(elapsed % 1000000) * 1000;
+        if (device->capture_last.tv_nsec >= 1000000000) {
+            device->capture_last.tv_sec += 1;
+            device->capture_last.tv_nsec -= 1000000000;
+        }
+    }
+
+    header[0] = (uint8_t)elapsed;
+    header[1] = (uint8_t)(elapsed >> 8);
+    header[2] = (uint8_t)(elapsed >> 16);
+    header[3] = (uint8_t)(elapsed >> 24);
+    header[4] = (uint8_t)direction;
+    if (fwrite(header, sizeof(header), 1, device->capture) != 1 ||
+        fwrite(report, size, 1, device->capture) != 1) {
+        KEYLEDS_LOG(WARNING, "Capture on fd %d failed: %s", device->fd, keyleds_strerror(errno));
+        fclose(device->capture);
+        device->capture = NULL;
+    }
+}
+
+/****************************************************************************/
+/* Replay */
+
+struct replay_record {
+    uint32_t    elapsed;                /* microseconds since previous record */
+    uint8_t     direction;
+    uint8_t     data[1 + CAPTURE_MAX_REPORT_SIZE];
+    unsigned    size;
+};
+
+struct replay_request {
+    uint8_t     recorded[4];            /* report id, target, feature, function|sw_id */
+    uint8_t     actual[7];              /* same, plus ping parameters */
+};
+
+struct replay_device {
+    FILE *      file;
+    int         fd;
+    bool        fast;                   /* send responses without delay */
+    struct keyleds_device_reports reports[CAPTURE_MAX_REPORTS + 1];
+
+    struct replay_request history[REPLAY_HISTORY];
+    unsigned    history_first;
+    unsigned    history_nb;
+    unsigned    mismatches;
+};
+
+bool keyleds_replay_match(const char * path)
+{
+    return strncmp(path, KEYLEDS_REPLAY_PREFIX, strlen(KEYLEDS_REPLAY_PREFIX)) == 0;
+}
+
+static bool replay_read_header(struct replay_device * replay)
+{
+    char magic[CAPTURE_MAGIC_LENGTH];
+    int count, idx, value;
+
+    if (fread(magic, sizeof(magic), 1, replay->file) != 1 ||
+        memcmp(magic, KEYLEDS_CAPTURE_MAGIC, sizeof(magic)) != 0) { return false; }
+    if ((count = fgetc(replay->file)) == EOF || count > CAPTURE_MAX_REPORTS) { return false; }
+    for (idx = 0; idx < count; idx += 1) {
+        if ((value = fgetc(replay->file)) == EOF) { return false; }
+        replay->reports[idx].id = (uint8_t)value;
+        if ((value = fgetc(replay->file)) == EOF || value == 0) { return false; }
+        replay->reports[idx].size = (uint8_t)value;
+    }
+    replay->reports[count].id = DEVICE_REPORT_INVALID;
+    replay->reports[count].size = 0;
+    return count > 0;
+}
+
+/* Returns 1 on success, 0 on clean end of capture, -1 on truncated or corrupt data */
+static int replay_read_record(struct replay_device * replay, struct replay_record * record)
+{
+    uint8_t header[6];
+    unsigned idx;
+    int first;
+
+    if ((first = fgetc(replay->file)) == EOF) { return ferror(replay->file) ? -1 : 0; }
+    header[0] = (uint8_t)first;
+    if (fread(&header[1], sizeof(header) - 1, 1, replay->file) != 1) { return -1; }
+    record->elapsed = (uint32_t)header[0] | (uint32_t)header[1] << 8
+                    | (uint32_t)header[2] << 16 | (uint32_t)header[3] << 24;
+    record->direction = header[4];
+    record->data[0] = header[5];
+
+    for (idx = 0; replay->reports[idx].id != DEVICE_REPORT_INVALID; idx += 1) {
+        if (replay->reports[idx].id == record->data[0]) { break; }
+    }
+    if (replay->reports[idx].id == DEVICE_REPORT_INVALID) { return -1; }
+    record->size = 1 + replay->reports[idx].size;
+    if (fread(&record->data[1], record->size - 1, 1, replay->file) != 1) { return -1; }
+    return 1;
+}
+
+/* Remember how the client actually phrased a recorded request */
+static void replay_remember(struct replay_device * replay, const struct replay_record * record,
+                            const uint8_t * actual, size_t size)
+{
+    struct replay_request * request;
+
+    if (replay->history_nb == REPLAY_HISTORY) {
+        replay->history_first = (replay->history_first + 1) % REPLAY_HISTORY;
+        replay->history_nb -= 1;
+    }
+    request = &replay->history[(replay->history_first + replay->history_nb) % REPLAY_HISTORY];
+    memcpy(request->recorded, record->data, sizeof(request->recorded));
+    memset(request->actual, 0, sizeof(request->actual));
+    memcpy(request->actual, actual, size < sizeof(request->actual) ? size : sizeof(request->actual));
+    replay->history_nb += 1;
+}
+
+/* Responses echo some request fields that legitimately vary between runs:
+ * software id, and the random ping sequence. Patch them to match what the
+ * client sent this time. */
+static void replay_patch_response(struct replay_device * replay, struct replay_record * record)
+{
+    const bool is_error = record->data[2] == 0xff;
+    const uint8_t * header = is_error ? &record->data[3] : &record->data[2];
+    unsigned idx;
+
+    for (idx = replay->history_nb; idx > 0; idx -= 1) {
+        struct replay_request * request =
+            &replay->history[(replay->history_first + idx - 1) % REPLAY_HISTORY];
+        if (request->recorded[1] != record->data[1] ||
+            request->recorded[2] != header[0] ||
+            request->recorded[3] != header[1]) { continue; }
+
+        record->data[is_error ? 4 : 3] = request->actual[3];
+        if (!is_error && request->recorded[2] == 0 && (request->recorded[3] >> 4) == 1) {
+            record->data[6] = request->actual[6];   /* root feature, ping */
+        }
+        return;
+    }
+}
+
+/* Compare requests, ignoring fields that legitimately vary between runs */
+static bool replay_same_request(const struct replay_record * record,
+                                const uint8_t * report, size_t size)
+{
+    const bool is_ping = record->data[2] == 0 && (record->data[3] >> 4) == 1;
+    size_t idx;
+
+    if (size != record->size || size < 4) { return false; }
+    if (memcmp(report, record->data, 3) != 0) { return false; }
+    if ((report[3] >> 4) != (record->data[3] >> 4)) { return false; }
+    for (idx = 4; idx < size; idx += 1) {
+        if (report[idx] != record->data[idx] && !(is_ping && idx == 6)) { return false; }
+    }
+    return true;
+}
+
+static void replay_timespec_add(struct timespec * ts, uint64_t us)
+{
+    ts->tv_sec += (time_t)(us / 1000000);
+    ts->tv_nsec += (long)(us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000) { ts->tv_sec += 1; ts->tv_nsec -= 1000000000; }
+}
+
+static void * replay_thread(void * arg)
+{
+    struct replay_device * replay = arg;
+    struct replay_record record;
+    uint8_t report[1 + CAPTURE_MAX_REPORT_SIZE + 1];
+    struct timespec anchor;             /* when the client sent last request */
+    uint64_t since_anchor = 0;          /* capture time elapsed since last request */
+    unsigned records = 0;
+    ssize_t nread;
+    int ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &anchor);
+
+    while ((ret = replay_read_record(replay, &record)) > 0) {
+        records += 1;
+        since_anchor += record.elapsed;
+
+        if (record.direction == KEYLEDS_CAPTURE_SENT) {
+            if ((nread = recv(replay->fd, report, sizeof(report), 0)) <= 0) { goto exit; }
+            if (!replay_same_request(&record, report, (size_t)nread)) {
+                replay->mismatches += 1;
+                KEYLEDS_LOG(DEBUG, "Replay: request %u differs from capture", records);
+            }
+            replay_remember(replay, &record, report, (size_t)nread);
+            clock_gettime(CLOCK_MONOTONIC, &anchor);
+            since_anchor = 0;
+        } else {
+            if (!replay->fast && since_anchor > 0) {
+                struct timespec due = anchor;
+                replay_timespec_add(&due, since_anchor);
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {}
+            }
+            replay_patch_response(replay, &record);
+            if (send(replay->fd, record.data, record.size, MSG_NOSIGNAL) < 0) { goto exit; }
+        }
+    }
+    if (ret < 0) {
+        KEYLEDS_LOG(WARNING, "Replay: capture is corrupt after %u records", records);
+    }
+    KEYLEDS_LOG(INFO, "Replay: end of capture, %u records, %u mismatched requests",
+                records, replay->mismatches);
+
+    /* Device stops answering, as an unplugged one would. Wait for client to leave. */
+    while ((nread = recv(replay->fd, report, sizeof(report), 0)) > 0) {}
+
+exit:
+    KEYLEDS_LOG(DEBUG, "replay thread exiting");
+    fclose(replay->file);
+    close(replay->fd);
+    free(replay);
+    return NULL;
+}
+
+int keyleds_replay_open(const char * path, struct keyleds_device_reports ** reports,
+                        unsigned * max_report_size)
+{
+    char file_path[PATH_MAX];
+    struct replay_device * replay;
+    const char * options;
+    pthread_attr_t attr;
+    pthread_t thread;
+    unsigned idx;
+    size_t length;
+    int fds[2];
+
+    assert(path != NULL);
+    assert(reports != NULL);
+    assert(max_report_size != NULL);
+
+    if ((replay = calloc(1, sizeof(*replay))) == NULL) {
+        keyleds_set_error_errno();
+        return -1;
+    }
+
+    path += strlen(KEYLEDS_REPLAY_PREFIX);
+    options = strchr(path, '?');
+    length = options != NULL ? (size_t)(options - path) : strlen(path);
+    if (length == 0 || length >= sizeof(file_path) ||
+        (options != NULL && strcmp(options, "?fast") != 0)) {
+        KEYLEDS_LOG(ERROR, "Invalid replay specification %s", path);
+        errno = EINVAL;
+        keyleds_set_error_errno();
+        goto error_free_replay;
+    }
+    memcpy(file_path, path, length);
+    file_path[length] = '\0';
+    replay->fast = options != NULL;
+
+    if ((replay->file = fopen(file_path, "rbe")) == NULL) {
+        keyleds_set_error_errno();
+        goto error_free_replay;
+    }
+    if (!replay_read_header(replay)) {
+        KEYLEDS_LOG(ERROR, "%s is not a keyleds capture", file_path);
+        keyleds_set_error(KEYLEDS_ERROR_HIDREPORT);
+        goto error_close_file;
+    }
+
+    if ((*reports = malloc(sizeof(replay->reports))) == NULL) {
+        keyleds_set_error_errno();
+        goto error_close_file;
+    }
+    memcpy(*reports, replay->reports, sizeof(replay->reports));
+    *max_report_size = 0;
+    for (idx = 0; replay->reports[idx].id != DEVICE_REPORT_INVALID; idx += 1) {
+        if (replay->reports[idx].size > *max_report_size) {
+            *max_report_size = replay->reports[idx].size;
+        }
+    }
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        keyleds_set_error_errno();
+        goto error_free_reports;
+    }
+    replay->fd = fds[1];
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    errno = pthread_create(&thread, &attr, replay_thread, replay);
+    pthread_attr_destroy(&attr);
+    if (errno != 0) {
+        keyleds_set_error_errno();
+        goto error_close_fds;
+    }
+
+    KEYLEDS_LOG(INFO, "Replaying %s%s", file_path, replay->fast ? " (fast)" : "");
+    return fds[0];
+
+error_close_fds:
+    close(fds[0]);
+    close(fds[1]);
+error_free_reports:
+    free(*reports);
+error_close_file:
+    fclose(replay->file);
+error_free_replay:
+    free(replay);
+    return -1;
+}
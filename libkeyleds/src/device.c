@@ -14,100 +14,223 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE     /* for ppoll */
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <linux/hidraw.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 
 #include "config.h"
 #include "keyleds.h"
+#include "keyleds/capture.h"
 #include "keyleds/device.h"
 #include "keyleds/error.h"
 #include "keyleds/features.h"
 #include "keyleds/hid_parser.h"
 #include "keyleds/logging.h"
+#include "keyleds/simulator.h"
+#include "keyleds/stats.h"
 
 
 KEYLEDS_EXPORT Keyleds * keyleds_open(const char * path, uint8_t app_id)
+{
+    return keyleds_open_cached(path, app_id, NULL);
+}
+
+/* Opens the transport and checks it speaks HID++, without any I/O */
+static Keyleds * device_new(const char * path, uint8_t app_id)
 {
     Keyleds * dev = malloc(sizeof(Keyleds));
     struct hidraw_report_descriptor descriptor;
-    unsigned version;
+    struct timespec now;
+
+    /* Ping sequence only needs to vary between runs. Not using rand(), which
+     * is not thread-safe. */
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
     dev->app_id = app_id;
-    do { dev->ping_seq = rand(); } while (dev->ping_seq == 0);
+    dev->ping_seq = (uint8_t)(now.tv_nsec / 1000);
+    if (dev->ping_seq == 0) { dev->ping_seq = 1; }
+    dev->receiver = false;
     dev->timeout = KEYLEDS_CALL_TIMEOUT_US;
+    dev->has_deadline = false;
+    dev->pipeline_depth = 1;
+    dev->next_sw_id = 1;
+    dev->next_handle = 1;
+    dev->pending_nb = 0;
+    memset(dev->target_errors, 0, sizeof(dev->target_errors));
+    dev->feature_tables = NULL;
+    dev->feature_tables_nb = 0;
+    dev->capture = NULL;
+    dev->out_buffer = NULL;
+    dev->out_length = 0;
+    memset(&dev->syscalls, 0, sizeof(dev->syscalls));
+    dev->stats = NULL;
+
+    if (keyleds_sim_match(path)) {
+        /* Simulated device, it comes with its own report list */
+        if ((dev->fd = keyleds_sim_open(path, &dev->reports, &dev->max_report_size)) < 0) {
+            goto error_free_dev;
+        }
+    } else if (keyleds_replay_match(path)) {
+        /* Replayed capture, report list is stored in it */
+        if ((dev->fd = keyleds_replay_open(path, &dev->reports, &dev->max_report_size)) < 0) {
+            goto error_free_dev;
+        }
+    } else {
+        /* Open device */
+        KEYLEDS_LOG(DEBUG, "Opening device %s", path);
+        if ((dev->fd = open(path, O_RDWR | O_CLOEXEC)) < 0) {
+            keyleds_set_error_errno();
+            goto error_free_dev;
+        }
 
-    /* Open device */
-    KEYLEDS_LOG(DEBUG, "Opening device %s", path);
-    if ((dev->fd = open(path, O_RDWR)) < 0) {
-        keyleds_set_error_errno();
-        goto error_free_dev;
-    }
-    fcntl(dev->fd, F_SETFD, FD_CLOEXEC);
+        /* Read REPORT descriptor */
+        if (ioctl(dev->fd, HIDIOCGRDESCSIZE, &descriptor.size) < 0) {
+            keyleds_set_error_errno();
+            goto error_close_fd;
+        }
+        if (ioctl(dev->fd, HIDIOCGRDESC, &descriptor) < 0) {
+            keyleds_set_error_errno();
+            goto error_close_fd;
+        }
+        KEYLEDS_LOG(DEBUG, "Parsing report descriptor (%d bytes)", descriptor.size);
 
-    /* Read REPORT descriptor */
-    if (ioctl(dev->fd, HIDIOCGRDESCSIZE, &descriptor.size) < 0) {
-        keyleds_set_error_errno();
-        goto error_close_fd;
-    }
-    if (ioctl(dev->fd, HIDIOCGRDESC, &descriptor) < 0) {
-        keyleds_set_error_errno();
-        goto error_close_fd;
+        /* Parse report descriptor */
+        if (!keyleds_parse_hid(descriptor.value, descriptor.size,
+                               &dev->reports, &dev->max_report_size)) {
+            keyleds_set_error(KEYLEDS_ERROR_HIDREPORT);
+            goto error_close_fd;
+        }
+        if (dev->max_report_size == 0) {
+            keyleds_set_error(KEYLEDS_ERROR_HIDNOPP);
+            goto error_free_reports;
+        }
     }
-    KEYLEDS_LOG(DEBUG, "Parsing report descriptor (%d bytes)", descriptor.size);
 
-    /* Parse report descriptor */
-    if (!keyleds_parse_hid(descriptor.value, descriptor.size,
-                           &dev->reports, &dev->max_report_size)) {
-        keyleds_set_error(KEYLEDS_ERROR_HIDREPORT);
-        goto error_close_fd;
-    }
-    if (dev->max_report_size == 0) {
-        keyleds_set_error(KEYLEDS_ERROR_HIDNOPP);
+    /* Non-blocking for good: waits are done with poll, and stale input can be
+     * drained without toggling flags around it */
+    if (fcntl(dev->fd, F_SETFL, fcntl(dev->fd, F_GETFL) | O_NONBLOCK) < 0 ||
+        (dev->out_buffer = calloc(1, 1 + dev->max_report_size)) == NULL) {
+        keyleds_set_error_errno();
         goto error_free_reports;
     }
+    return dev;
+
+error_free_reports:
+    free(dev->out_buffer);
+    free(dev->reports);
+error_close_fd:
+    close(dev->fd);
+error_free_dev:
+    free(dev);
+    return NULL;
+}
+
+KEYLEDS_EXPORT Keyleds * keyleds_open_cached(const char * path, uint8_t app_id,
+                                             const char * cache_dir)
+{
+    Keyleds * dev;
+    uint8_t targets[KEYLEDS_TARGET_PAIRED_MAX - KEYLEDS_TARGET_PAIRED_MIN + 1];
+    unsigned version, targets_nb, idx;
+
+    if ((dev = device_new(path, app_id)) == NULL) { return NULL; }
+    keyleds_capture_from_env(dev, path);
 
     if (!keyleds_get_protocol(dev, KEYLEDS_TARGET_DEFAULT, &version, NULL)) {
-        goto error_free_reports;
+        goto error_close;
     }
 
-    if (version < 2) {
-        keyleds_set_error(KEYLEDS_ERROR_HIDVERSION);
-        goto error_free_reports;
+    /* A HID++ 1.0 device may be a receiver with HID++ 2.0 devices paired to it */
+    dev->receiver = version < 2;
+    keyleds_set_error(KEYLEDS_NO_ERROR);
+    targets_nb = keyleds_get_targets(dev, targets, sizeof(targets));
+    if (targets_nb == 0) {
+        if (keyleds_get_errno() == KEYLEDS_NO_ERROR) {
+            keyleds_set_error(KEYLEDS_ERROR_HIDVERSION);
+        }
+        goto error_close;
     }
+    if (targets_nb > sizeof(targets)) { targets_nb = sizeof(targets); }
 
-    if (!keyleds_ping(dev, KEYLEDS_TARGET_DEFAULT)) {
-        goto error_free_reports;
+    if (!keyleds_ping(dev, targets[0])) {
+        goto error_close;
     }
 
-    dev->features = malloc(sizeof(struct keyleds_device_feature));
-    dev->features[0].id = 0;
+    /* Learn feature indices now, so later calls never need a lookup round trip */
+    for (idx = 0; idx < targets_nb; idx += 1) {
+        struct keyleds_feature_cache cache;
+        bool has_cache = cache_dir != NULL &&
+                         keyleds_feature_cache_key(dev, targets[idx], cache_dir, &cache);
+
+        if (has_cache && keyleds_load_features(dev, targets[idx], &cache)) { continue; }
+        if (!keyleds_discover_features(dev, targets[idx])) {
+            KEYLEDS_LOG(WARNING, "Feature discovery failed on target %02x, "
+                        "features will be looked up on use", targets[idx]);
+        } else if (has_cache) {
+            keyleds_save_features(dev, targets[idx], &cache);
+        }
+    }
 
-    KEYLEDS_LOG(INFO, "Opened device %s protocol version %d", path, version);
+    if (dev->receiver) {
+        KEYLEDS_LOG(INFO, "Opened receiver %s with %u paired devices", path, targets_nb);
+    } else {
+        KEYLEDS_LOG(INFO, "Opened device %s protocol version %d", path, version);
+    }
     return dev;
 
-error_free_reports:
-    free(dev->reports);
-error_close_fd:
-    close(dev->fd);
-error_free_dev:
-    free(dev);
+error_close:
+    keyleds_close(dev);
     return NULL;
 }
 
+KEYLEDS_EXPORT bool keyleds_probe(const char * path, uint8_t app_id, unsigned timeout_us,
+                                  unsigned * version)
+{
+    Keyleds * dev;
+    unsigned protocol = 0;
+    bool result;
+
+    if (version != NULL) { *version = 0; }
+    if ((dev = device_new(path, app_id)) == NULL) { return false; }
+    dev->timeout = timeout_us;
+    result = keyleds_get_protocol(dev, KEYLEDS_TARGET_DEFAULT, &protocol, NULL);
+
+    /* A HID++ 1.0 device is only usable as a receiver with HID++ 2.0 devices
+     * paired to it. All slots are probed in one burst, so this is one more
+     * round trip, for receivers only. */
+    if (result && protocol < 2) {
+        dev->receiver = true;
+        keyleds_set_error(KEYLEDS_NO_ERROR);
+        if (keyleds_get_targets(dev, NULL, 0) == 0) {
+            if (keyleds_get_errno() == KEYLEDS_NO_ERROR) {
+                keyleds_set_error(KEYLEDS_ERROR_HIDVERSION);
+            }
+            result = false;
+        }
+    }
+    keyleds_close(dev);
+    if (version != NULL) { *version = protocol; }
+    return result;
+}
+
 KEYLEDS_EXPORT void keyleds_close(Keyleds * device)
 {
     assert(device != NULL);
+    keyleds_capture_stop(device);
     close(device->fd);
+    free(device->stats);
+    free(device->out_buffer);
     free(device->reports);
-    free(device->features);
+    keyleds_free_features(device);
     free(device);
 }
 
@@ -117,28 +240,101 @@ KEYLEDS_EXPORT void keyleds_set_timeout(Keyleds * device, unsigned us)
     device->timeout = us;
 }
 
+KEYLEDS_EXPORT unsigned keyleds_get_timeout(Keyleds * device)
+{
+    assert(device != NULL);
+    return device->timeout;
+}
+
+KEYLEDS_EXPORT void keyleds_set_deadline(Keyleds * device, const struct timespec * deadline)
+{
+    assert(device != NULL);
+    assert(deadline == NULL || (deadline->tv_nsec >= 0 && deadline->tv_nsec < 1000000000));
+    device->has_deadline = deadline != NULL;
+    if (deadline != NULL) { device->deadline = *deadline; }
+}
+
+KEYLEDS_EXPORT void keyleds_set_pipeline_depth(Keyleds * device, unsigned depth)
+{
+    assert(device != NULL);
+    if (depth < 1) { depth = 1; }
+    if (depth > KEYLEDS_PIPELINE_DEPTH_MAX) { depth = KEYLEDS_PIPELINE_DEPTH_MAX; }
+    device->pipeline_depth = depth;
+}
+
 KEYLEDS_EXPORT int keyleds_device_fd(Keyleds * device)
 {
     assert(device != NULL);
     return device->fd;
 }
 
+/* Pipelined requests of a target may be completed while another target's call
+ * waits on the shared link. Their failures are kept for the target's next call,
+ * so its owner sees them, rather than believing its leds were set. */
+static struct keyleds_error_state * keyleds_target_error(Keyleds * device, uint8_t target_id)
+{
+    unsigned slot = target_id == KEYLEDS_TARGET_DEFAULT ? 0 : target_id;
+    assert(slot < sizeof(device->target_errors) / sizeof(device->target_errors[0]));
+    return &device->target_errors[slot];
+}
+
+static void keyleds_pipeline_defer_error(Keyleds * device, uint8_t target_id)
+{
+    KEYLEDS_LOG(WARNING, "Pipelined request to target %02x failed: %s",
+                target_id, keyleds_get_error_str());
+    if (target_id != KEYLEDS_TARGET_DEFAULT && target_id > KEYLEDS_TARGET_PAIRED_MAX) {
+        return;     /* not a target we send to */
+    }
+    keyleds_save_error(keyleds_target_error(device, target_id));
+}
+
+/* Report, then forget, a failure deferred for target */
+static bool keyleds_pipeline_check(Keyleds * device, uint8_t target_id)
+{
+    struct keyleds_error_state * state = keyleds_target_error(device, target_id);
+    if (state->error == KEYLEDS_NO_ERROR) { return true; }
+    keyleds_restore_error(state);
+    state->error = KEYLEDS_NO_ERROR;
+    return false;
+}
+
+static int keyleds_read_report(Keyleds * device, uint8_t * message, ssize_t * size,
+                               const struct timespec * deadline, bool poll_first);
+static int keyleds_pipeline_complete(Keyleds * device, const uint8_t * message, ssize_t nread);
+
 KEYLEDS_EXPORT bool keyleds_flush_fd(Keyleds * device)
 {
     assert(device != NULL);
-    uint8_t buffer[device->max_report_size + 1];
+    static const struct timespec now = { 0, 0 };  /* any past time works */
+    uint8_t message[1 + device->max_report_size];
+    bool poll_first = true;     /* usually there is nothing to drain, which a poll tells */
     ssize_t nread;
-
-    fcntl(device->fd, F_SETFL, O_NONBLOCK);
-    while ((nread = read(device->fd, buffer, device->max_report_size + 1)) > 0) {
-        /* do nothing */
-    }
-    if (errno != EAGAIN) {
-        keyleds_set_error_errno();
-        return false;
+    int ret;
+
+    /* Link may be shared by several targets: responses to requests still in
+     * flight are not stale, complete them instead of dropping them. Requests
+     * whose response has not arrived yet stay pending. Reports go through the
+     * same validation and capture as those read by keyleds_receive. */
+    while ((ret = keyleds_read_report(device, message, &nread, &now, poll_first)) > 0) {
+        poll_first = false;
+        switch (device->pending_nb > 0 ? keyleds_pipeline_complete(device, message, nread) : -1) {
+        case 0:
+            keyleds_pipeline_defer_error(device, message[1]);
+            break;
+        case -1:
+            if (device->stats != NULL) { keyleds_stats_discarded(device); }
+            break;
+        }
     }
-    fcntl(device->fd, F_SETFL, 0);
-    return true;
+    return ret == 0;
+}
+
+KEYLEDS_EXPORT void keyleds_get_syscall_counts(Keyleds * device,
+                                               struct keyleds_syscall_counts * counts)
+{
+    assert(device != NULL);
+    assert(counts != NULL);
+    *counts = device->syscalls;
 }
 
 /****************************************************************************/
@@ -158,7 +354,25 @@ bool keyleds_send(Keyleds * device, uint8_t target_id, uint8_t feature_idx,
                   uint8_t function, size_t length, const uint8_t * data)
 {
     assert(device != NULL);
+
+    /* Synchronous requests must not overtake pipelined ones to the same target.
+     * Other targets are independent devices, their requests may stay in flight. */
+    if (device->pending_nb > 0 && keyleds_pipeline_pending(device, target_id) > 0) {
+        if (!keyleds_pipeline_drain(device, target_id)) { return false; }
+    } else if (!keyleds_pipeline_check(device, target_id)) {
+        return false;
+    }
+
+    return keyleds_send_tagged(device, target_id, feature_idx, function, device->app_id,
+                               length, data);
+}
+
+bool keyleds_send_tagged(Keyleds * device, uint8_t target_id, uint8_t feature_idx,
+                         uint8_t function, uint8_t sw_id, size_t length, const uint8_t * data)
+{
+    assert(device != NULL);
     assert(function <= 0xf);
+    assert(sw_id <= 0xf);
     assert(length + 3 <= device->max_report_size);
     assert(length == 0 || data != NULL);
 
@@ -166,14 +380,18 @@ bool keyleds_send(Keyleds * device, uint8_t target_id, uint8_t feature_idx,
     while (device->reports[idx].size < 3 + length) { idx += 1; }
 
     size_t report_size = device->reports[idx].size;
-    uint8_t buffer[1 + report_size];
+    uint8_t * buffer = device->out_buffer;
 
+    /* Buffer is kept zeroed past the last payload, only clear what it left over */
     buffer[0] = device->reports[idx].id;
     buffer[1] = target_id;
     buffer[2] = feature_idx;
-    buffer[3] = function << 4 | device->app_id;
+    buffer[3] = function << 4 | sw_id;
     memcpy(&buffer[4], data, length);
-    memset(&buffer[4 + length], 0, report_size - 3 - length);
+    if (device->out_length > length) {
+        memset(&buffer[4 + length], 0, device->out_length - length);
+    }
+    device->out_length = length;
 
 #ifndef NDEBUG
     if (g_keyleds_debug_level >= KEYLEDS_LOG_DEBUG) {
@@ -183,51 +401,122 @@ bool keyleds_send(Keyleds * device, uint8_t target_id, uint8_t feature_idx,
     }
 #endif
 
-    ssize_t nwritten = write(device->fd, buffer, 1 + report_size);
-    if (nwritten < 0) {
-        keyleds_set_error_errno();
-        return false;
+    ssize_t nwritten;
+    for (;;) {
+        device->syscalls.write += 1;
+        if ((nwritten = write(device->fd, buffer, 1 + report_size)) >= 0) { break; }
+        if (errno == EINTR) { continue; }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            keyleds_set_error_errno();
+            return false;
+        }
+        /* Output queue is full, wait for room. Device timeout bounds the wait. */
+        struct pollfd pfd = { .fd = device->fd, .events = POLLOUT };
+        device->syscalls.poll += 1;
+        int ret = poll(&pfd, 1, device->timeout > 0 ? (int)(device->timeout + 999) / 1000 : -1);
+        if (ret == 0) {
+            keyleds_set_error(KEYLEDS_ERROR_TIMEDOUT);
+            return false;
+        }
+        if (ret < 0 && errno != EINTR) {
+            keyleds_set_error_errno();
+            return false;
+        }
     }
     if ((size_t)nwritten != 1 + report_size) {
         KEYLEDS_LOG(DEBUG, "Unexpected write size %zd on fd %d", nwritten, device->fd);
         keyleds_set_error(KEYLEDS_ERROR_IO_LENGTH);
         return false;
     }
+    if (device->capture != NULL) {
+        keyleds_capture_report(device, KEYLEDS_CAPTURE_SENT, buffer, 1 + report_size);
+    }
+    if (device->stats != NULL) {
+        keyleds_stats_sent(device, target_id, feature_idx, function, 1 + report_size);
+    }
     return true;
 }
 
-bool keyleds_receive(Keyleds * device, uint8_t target_id, uint8_t feature_idx,
-                     uint8_t * message, size_t * size)
+static bool timespec_before(const struct timespec * lhs, const struct timespec * rhs)
+{
+    return lhs->tv_sec < rhs->tv_sec ||
+           (lhs->tv_sec == rhs->tv_sec && lhs->tv_nsec < rhs->tv_nsec);
+}
+
+/* Compute the absolute deadline for a call starting now, from device timeout and
+ * user-set deadline, whichever comes first. Returns false if there is none. */
+static bool keyleds_call_deadline(const Keyleds * device, struct timespec * deadline)
 {
+    bool result = false;
+
+    if (device->timeout > 0) {
+        clock_gettime(CLOCK_MONOTONIC, deadline);
+        deadline->tv_sec += device->timeout / 1000000;
+        deadline->tv_nsec += (long)(device->timeout % 1000000) * 1000;
+        if (deadline->tv_nsec >= 1000000000) {
+            deadline->tv_sec += 1;
+            deadline->tv_nsec -= 1000000000;
+        }
+        result = true;
+    }
+    if (device->has_deadline && (!result || timespec_before(&device->deadline, deadline))) {
+        *deadline = device->deadline;
+        result = true;
+    }
+    return result;
+}
+
+/* Read next HID++ report, waiting until deadline at most, or forever if it is NULL.
+ * If poll_first is false, a read is attempted before waiting, which saves a
+ * syscall when input is likely already queued.
+ * Returns 1 on success, 0 if deadline passed, -1 on error. */
+static int keyleds_read_report(Keyleds * device, uint8_t * message, ssize_t * size,
+                               const struct timespec * deadline, bool poll_first)
+{
+    struct pollfd pfd = { .fd = device->fd, .events = POLLIN };
+    bool readable = !poll_first, has_read = false;
     int err, idx;
     ssize_t nread;
 
-    assert(device != NULL);
-    assert(message != NULL);
-
-    do {
-        if (device->timeout > 0) {
-            fd_set set;
-            struct timeval timeout;
+    for (;;) {
+        if (!readable) {
+            struct timespec remaining;
+            if (deadline != NULL) {
+                clock_gettime(CLOCK_MONOTONIC, &remaining);
+                if (timespec_before(&remaining, deadline)) {
+                    remaining.tv_sec = deadline->tv_sec - remaining.tv_sec;
+                    remaining.tv_nsec = deadline->tv_nsec - remaining.tv_nsec;
+                    if (remaining.tv_nsec < 0) {
+                        remaining.tv_sec -= 1;
+                        remaining.tv_nsec += 1000000000;
+                    }
+                } else if (has_read) {
+                    return 0;       /* we just found nothing to read, polling is moot */
+                } else {
+                    remaining.tv_sec = remaining.tv_nsec = 0;
+                }
+            }
 
-            FD_ZERO(&set);
-            FD_SET(device->fd, &set);
-            timeout.tv_sec = KEYLEDS_CALL_TIMEOUT_US / 1000000;
-            timeout.tv_usec = KEYLEDS_CALL_TIMEOUT_US % 1000000;
-            if ((err = select(device->fd + 1, &set, NULL, NULL, &timeout)) < 0) {
+            device->syscalls.poll += 1;
+            if ((err = ppoll(&pfd, 1, deadline != NULL ? &remaining : NULL, NULL)) < 0) {
+                if (errno == EINTR) { continue; }
                 keyleds_set_error_errno();
-                return false;
-            }
-            if (err == 0) {
-                KEYLEDS_LOG(INFO, "Device timeout while reading fd %d", device->fd);
-                keyleds_set_error(KEYLEDS_ERROR_TIMEDOUT);
-                return false;
+                return -1;
             }
+            if (err == 0) { return 0; }
         }
 
-        if ((nread = read(device->fd, message, device->max_report_size + 1)) < 0) {
+        device->syscalls.read += 1;
+        nread = read(device->fd, message, device->max_report_size + 1);
+        has_read = true;
+        if (nread < 0) {
+            if (errno == EINTR) { continue; }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                readable = false;
+                continue;
+            }
             keyleds_set_error_errno();
-            return false;
+            return -1;
         }
 #ifndef NDEBUG
         if (g_keyleds_debug_level >= KEYLEDS_LOG_DEBUG) {
@@ -240,29 +529,87 @@ bool keyleds_receive(Keyleds * device, uint8_t target_id, uint8_t feature_idx,
         {
             if (device->reports[idx].id == message[0]) { break; }
         }
-        if (device->reports[idx].id == DEVICE_REPORT_INVALID) { continue; }
+        if (device->reports[idx].id != DEVICE_REPORT_INVALID) { break; }
+        if (device->stats != NULL) { keyleds_stats_discarded(device); }
+        readable = true;            /* not HID++, there may be more queued behind it */
+    }
+
+    if (nread != 1 + device->reports[idx].size) {
+        KEYLEDS_LOG(DEBUG, "Unexpected read size %zd on fd %d", nread, device->fd);
+        keyleds_set_error(KEYLEDS_ERROR_IO_LENGTH);
+        return -1;
+    }
+    if (device->capture != NULL) {
+        keyleds_capture_report(device, KEYLEDS_CAPTURE_RECEIVED, message, (size_t)nread);
+    }
+    *size = nread;
+    return 1;
+}
 
-        if (nread != 1 + device->reports[idx].size) {
-            KEYLEDS_LOG(DEBUG, "Unexpected read size %zd on fd %d", nread, device->fd);
-            keyleds_set_error(KEYLEDS_ERROR_IO_LENGTH);
+/* Same as keyleds_read_report, turning an expired deadline into an error */
+static bool keyleds_read_report_until(Keyleds * device, uint8_t * message, ssize_t * size,
+                                      const struct timespec * deadline, bool poll_first)
+{
+    int ret = keyleds_read_report(device, message, size, deadline, poll_first);
+    if (ret == 0) {
+        KEYLEDS_LOG(INFO, "Device timeout while reading fd %d", device->fd);
+        keyleds_set_error(KEYLEDS_ERROR_TIMEDOUT);
+    }
+    return ret > 0;
+}
+
+bool keyleds_receive(Keyleds * device, uint8_t target_id, uint8_t feature_idx,
+                     uint8_t * message, size_t * size)
+{
+    struct timespec deadline;
+    bool has_deadline;
+    ssize_t nread;
+
+    assert(device != NULL);
+    assert(message != NULL);
+
+    /* Deadline is fixed now, so unrelated reports cannot extend the wait */
+    has_deadline = keyleds_call_deadline(device, &deadline);
+    for (;;) {
+        if (!keyleds_read_report_until(device, message, &nread,
+                                       has_deadline ? &deadline : NULL, true)) {
+            if (device->stats != NULL && keyleds_get_errno() == KEYLEDS_ERROR_TIMEDOUT) {
+                keyleds_stats_timeout(device, target_id, feature_idx,
+                                      device->stats->last_function);
+            }
             return false;
         }
+        if (message[1] == target_id && (            /* message is from this device */
+            (
+                message[2] == feature_idx &&            /* message is for correct feature */
+                (message[3] & 0xf) == device->app_id    /* message is for us */
+            ) || (
+                message[2] == 0xff &&                   /* message is an error */
+                message[3] == feature_idx &&            /* message if for correct feature */
+                (message[4] & 0xf) == device->app_id    /* message is for us */
+            ) || (                                          /* special handling for getprotocol */
+                message[2] == 0x8f &&                       /* message is HIDPP1 error */
+                message[3] == KEYLEDS_FEATURE_IDX_ROOT &&   /* feature is root feature */
+                (message[4] & 0xf) == device->app_id        /* message is for us */
+            ))) { break; }
+
+        /* Requests to other targets may still be in flight, complete them as they come */
+        switch (device->pending_nb > 0 ? keyleds_pipeline_complete(device, message, nread) : -1) {
+        case 0:
+            keyleds_pipeline_defer_error(device, message[1]);
+            break;
+        case -1:
+            if (device->stats != NULL) { keyleds_stats_discarded(device); }
+            break;
+        }
+    }
 
-    } while(!(
-        message[1] == target_id && (                /* message is from this device */
-        (
-            message[2] == feature_idx &&            /* message is for correct feature */
-            (message[3] & 0xf) == device->app_id    /* message is for us */
-        ) || (
-            message[2] == 0xff &&                   /* message is an error */
-            message[3] == feature_idx &&            /* message if for correct feature */
-            (message[4] & 0xf) == device->app_id    /* message is for us */
-        ) || (                                          /* special handling for getprotocol */
-            message[2] == 0x8f &&                       /* message is HIDPP1 error */
-            message[3] == KEYLEDS_FEATURE_IDX_ROOT &&   /* feature is root feature */
-            (message[4] & 0xf) == device->app_id        /* message is for us */
-        )
-    )));
+    if (device->stats != NULL) {
+        const bool is_error = message[2] == 0xff || message[2] == 0x8f;
+        keyleds_stats_received(device, target_id, feature_idx,
+                               (is_error ? message[4] : message[3]) >> 4,
+                               &device->stats->last_sent, (size_t)nread, is_error);
+    }
 
     if (message[2] == 0xff) {
         keyleds_set_error_hidpp(message[5]);
@@ -302,3 +649,300 @@ int keyleds_call(Keyleds * device, uint8_t * result, size_t result_len,
 
     return ret;
 }
+
+/****************************************************************************/
+/* Pipelined requests
+ *
+ * Requests are tagged with a rotating software id instead of the application
+ * id, so that responses can be matched to their request while several of them
+ * are in flight. Responses are only collected when the window is full, or when
+ * a synchronous request needs the channel, at which point errors are reported.
+ */
+
+static uint8_t keyleds_pipeline_sw_id(Keyleds * device)
+{
+    for (;;) {
+        uint8_t sw_id = device->next_sw_id;
+        unsigned idx;
+
+        device->next_sw_id = sw_id >= 0xf ? 1 : sw_id + 1;
+        if (sw_id == device->app_id) { continue; }
+        for (idx = 0; idx < device->pending_nb; idx += 1) {
+            if (device->pending[idx].sw_id == sw_id) { break; }
+        }
+        if (idx == device->pending_nb) { return sw_id; }
+    }
+}
+
+/* Match a report against pending requests, completing the request it answers.
+ * Returns 1 if the request succeeded, 0 if it failed, -1 if report was unrelated. */
+static int keyleds_pipeline_complete(Keyleds * device, const uint8_t * message, ssize_t nread)
+{
+    bool is_error = message[2] == 0xff || message[2] == 0x8f;   /* HID++ 2.0 or 1.0 error */
+    unsigned idx;
+
+    for (idx = 0; idx < device->pending_nb; idx += 1) {
+        const struct keyleds_pending_request * request = &device->pending[idx];
+        if (message[1] != request->target_id) { continue; }
+        if (!is_error && message[2] == request->feature_idx &&
+            message[3] == (request->function << 4 | request->sw_id)) { break; }
+        if (is_error && message[3] == request->feature_idx &&
+            message[4] == (request->function << 4 | request->sw_id)) { break; }
+    }
+    if (idx == device->pending_nb) { return -1; }
+
+    /* Remove it from the queue before invoking the callback, which may submit again */
+    struct keyleds_pending_request request = device->pending[idx];
+    device->pending_nb -= 1;
+    memmove(&device->pending[idx], &device->pending[idx + 1],
+            (device->pending_nb - idx) * sizeof(device->pending[0]));
+
+    if (device->stats != NULL) {
+        keyleds_stats_received(device, request.target_id, request.feature_idx, request.function,
+                               &request.sent, (size_t)nread, is_error);
+    }
+    if (is_error) {
+        KEYLEDS_LOG(DEBUG, "Pipelined request %d failed", request.sw_id);
+        if (message[2] == 0x8f) {
+            keyleds_set_error(KEYLEDS_ERROR_HIDVERSION);    /* no HID++ 2.0 device there */
+        } else {
+            keyleds_set_error_hidpp(message[5]);
+        }
+    }
+    if (request.callback != NULL) {
+        const uint8_t * data = keyleds_response_data(device, message);
+        (*request.callback)(device, request.handle, !is_error,
+                            is_error ? NULL : data, is_error ? 0 : nread - (data - message),
+                            request.userdata);
+        return 1;       /* error was reported through the callback */
+    }
+    return is_error ? 0 : 1;
+}
+
+unsigned keyleds_pipeline_pending(const Keyleds * device, uint8_t target_id)
+{
+    unsigned idx, count = 0;
+    for (idx = 0; idx < device->pending_nb; idx += 1) {
+        if (device->pending[idx].target_id == target_id) { count += 1; }
+    }
+    return count;
+}
+
+/* Fail all requests in flight with current error, invoking their callbacks.
+ * Internal requests have no callback: unless their target is the owner's, which
+ * gets the error now, it is deferred to the next call to their target.
+ * Queue is emptied first, so callbacks may submit new requests. */
+void keyleds_pipeline_abort(Keyleds * device, int owner_id)
+{
+    struct keyleds_pending_request pending[KEYLEDS_PIPELINE_DEPTH_MAX];
+    unsigned idx, pending_nb = device->pending_nb;
+
+    memcpy(pending, device->pending, pending_nb * sizeof(pending[0]));
+    device->pending_nb = 0;
+    for (idx = 0; idx < pending_nb; idx += 1) {
+        if (pending[idx].callback != NULL) {
+            (*pending[idx].callback)(device, pending[idx].handle, false, NULL, 0,
+                                     pending[idx].userdata);
+        } else if ((int)pending[idx].target_id != owner_id) {
+            keyleds_pipeline_defer_error(device, pending[idx].target_id);
+        }
+    }
+}
+
+/* Account all requests still in flight as timed out */
+static void keyleds_pipeline_stats_timeout(Keyleds * device)
+{
+    unsigned idx;
+    for (idx = 0; idx < device->pending_nb; idx += 1) {
+        const struct keyleds_pending_request * request = &device->pending[idx];
+        keyleds_stats_timeout(device, request->target_id, request->feature_idx,
+                              request->function);
+    }
+}
+
+/* Wait until at most max_pending requests to target are in flight, and there is
+ * room for another one. Failures of requests to other targets are not ours to
+ * report, they are kept for those targets' next call. */
+bool keyleds_pipeline_wait(Keyleds * device, uint8_t target_id, unsigned max_pending)
+{
+    assert(device != NULL);
+    uint8_t message[1 + device->max_report_size];
+    struct timespec deadline;
+    bool has_deadline = keyleds_call_deadline(device, &deadline);
+    bool result = true, received = false;
+
+    while (device->pending_nb >= KEYLEDS_PIPELINE_DEPTH_MAX ||
+           keyleds_pipeline_pending(device, target_id) > max_pending) {
+        ssize_t nread;
+
+        /* Once a response came in, others to the same burst are likely queued
+         * behind it: try reading them before polling. */
+        if (!keyleds_read_report_until(device, message, &nread,
+                                       has_deadline ? &deadline : NULL, !received)) {
+            if (device->stats != NULL && keyleds_get_errno() == KEYLEDS_ERROR_TIMEDOUT) {
+                keyleds_pipeline_stats_timeout(device);
+            }
+            keyleds_pipeline_abort(device, target_id);  /* lost track of device, caller must resync */
+            return false;
+        }
+        received = true;
+        switch (keyleds_pipeline_complete(device, message, nread)) {
+        case 0:
+            if (message[1] == target_id) {
+                result = false;
+            } else {
+                keyleds_pipeline_defer_error(device, message[1]);
+            }
+            break;
+        case -1:
+            if (device->stats != NULL) { keyleds_stats_discarded(device); }
+            break;
+        }
+    }
+    if (!keyleds_pipeline_check(device, target_id)) { result = false; }
+    return result;
+}
+
+bool keyleds_pipeline_submit(Keyleds * device, uint8_t target_id, uint8_t feature_idx,
+                             uint8_t function, size_t length, const uint8_t * data,
+                             keyleds_request_t handle, keyleds_completion_cb callback,
+                             void * userdata)
+{
+    assert(device != NULL);
+    assert(device->pending_nb < KEYLEDS_PIPELINE_DEPTH_MAX);
+
+    uint8_t sw_id = keyleds_pipeline_sw_id(device);
+    if (!keyleds_send_tagged(device, target_id, feature_idx, function, sw_id, length, data)) {
+        return false;
+    }
+
+    struct keyleds_pending_request * request = &device->pending[device->pending_nb];
+    request->target_id = target_id;
+    request->feature_idx = feature_idx;
+    request->function = function;
+    request->sw_id = sw_id;
+    request->handle = handle;
+    request->callback = callback;
+    request->userdata = userdata;
+    request->has_expiry = false;
+    if (device->stats != NULL) { request->sent = device->stats->last_sent; }
+    device->pending_nb += 1;
+    return true;
+}
+
+bool keyleds_pipeline_drain(Keyleds * device, uint8_t target_id)
+{
+    return keyleds_pipeline_wait(device, target_id, 0);
+}
+
+KEYLEDS_EXPORT bool keyleds_wait_requests(Keyleds * device, uint8_t target_id)
+{
+    assert(device != NULL);
+    return keyleds_pipeline_drain(device, target_id);
+}
+
+/****************************************************************************/
+/* Asynchronous requests */
+
+KEYLEDS_EXPORT keyleds_request_t keyleds_submit(Keyleds * device, uint8_t target_id,
+                                                uint16_t feature_id, uint8_t function,
+                                                size_t length, const uint8_t * data,
+                                                keyleds_completion_cb callback, void * userdata)
+{
+    assert(device != NULL);
+    assert(function <= 0xf);
+    assert(length == 0 || data != NULL);
+
+    if (length + 3 > device->max_report_size) {
+        keyleds_set_error(KEYLEDS_ERROR_IO_LENGTH);
+        return 0;
+    }
+    if (device->pending_nb >= KEYLEDS_PIPELINE_DEPTH_MAX) {
+        errno = EAGAIN;
+        keyleds_set_error_errno();
+        return 0;
+    }
+
+    uint8_t feature_idx;
+    if (feature_id == KEYLEDS_FEATURE_ROOT) {
+        feature_idx = KEYLEDS_FEATURE_IDX_ROOT;
+    } else {
+        /* Resolving an uncached feature index is a synchronous call */
+        feature_idx = keyleds_get_feature_index(device, target_id, feature_id);
+        if (feature_idx == 0) { return 0; }
+    }
+
+    keyleds_request_t handle = device->next_handle;
+    device->next_handle = handle == UINT_MAX ? 1 : handle + 1;
+
+    if (!keyleds_pipeline_submit(device, target_id, feature_idx, function, length, data,
+                                 handle, callback, userdata)) {
+        return 0;
+    }
+    struct keyleds_pending_request * request = &device->pending[device->pending_nb - 1];
+    request->has_expiry = keyleds_call_deadline(device, &request->expiry);
+    return handle;
+}
+
+/* Fail asynchronous requests whose response is overdue, returns how many */
+static int keyleds_pipeline_expire(Keyleds * device)
+{
+    struct timespec now;
+    unsigned idx = 0;
+    int expired = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (idx < device->pending_nb) {
+        struct keyleds_pending_request request = device->pending[idx];
+        if (!request.has_expiry || timespec_before(&now, &request.expiry)) {
+            idx += 1;
+            continue;
+        }
+        device->pending_nb -= 1;
+        memmove(&device->pending[idx], &device->pending[idx + 1],
+                (device->pending_nb - idx) * sizeof(device->pending[0]));
+
+        KEYLEDS_LOG(INFO, "Request %u to target %02x timed out", request.handle, request.target_id);
+        if (device->stats != NULL) {
+            keyleds_stats_timeout(device, request.target_id, request.feature_idx,
+                                  request.function);
+        }
+        keyleds_set_error(KEYLEDS_ERROR_TIMEDOUT);
+        if (request.callback != NULL) {
+            (*request.callback)(device, request.handle, false, NULL, 0, request.userdata);
+        }
+        expired += 1;
+        idx = 0;        /* callback may have changed the queue */
+    }
+    return expired;
+}
+
+KEYLEDS_EXPORT int keyleds_process_events(Keyleds * device)
+{
+    assert(device != NULL);
+    static const struct timespec now = { 0, 0 };  /* any past time works */
+    uint8_t message[1 + device->max_report_size];
+    int completed = 0;
+
+    while (device->pending_nb > 0) {
+        ssize_t nread;
+        int ret = keyleds_read_report(device, message, &nread, &now, false);
+        if (ret < 0) {
+            keyleds_pipeline_abort(device, -1);
+            return -1;
+        }
+        if (ret == 0) { break; }
+        if (keyleds_pipeline_complete(device, message, nread) >= 0) {
+            completed += 1;
+        } else if (device->stats != NULL) {
+            keyleds_stats_discarded(device);
+        }
+    }
+    return completed + keyleds_pipeline_expire(device);
+}
+
+KEYLEDS_EXPORT unsigned keyleds_pending_requests(Keyleds * device)
+{
+    assert(device != NULL);
+    return device->pending_nb;
+}
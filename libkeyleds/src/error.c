@@ -56,16 +56,21 @@ static thread_local int keyleds_saved_errno = 0;
 static thread_local char keyleds_error_buffer[256];
 #endif
 
-KEYLEDS_EXPORT const char * keyleds_get_error_str()
+/* Returned string is valid until next call from the same thread */
+const char * keyleds_strerror(int errnum)
 {
-    if (keyleds_errno == KEYLEDS_ERROR_ERRNO) {
 #ifdef POSIX_STRERROR_R_FOUND
-        strerror_r(keyleds_saved_errno, keyleds_error_buffer,
-                   sizeof(keyleds_error_buffer));
-        return keyleds_error_buffer;
+    strerror_r(errnum, keyleds_error_buffer, sizeof(keyleds_error_buffer));
+    return keyleds_error_buffer;
 #else
-        return strerror(keyleds_saved_errno);
+    return strerror(errnum);
 #endif
+}
+
+KEYLEDS_EXPORT const char * keyleds_get_error_str()
+{
+    if (keyleds_errno == KEYLEDS_ERROR_ERRNO) {
+        return keyleds_strerror(keyleds_saved_errno);
     } else if (keyleds_errno == KEYLEDS_ERROR_DEVICE) {
         return device_error_strings[keyleds_saved_errno];
     }
@@ -105,3 +110,15 @@ void keyleds_set_error(keyleds_error_t err)
     keyleds_errno = err;
     KEYLEDS_LOG(DEBUG, "%s", error_strings[err]);
 }
+
+void keyleds_save_error(struct keyleds_error_state * state)
+{
+    state->error = keyleds_errno;
+    state->detail = keyleds_saved_errno;
+}
+
+void keyleds_restore_error(const struct keyleds_error_state * state)
+{
+    keyleds_errno = state->error;
+    keyleds_saved_errno = state->detail;
+}
@@ -14,8 +14,15 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "config.h"
 #include "keyleds.h"
@@ -80,6 +87,56 @@ KEYLEDS_EXPORT bool keyleds_ping(Keyleds * device, uint8_t target_id)
     return true;
 }
 
+struct target_probe {
+    uint8_t     target_id;
+    bool        found;
+};
+
+static void target_probe_complete(Keyleds * device, keyleds_request_t request, bool success,
+                                  const uint8_t * data, size_t length, void * userdata)
+{
+    struct target_probe * probe = userdata;
+    (void)device; (void)request;
+    probe->found = success && length >= 1 && data[0] >= 2;
+}
+
+/* List targets that speak HID++ 2.0. A device directly attached is its own only
+ * target. Behind a receiver, all device slots are probed at once, so empty slots
+ * answering with an error do not cost a round trip each. */
+KEYLEDS_EXPORT unsigned keyleds_get_targets(Keyleds * device, uint8_t * targets, unsigned max)
+{
+    struct target_probe probes[KEYLEDS_TARGET_PAIRED_MAX - KEYLEDS_TARGET_PAIRED_MIN + 1];
+    unsigned idx, count = 0;
+
+    assert(device != NULL);
+    assert(targets != NULL || max == 0);
+
+    if (!device->receiver) {
+        if (max > 0) { targets[0] = KEYLEDS_TARGET_DEFAULT; }
+        return 1;
+    }
+
+    for (idx = 0; idx < sizeof(probes) / sizeof(probes[0]); idx += 1) {
+        probes[idx].target_id = KEYLEDS_TARGET_PAIRED_MIN + idx;
+        probes[idx].found = false;
+        if (device->pending_nb >= KEYLEDS_PIPELINE_DEPTH_MAX &&
+            !keyleds_pipeline_wait(device, probes[idx].target_id, 0)) { return 0; }
+        if (!keyleds_pipeline_submit(device, probes[idx].target_id, KEYLEDS_FEATURE_IDX_ROOT,
+                                     F_PING, 0, NULL, 0, target_probe_complete, &probes[idx])) {
+            return 0;
+        }
+    }
+    for (idx = 0; idx < sizeof(probes) / sizeof(probes[0]); idx += 1) {
+        if (!keyleds_pipeline_drain(device, probes[idx].target_id)) { return 0; }
+        if (probes[idx].found) {
+            if (count < max) { targets[count] = probes[idx].target_id; }
+            count += 1;
+        }
+    }
+    KEYLEDS_LOG(DEBUG, "found %u paired targets", count);
+    return count;
+}
+
 KEYLEDS_EXPORT unsigned keyleds_get_feature_count(struct keyleds_device * device, uint8_t target_id)
 {
     uint8_t data[1];
@@ -90,21 +147,95 @@ KEYLEDS_EXPORT unsigned keyleds_get_feature_count(struct keyleds_device * device
     return (unsigned)data[0];
 }
 
+/****************************************************************************/
+/* Feature table
+ *
+ * Each target gets a table mapping feature indices to ids directly, and ids
+ * back to indices through a small open-addressing hash. Tables are filled at
+ * once by keyleds_discover_features, or one entry at a time on lookup misses.
+ */
+
+static unsigned feature_hash(uint16_t feature_id)
+{
+    return ((feature_id * 0x9e37u) >> 8) % KEYLEDS_FEATURE_SLOTS;
+}
+
+static struct keyleds_feature_table * feature_table(Keyleds * device, uint8_t target_id,
+                                                    bool create)
+{
+    struct keyleds_feature_table * tables;
+    unsigned idx;
+
+    for (idx = 0; idx < device->feature_tables_nb; idx += 1) {
+        if (device->feature_tables[idx].target_id == target_id) {
+            return &device->feature_tables[idx];
+        }
+    }
+    if (!create) { return NULL; }
+
+    tables = realloc(device->feature_tables, (idx + 1) * sizeof(tables[0]));
+    if (tables == NULL) { keyleds_set_error_errno(); return NULL; }
+    device->feature_tables = tables;
+    device->feature_tables_nb = idx + 1;
+
+    memset(&tables[idx], 0, sizeof(tables[idx]));
+    tables[idx].target_id = target_id;
+    return &tables[idx];
+}
+
+static void feature_table_add(struct keyleds_feature_table * table, uint8_t feature_idx,
+                              uint16_t feature_id, uint8_t flags)
+{
+    unsigned bucket;
+
+    if (table->ids[feature_idx] == feature_id) { return; }
+    table->ids[feature_idx] = feature_id;
+    table->flags[feature_idx] = flags;
+
+    /* At most 255 entries in 256 buckets, there is always a free one */
+    for (bucket = feature_hash(feature_id); table->buckets[bucket] != 0;
+         bucket = (bucket + 1) % KEYLEDS_FEATURE_SLOTS) {}
+    table->buckets[bucket] = feature_idx;
+    KEYLEDS_LOG(DEBUG, "feature %04x is at %d [%02x]", feature_id, feature_idx, flags);
+}
+
+static uint8_t feature_table_find(const struct keyleds_feature_table * table, uint16_t feature_id)
+{
+    unsigned bucket;
+
+    for (bucket = feature_hash(feature_id); table->buckets[bucket] != 0;
+         bucket = (bucket + 1) % KEYLEDS_FEATURE_SLOTS) {
+        if (table->ids[table->buckets[bucket]] == feature_id) {
+            return table->buckets[bucket];
+        }
+    }
+    return 0;
+}
+
+void keyleds_free_features(Keyleds * device)
+{
+    free(device->feature_tables);
+    device->feature_tables = NULL;
+    device->feature_tables_nb = 0;
+}
+
+/****************************************************************************/
+
 KEYLEDS_EXPORT uint16_t keyleds_get_feature_id(struct keyleds_device * device,
                                                uint8_t target_id, uint8_t feature_idx)
 {
-    size_t idx;
-    uint16_t feature_id;
+    struct keyleds_feature_table * table;
     uint8_t data[3];
 
     if (feature_idx == KEYLEDS_FEATURE_IDX_ROOT) { return KEYLEDS_FEATURE_ROOT; }
     if (feature_idx == KEYLEDS_FEATURE_IDX_FEATURE) { return KEYLEDS_FEATURE_FEATURE; }
 
-    for (idx = 0; device->features[idx].id != 0; idx += 1) {
-        if (device->features[idx].target_id == target_id &&
-            device->features[idx].index == feature_idx) {
-            return device->features[idx].id;
-        }
+    table = feature_table(device, target_id, true);
+    if (table == NULL) { return 0; }
+    if (table->ids[feature_idx] != 0) { return table->ids[feature_idx]; }
+    if (table->complete) {
+        keyleds_set_error(KEYLEDS_ERROR_FEATURE_NOT_FOUND);
+        return 0;
     }
 
     if (keyleds_call(device, data, sizeof(data),
@@ -114,35 +245,26 @@ KEYLEDS_EXPORT uint16_t keyleds_get_feature_id(struct keyleds_device * device,
         return 0;
     }
 
-    feature_id = (data[0] << 8) | data[1];
-    device->features = realloc(device->features, (idx + 2) * sizeof(device->features[0]));
-    device->features[idx].target_id = target_id;
-    device->features[idx].id = feature_id;
-    device->features[idx].index = feature_idx;
-    device->features[idx].reserved = (data[2] & (1<<5)) != 0;
-    device->features[idx].hidden = (data[2] & (1<<6)) != 0;
-    device->features[idx].obsolete = (data[2] & (1<<7)) != 0;
-    device->features[idx + 1].id = 0;
-    KEYLEDS_LOG(DEBUG, "feature %04x is at %d [%02x]",
-                       feature_id, feature_idx, data[2]);
-    return feature_id;
+    feature_table_add(table, feature_idx, (data[0] << 8) | data[1], data[2]);
+    return table->ids[feature_idx];
 }
 
 KEYLEDS_EXPORT uint8_t keyleds_get_feature_index(struct keyleds_device * device,
                                                  uint8_t target_id, uint16_t feature_id)
 {
-    size_t idx;
+    struct keyleds_feature_table * table;
     uint8_t feature_idx;
     uint8_t data[2];
 
     if (feature_id == KEYLEDS_FEATURE_ROOT) { return KEYLEDS_FEATURE_IDX_ROOT; }
     if (feature_id == KEYLEDS_FEATURE_FEATURE) { return KEYLEDS_FEATURE_IDX_FEATURE; }
 
-    for (idx = 0; device->features[idx].id != 0; idx += 1) {
-        if (device->features[idx].target_id == target_id &&
-            device->features[idx].id == feature_id) {
-            return device->features[idx].index;
-        }
+    table = feature_table(device, target_id, true);
+    if (table == NULL) { return 0; }
+    if ((feature_idx = feature_table_find(table, feature_id)) != 0) { return feature_idx; }
+    if (table->complete) {
+        keyleds_set_error(KEYLEDS_ERROR_FEATURE_NOT_FOUND);
+        return 0;
     }
 
     if (keyleds_call(device, data, sizeof(data),
@@ -158,15 +280,235 @@ KEYLEDS_EXPORT uint8_t keyleds_get_feature_index(struct keyleds_device * device,
         return 0;
     }
 
-    device->features = realloc(device->features, (idx + 2) * sizeof(device->features[0]));
-    device->features[idx].target_id = target_id;
-    device->features[idx].id = feature_id;
-    device->features[idx].index = feature_idx;
-    device->features[idx].reserved = (data[1] & (1<<5)) != 0;
-    device->features[idx].hidden = (data[1] & (1<<6)) != 0;
-    device->features[idx].obsolete = (data[1] & (1<<7)) != 0;
-    device->features[idx + 1].id = 0;
-    KEYLEDS_LOG(DEBUG, "feature %04x is at %d [%02x]",
-                       feature_id, feature_idx, data[1]);
+    feature_table_add(table, feature_idx, feature_id, data[1]);
     return feature_idx;
 }
+
+/* Bulk enumeration. Fills ids from index 1 onwards, returns the feature count,
+ * which may exceed max. */
+KEYLEDS_EXPORT unsigned keyleds_get_feature_ids(struct keyleds_device * device, uint8_t target_id,
+                                                uint16_t * ids, unsigned max)
+{
+    const struct keyleds_feature_table * table;
+    unsigned idx;
+
+    assert(device != NULL);
+    assert(ids != NULL || max == 0);
+
+    table = feature_table(device, target_id, false);
+    if (table == NULL || !table->complete) {
+        if (!keyleds_discover_features(device, target_id)) { return 0; }
+        table = feature_table(device, target_id, false);
+    }
+
+    for (idx = 0; idx < table->count && idx < max; idx += 1) {
+        ids[idx] = table->ids[idx + 1];
+    }
+    return table->count;
+}
+
+/****************************************************************************/
+/* Eager discovery: enumerate all features in one pipelined burst */
+
+struct discovery_context {
+    struct keyleds_feature_table * table;
+    bool        failed;
+};
+
+struct discovery_slot {
+    struct discovery_context * context;
+    uint8_t     feature_idx;
+};
+
+static void discovery_complete(Keyleds * device, keyleds_request_t request, bool success,
+                               const uint8_t * data, size_t length, void * userdata)
+{
+    struct discovery_slot * slot = userdata;
+    (void)device; (void)request;
+
+    if (!success || length < 3) {
+        slot->context->failed = true;
+        return;
+    }
+    feature_table_add(slot->context->table, slot->feature_idx,
+                      (data[0] << 8) | data[1], data[2]);
+}
+
+bool keyleds_discover_features(Keyleds * device, uint8_t target_id)
+{
+    struct discovery_context context;
+    unsigned count, idx;
+
+    assert(device != NULL);
+
+    if ((count = keyleds_get_feature_count(device, target_id)) == 0) { return false; }
+    if (count >= KEYLEDS_FEATURE_SLOTS) { count = KEYLEDS_FEATURE_SLOTS - 1; }
+    if ((context.table = feature_table(device, target_id, true)) == NULL) { return false; }
+    context.failed = false;
+
+    {
+    struct discovery_slot slots[count];
+    for (idx = 1; idx <= count; idx += 1) {
+        if (device->pending_nb >= KEYLEDS_PIPELINE_DEPTH_MAX &&
+            !keyleds_pipeline_wait(device, target_id, KEYLEDS_PIPELINE_DEPTH_MAX - 1)) {
+            return false;
+        }
+
+        slots[idx - 1].context = &context;
+        slots[idx - 1].feature_idx = idx;
+        if (!keyleds_pipeline_submit(device, target_id, KEYLEDS_FEATURE_IDX_FEATURE,
+                                     F_GET_FEATURE_ID, 1, (uint8_t[]){idx},
+                                     0, discovery_complete, &slots[idx - 1])) {
+            keyleds_pipeline_drain(device, target_id);
+            return false;
+        }
+    }
+    if (!keyleds_pipeline_drain(device, target_id) || context.failed) { return false; }
+    }
+
+    context.table->count = count;
+    context.table->complete = true;
+    KEYLEDS_LOG(DEBUG, "discovered %u features on target %02x", count, target_id);
+    return true;
+}
+
+/****************************************************************************/
+/* Persistent feature cache
+ *
+ * The table is stored as text, in a file named after the device model. As
+ * firmware upgrades may move features around, the firmware versions are stored
+ * as well, and a mismatch invalidates the cache. The key costs a few round
+ * trips, so it is computed once per open and used for both loading and saving.
+ */
+
+#define FEATURE_CACHE_MAGIC "keyleds-features 1"
+
+bool keyleds_feature_cache_key(Keyleds * device, uint8_t target_id, const char * cache_dir,
+                               struct keyleds_feature_cache * cache)
+{
+    struct keyleds_device_version * version;
+    size_t done = 0;
+    unsigned idx;
+
+    assert(device != NULL);
+    assert(cache_dir != NULL);
+    assert(cache != NULL);
+
+    if (!keyleds_get_device_version(device, target_id, &version)) { return false; }
+
+    cache->dir = cache_dir;
+    snprintf(cache->path, sizeof(cache->path), "%s/%02x%02x%02x%02x%02x%02x_%02x.features",
+             cache_dir, version->model[0], version->model[1], version->model[2],
+             version->model[3], version->model[4], version->model[5], target_id);
+
+    cache->firmware[0] = '\0';
+    for (idx = 0; idx < version->length && done < sizeof(cache->firmware); idx += 1) {
+        int ret = snprintf(cache->firmware + done, sizeof(cache->firmware) - done, "%s%s%u.%u.%u",
+                           idx > 0 ? "," : "", version->protocols[idx].prefix,
+                           version->protocols[idx].version_major,
+                           version->protocols[idx].version_minor,
+                           version->protocols[idx].build);
+        if (ret < 0) { break; }
+        done += (size_t)ret;
+    }
+    keyleds_free_device_version(version);
+    return true;
+}
+
+bool keyleds_load_features(Keyleds * device, uint8_t target_id,
+                           const struct keyleds_feature_cache * cache)
+{
+    char line[256];
+    struct keyleds_feature_table * table;
+    unsigned feature_idx, feature_id, flags, count = 0;
+    FILE * file;
+    bool result = false;
+
+    assert(device != NULL);
+    assert(cache != NULL);
+
+    if ((file = fopen(cache->path, "r")) == NULL) { return false; }
+    if ((table = feature_table(device, target_id, true)) == NULL) { goto exit_close; }
+
+    if (fgets(line, sizeof(line), file) == NULL) { goto exit_close; }
+    line[strcspn(line, "\n")] = '\0';
+    if (strcmp(line, FEATURE_CACHE_MAGIC) != 0) { goto exit_close; }
+
+    if (fgets(line, sizeof(line), file) == NULL) { goto exit_close; }
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "firmware ", 9) != 0 || strcmp(line + 9, cache->firmware) != 0) {
+        KEYLEDS_LOG(INFO, "Feature cache %s is outdated", cache->path);
+        goto exit_close;
+    }
+    while (fscanf(file, "%x %x %x", &feature_idx, &feature_id, &flags) == 3) {
+        if (feature_idx == 0 || feature_idx >= KEYLEDS_FEATURE_SLOTS ||
+            feature_id > UINT16_MAX || flags > UINT8_MAX) { goto exit_close; }
+        feature_table_add(table, feature_idx, feature_id, flags);
+        if (feature_idx > count) { count = feature_idx; }
+    }
+    if (!feof(file)) { goto exit_close; }
+
+    table->count = count;
+    table->complete = true;
+    KEYLEDS_LOG(DEBUG, "loaded %u features from %s", count, cache->path);
+    result = true;
+
+exit_close:
+    fclose(file);
+    return result;
+}
+
+/* Create directory along with its missing parents */
+KEYLEDS_EXPORT bool keyleds_cache_mkdir(const char * dir)
+{
+    char path[PATH_MAX];
+    size_t idx;
+
+    if (strlen(dir) >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+    strcpy(path, dir);
+    for (idx = 1; path[idx] != '\0'; idx += 1) {
+        if (path[idx] != '/') { continue; }
+        path[idx] = '\0';
+        if (mkdir(path, 0700) < 0 && errno != EEXIST) { return false; }
+        path[idx] = '/';
+    }
+    return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+bool keyleds_save_features(Keyleds * device, uint8_t target_id,
+                           const struct keyleds_feature_cache * cache)
+{
+    const struct keyleds_feature_table * table;
+    unsigned idx;
+    FILE * file;
+
+    assert(device != NULL);
+    assert(cache != NULL);
+
+    table = feature_table(device, target_id, false);
+    if (table == NULL || !table->complete) { return false; }
+
+    if (!keyleds_cache_mkdir(cache->dir)) {
+        KEYLEDS_LOG(INFO, "Cannot create cache directory %s: %s", cache->dir,
+                    keyleds_strerror(errno));
+        return false;
+    }
+    if ((file = fopen(cache->path, "w")) == NULL) {
+        KEYLEDS_LOG(INFO, "Cannot write feature cache %s: %s", cache->path,
+                    keyleds_strerror(errno));
+        return false;
+    }
+    fprintf(file, FEATURE_CACHE_MAGIC "\nfirmware %s\n", cache->firmware);
+    for (idx = 1; idx <= table->count; idx += 1) {
+        fprintf(file, "%02x %04x %02x\n", idx, table->ids[idx], table->flags[idx]);
+    }
+    if (fclose(file) != 0) {
+        unlink(cache->path);
+        return false;
+    }
+    KEYLEDS_LOG(DEBUG, "saved %u features to %s", table->count, cache->path);
+    return true;
+}
@@ -93,40 +93,111 @@ KEYLEDS_EXPORT bool keyleds_get_leds(Keyleds * device, uint8_t target_id,
                                      keyleds_block_id_t block_id,
                                      struct keyleds_key_color * keys, uint16_t offset, unsigned keys_nb)
 {
-    unsigned done = 0;
+    struct keyleds_leds_query query = { block_id, offset, keys_nb, keys };
+    return keyleds_get_leds_batch(device, target_id, &query, 1);
+}
+
+/* Bulk readback: all chunk requests are sent back-to-back, and responses are
+ * matched to their chunk through the offset they echo. */
+
+struct leds_chunk {
+    struct keyleds_leds_query * query;
+    uint16_t    offset;         /* offset of first key, relative to query */
+    uint16_t    keys_nb;        /* number of keys expected */
+    bool        done;
+    bool        failed;         /* device returned an error, which is already set */
+};
+
+static void get_leds_complete(Keyleds * device, keyleds_request_t request, bool success,
+                              const uint8_t * data, size_t length, void * userdata)
+{
+    struct leds_chunk * chunk = userdata;
+    unsigned offset, idx;
+    (void)device; (void)request;
+
+    if (!success) { chunk->failed = true; return; }
+    if (length < 4) { return; }
+    offset = (unsigned)data[2] << 8 | data[3];
+    if (offset != (unsigned)chunk->query->offset + chunk->offset) { return; }
+
+    for (idx = 0; idx < chunk->keys_nb && 4 + idx * 4 + 3 < length; idx += 1) {
+        struct keyleds_key_color * key = &chunk->query->keys[chunk->offset + idx];
+        key->id = data[4 + idx * 4];
+        key->red = data[4 + idx * 4 + 1];
+        key->green = data[4 + idx * 4 + 2];
+        key->blue = data[4 + idx * 4 + 3];
+    }
+    chunk->done = idx == chunk->keys_nb;
+}
+
+KEYLEDS_EXPORT bool keyleds_get_leds_batch(Keyleds * device, uint8_t target_id,
+                                           struct keyleds_leds_query * queries,
+                                           unsigned queries_nb)
+{
+    const unsigned per_call = keyleds_leds_per_report(device);
+    struct leds_chunk * chunks;
+    unsigned chunks_nb = 0, idx, offset;
+    uint8_t feature_idx;
+    bool result = true;
 
     assert(device != NULL);
-    assert((unsigned)block_id <= UINT16_MAX);
-    assert(keys != NULL);
-    assert(keys_nb + offset <= UINT16_MAX);
-
-    while (done < keys_nb) {
-        uint8_t data[device->max_report_size];
-        int data_size;
-        unsigned data_offset;
-
-        data_size = keyleds_call(device, data, sizeof(data),
-                                 target_id, KEYLEDS_FEATURE_LEDS, F_GET_LEDS,
-                                 4, (uint8_t[]){block_id >> 8, block_id,
-                                                offset >> 8, offset});
-        if (data_size < 0) { return false; }
-        if (data[2] != (offset >> 8) ||
-            data[3] != (offset & 0x00ff)) {
-            keyleds_set_error(KEYLEDS_ERROR_RESPONSE);
-            return false;
+    assert(queries != NULL || queries_nb == 0);
+
+    for (idx = 0; idx < queries_nb; idx += 1) {
+        assert((unsigned)queries[idx].block_id <= UINT16_MAX);
+        assert(queries[idx].keys != NULL || queries[idx].keys_nb == 0);
+        assert(queries[idx].keys_nb + queries[idx].offset <= UINT16_MAX);
+        chunks_nb += (queries[idx].keys_nb + per_call - 1) / per_call;
+    }
+    if (chunks_nb == 0) { return true; }
+
+    feature_idx = keyleds_get_feature_index(device, target_id, KEYLEDS_FEATURE_LEDS);
+    if (feature_idx == 0) { return false; }
+
+    if ((chunks = malloc(chunks_nb * sizeof(chunks[0]))) == NULL) {
+        keyleds_set_error_errno();
+        return false;
+    }
+    chunks_nb = 0;
+    for (idx = 0; idx < queries_nb; idx += 1) {
+        for (offset = 0; offset < queries[idx].keys_nb; offset += per_call) {
+            struct leds_chunk * chunk = &chunks[chunks_nb++];
+            chunk->query = &queries[idx];
+            chunk->offset = offset;
+            chunk->keys_nb = queries[idx].keys_nb - offset < per_call
+                           ? queries[idx].keys_nb - offset : per_call;
+            chunk->done = false;
+            chunk->failed = false;
         }
+    }
 
-        for (data_offset = 4; data_offset < (unsigned)data_size; data_offset += 4) {
-            keys[done].id = data[data_offset];
-            keys[done].red = data[data_offset + 1];
-            keys[done].green = data[data_offset + 2];
-            keys[done].blue = data[data_offset + 3];
-            done += 1;
-            offset += 1;
-            if (done >= keys_nb) { break; }
+    for (idx = 0; idx < chunks_nb; idx += 1) {
+        const keyleds_block_id_t block_id = chunks[idx].query->block_id;
+        const unsigned offset = chunks[idx].query->offset + chunks[idx].offset;
+
+        if (device->pending_nb >= KEYLEDS_PIPELINE_DEPTH_MAX &&
+            !keyleds_pipeline_wait(device, target_id, KEYLEDS_PIPELINE_DEPTH_MAX - 1)) {
+            result = false;
+            break;
+        }
+        if (!keyleds_pipeline_submit(device, target_id, feature_idx, F_GET_LEDS,
+                                     4, (uint8_t[]){block_id >> 8, block_id,
+                                                    offset >> 8, offset},
+                                     0, get_leds_complete, &chunks[idx])) {
+            result = false;
+            break;
         }
     }
-    return true;
+    if (!keyleds_pipeline_drain(device, target_id)) { result = false; }
+
+    for (idx = 0; result && idx < chunks_nb; idx += 1) {
+        if (!chunks[idx].done) {
+            if (!chunks[idx].failed) { keyleds_set_error(KEYLEDS_ERROR_RESPONSE); }
+            result = false;
+        }
+    }
+    free(chunks);
+    return result;
 }
 
 KEYLEDS_EXPORT bool keyleds_set_leds(Keyleds * device, uint8_t target_id,
@@ -135,12 +206,18 @@ KEYLEDS_EXPORT bool keyleds_set_leds(Keyleds * device, uint8_t target_id,
 {
     uint16_t per_call = (device->max_report_size - 3 - 4) / 4;
     uint16_t offset, idx;
+    uint8_t feature_idx = 0;
 
     assert(device != NULL);
     assert((unsigned)block_id <= UINT16_MAX);
     assert(keys != NULL);
     assert(keys_nb <= UINT16_MAX);
 
+    if (device->pipeline_depth > 1) {
+        feature_idx = keyleds_get_feature_index(device, target_id, KEYLEDS_FEATURE_LEDS);
+        if (feature_idx == 0) { return false; }
+    }
+
     uint8_t data[4 + per_call * 4];
     data[0] = (uint8_t)(block_id >> 8);
     data[1] = (uint8_t)(block_id >> 0);
@@ -156,15 +233,31 @@ KEYLEDS_EXPORT bool keyleds_set_leds(Keyleds * device, uint8_t target_id,
             data[4 + idx * 4 + 3] = keys[offset + idx].blue;
         }
 
-        if (keyleds_call(device, NULL, 0,
-                         target_id, KEYLEDS_FEATURE_LEDS, F_SET_LEDS,
-                         4 + batch_length * 4, data) < 0) {
+        if (device->pipeline_depth > 1) {
+            if ((device->pending_nb >= KEYLEDS_PIPELINE_DEPTH_MAX ||
+                 keyleds_pipeline_pending(device, target_id) >= device->pipeline_depth) &&
+                !keyleds_pipeline_wait(device, target_id, device->pipeline_depth - 1)) {
+                return false;
+            }
+            if (!keyleds_pipeline_submit(device, target_id, feature_idx, F_SET_LEDS,
+                                         4 + batch_length * 4, data, 0, NULL, NULL)) {
+                return false;
+            }
+        } else if (keyleds_call(device, NULL, 0,
+                                target_id, KEYLEDS_FEATURE_LEDS, F_SET_LEDS,
+                                4 + batch_length * 4, data) < 0) {
             return false;
         }
     }
     return true;
 }
 
+KEYLEDS_EXPORT unsigned keyleds_leds_per_report(Keyleds * device)
+{
+    assert(device != NULL);
+    return (device->max_report_size - 3 - 4) / 4;
+}
+
 KEYLEDS_EXPORT bool keyleds_set_led_block(Keyleds * device, uint8_t target_id,
                                           keyleds_block_id_t block_id,
                                           uint8_t red, uint8_t green, uint8_t blue)
@@ -17,6 +17,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "config.h"
 #include "keyleds.h"
@@ -37,16 +38,54 @@ enum devinfo_feature_function {
 };
 
 
+struct firmware_slot {
+    struct keyleds_device_version * info;
+    unsigned    idx;
+    bool *      failed;
+};
+
+static void firmware_info_complete(Keyleds * device, keyleds_request_t request, bool success,
+                                   const uint8_t * data, size_t length, void * userdata)
+{
+    struct firmware_slot * slot = userdata;
+    struct keyleds_device_version * info = slot->info;
+    (void)device; (void)request;
+
+    if (!success || length < 16) {
+        *slot->failed = true;
+        return;
+    }
+    info->protocols[slot->idx].type = data[0];
+    memcpy(info->protocols[slot->idx].prefix, &data[1], 3);
+    info->protocols[slot->idx].prefix[3] = '\0';
+    info->protocols[slot->idx].version_major = 100
+                                             +  10 * (unsigned)(data[4] >> 4)
+                                             +   1 * (unsigned)(data[4] & 0xf);
+    info->protocols[slot->idx].version_minor =  10 * (unsigned)(data[5] >> 4)
+                                             +   1 * (unsigned)(data[5] & 0xf);
+    info->protocols[slot->idx].build = ((unsigned)data[6] << 8) | data[7];
+    info->protocols[slot->idx].is_active = (data[8] & (1<<0)) != 0;
+    info->protocols[slot->idx].product_id = ((uint16_t)data[9] << 8) | data[10];
+    memcpy(info->protocols[slot->idx].misc, &data[11], 5);
+}
+
+/* Firmware entries are independent queries, they are all sent in one burst */
 KEYLEDS_EXPORT bool keyleds_get_device_version(Keyleds * device, uint8_t target_id,
                                                struct keyleds_device_version ** out)
 {
-    uint8_t data[16];   /* max of F_GET_DEVICE_INFO and F_GET_FIRMWARE_INFO */
+    uint8_t data[16];   /* F_GET_DEVICE_INFO */
     unsigned length, idx;
+    uint8_t feature_idx;
     struct keyleds_device_version * info;
+    bool failed = false;
 
     assert(device != NULL);
     assert(out != NULL);
 
+    if ((feature_idx = keyleds_get_feature_index(device, target_id,
+                                                 KEYLEDS_FEATURE_VERSION)) == 0) {
+        return false;
+    }
     if (keyleds_call(device, data, (unsigned)sizeof(data),
                      target_id, KEYLEDS_FEATURE_VERSION, F_GET_DEVICE_INFO,
                      0, NULL) < 0) {
@@ -61,24 +100,24 @@ KEYLEDS_EXPORT bool keyleds_get_device_version(Keyleds * device, uint8_t target_
     memcpy(info->model, &data[7], 6);
     info->length = length;
 
+    {
+    struct firmware_slot slots[length > 0 ? length : 1];
     for (idx = 0; idx < length; idx += 1) {
-        if (keyleds_call(device, data, (unsigned)sizeof(data),
-                         target_id, KEYLEDS_FEATURE_VERSION, F_GET_FIRMWARE_INFO,
-                         1, (uint8_t[]){idx}) < 0) {
+        if (device->pending_nb >= KEYLEDS_PIPELINE_DEPTH_MAX &&
+            !keyleds_pipeline_wait(device, target_id, KEYLEDS_PIPELINE_DEPTH_MAX - 1)) {
             goto err_get_dev_info_free;
         }
-        info->protocols[idx].type = data[0];
-        memcpy(info->protocols[idx].prefix, &data[1], 3);
-        info->protocols[idx].prefix[3] = '\0';
-        info->protocols[idx].version_major = 100
-                                           +  10 * (unsigned)(data[4] >> 4)
-                                           +   1 * (unsigned)(data[4] & 0xf);
-        info->protocols[idx].version_minor =  10 * (unsigned)(data[5] >> 4)
-                                           +   1 * (unsigned)(data[5] & 0xf);
-        info->protocols[idx].build = ((unsigned)data[6] << 8) | data[7];
-        info->protocols[idx].is_active = (data[8] & (1<<0)) != 0;
-        info->protocols[idx].product_id = ((uint16_t)data[9] << 8) | data[10];
-        memcpy(info->protocols[idx].misc, &data[11], 5);
+        slots[idx].info = info;
+        slots[idx].idx = idx;
+        slots[idx].failed = &failed;
+        if (!keyleds_pipeline_submit(device, target_id, feature_idx, F_GET_FIRMWARE_INFO,
+                                     1, (uint8_t[]){idx}, 0,
+                                     firmware_info_complete, &slots[idx])) {
+            keyleds_pipeline_drain(device, target_id);
+            goto err_get_dev_info_free;
+        }
+    }
+    if (!keyleds_pipeline_drain(device, target_id) || failed) { goto err_get_dev_info_free; }
     }
 
     *out = info;
@@ -0,0 +1,723 @@
+/* Keyleds -- Gaming keyboard tool
+ * Copyright (C) 2017 Julien Hartmann, juli1.hartmann@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* In-process HID++ device simulator
+ *
+ * Emulates a keyboard on one end of a socket pair, the other end being used
+ * by libkeyleds as if it were a hidraw device node. Sequenced packets keep
+ * report boundaries, just like hidraw does. Requests are handled as soon as
+ * they arrive, but responses are held back for the configured latency, so
+ * pipelined requests overlap the way they do on real hardware.
+ */
+#define _GNU_SOURCE     /* for ppoll */
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "config.h"
+#include "keyleds.h"
+#include "keyleds/device.h"
+#include "keyleds/error.h"
+#include "keyleds/features.h"
+#include "keyleds/logging.h"
+#include "keyleds/simulator.h"
+
+#define SIM_REPORT_LONG     (0x11)
+#define SIM_MAX_REPORT_SIZE (63)
+#define SIM_MAX_BLOCKS      (16)
+#define SIM_MAX_KEYS        (256)
+#define SIM_GAMEMODE_MAX    (32)
+#define SIM_QUEUE_SIZE      (32)
+
+static const struct keyleds_device_reports sim_reports[] = {
+    { 0x10, 6 },
+    { SIM_REPORT_LONG, 19 },
+    { 0x12, SIM_MAX_REPORT_SIZE },
+    { DEVICE_REPORT_INVALID, 0 }
+};
+
+static const struct {
+    const char *    alias;
+    const char *    name;
+    uint8_t         model[6];
+} sim_models[] = {
+    { "g410", "Logitech G410", { 0xc3, 0x30, 0, 0, 0, 0 } },
+    { "g610", "Logitech G610", { 0xc3, 0x33, 0, 0, 0, 0 } },
+    { "g810", "Logitech G810", { 0xc3, 0x31, 0, 0, 0, 0 } },
+    { "g910", "Logitech G910", { 0xc3, 0x2b, 0, 0, 0, 0 } },
+};
+
+static const uint16_t sim_features[] = {
+    KEYLEDS_FEATURE_ROOT,
+    KEYLEDS_FEATURE_FEATURE,
+    KEYLEDS_FEATURE_VERSION,
+    KEYLEDS_FEATURE_NAME,
+    KEYLEDS_FEATURE_KEYBOARD_LAYOUT_2,
+    KEYLEDS_FEATURE_GAMEMODE,
+    KEYLEDS_FEATURE_LEDS
+};
+#define SIM_FEATURES_NB (sizeof(sim_features) / sizeof(sim_features[0]))
+
+enum sim_hidpp_error {
+    SIM_ERR_INVALID_ARGUMENT = 2,
+    SIM_ERR_OUT_OF_RANGE = 3,
+    SIM_ERR_INVALID_FEATURE_INDEX = 6,
+    SIM_ERR_INVALID_FUNCTION = 7
+};
+#define SIM_HIDPP1_ERR_INVALID_SUBID    (0x01)
+#define SIM_HIDPP1_ERR_UNKNOWN_DEVICE   (0x08)
+
+struct sim_block {
+    uint16_t    id;
+    unsigned    keys_nb;
+    uint8_t     keys[SIM_MAX_KEYS];         /* key ids, in readback order */
+    uint8_t     colors[SIM_MAX_KEYS][3];    /* current color of each key */
+};
+
+struct sim_response {
+    struct timespec due;                    /* when the response may be sent */
+    size_t      size;
+    uint8_t     data[1 + SIM_MAX_REPORT_SIZE];
+};
+
+struct sim_device {
+    int         fd;                         /* simulator end of the socket pair */
+    char        name[32];
+    uint8_t     model[6];
+    uint8_t     layout;
+    unsigned    latency;                    /* microseconds */
+    unsigned    jitter;                     /* microseconds */
+    unsigned    seed;
+    unsigned    paired;                     /* if non-zero, act as receiver with that many devices */
+
+    unsigned    blocks_nb;
+    struct sim_block blocks[SIM_MAX_BLOCKS];
+    unsigned    gamemode_nb;
+    uint8_t     gamemode[SIM_GAMEMODE_MAX];
+
+    struct sim_response queue[SIM_QUEUE_SIZE];  /* ring buffer of pending responses */
+    unsigned    queue_first;
+    unsigned    queue_nb;
+};
+
+/****************************************************************************/
+/* Setup */
+
+bool keyleds_sim_match(const char * path)
+{
+    return strncmp(path, KEYLEDS_SIM_PREFIX, strlen(KEYLEDS_SIM_PREFIX)) == 0;
+}
+
+/* Returns the value of attribute name within tag, in buffer */
+static bool xml_attribute(const char * tag, const char * tag_end, const char * name,
+                          char * buffer, size_t size)
+{
+    const size_t name_len = strlen(name);
+    const char * ptr;
+
+    for (ptr = tag + 1; ptr + name_len + 2 < tag_end; ptr += 1) {
+        if ((ptr[-1] == ' ' || ptr[-1] == '\t' || ptr[-1] == '\n') &&
+            strncmp(ptr, name, name_len) == 0 && ptr[name_len] == '=' &&
+            (ptr[name_len + 1] == '"' || ptr[name_len + 1] == '\'')) {
+            const char * value = ptr + name_len + 2;
+            const char * value_end = memchr(value, ptr[name_len + 1], tag_end - value);
+            if (value_end == NULL || (size_t)(value_end - value) >= size) { return false; }
+            memcpy(buffer, value, value_end - value);
+            buffer[value_end - value] = '\0';
+            return true;
+        }
+    }
+    return false;
+}
+
+static struct sim_block * sim_find_block(struct sim_device * sim, uint16_t block_id)
+{
+    unsigned idx;
+    for (idx = 0; idx < sim->blocks_nb; idx += 1) {
+        if (sim->blocks[idx].id == block_id) { return &sim->blocks[idx]; }
+    }
+    return NULL;
+}
+
+static void sim_add_key(struct sim_device * sim, uint16_t block_id, uint8_t key_id)
+{
+    struct sim_block * block = sim_find_block(sim, block_id);
+    unsigned idx;
+
+    if (block == NULL) {
+        if (sim->blocks_nb >= SIM_MAX_BLOCKS) { return; }
+        block = &sim->blocks[sim->blocks_nb++];
+        block->id = block_id;
+        block->keys_nb = 0;
+    }
+    for (idx = 0; idx < block->keys_nb; idx += 1) {
+        if (block->keys[idx] == key_id) { return; }
+    }
+    if (block->keys_nb < SIM_MAX_KEYS) { block->keys[block->keys_nb++] = key_id; }
+}
+
+/* Load key blocks from a keyledsd layout file. Only <keyboard zone> and
+ * <key code> matter here, so a minimal tag scanner is enough. */
+static bool sim_load_layout(struct sim_device * sim, const char * dir)
+{
+    char path[PATH_MAX], value[16];
+    char * content;
+    const char * ptr;
+    uint16_t zone = 0;
+    long size;
+    FILE * file;
+
+    snprintf(path, sizeof(path), "%s/%02x%02x%02x%02x%02x%02x_%04x.xml", dir,
+             sim->model[0], sim->model[1], sim->model[2],
+             sim->model[3], sim->model[4], sim->model[5], sim->layout);
+    if ((file = fopen(path, "r")) == NULL) { return false; }
+    if (fseek(file, 0, SEEK_END) < 0 || (size = ftell(file)) < 0 ||
+        fseek(file, 0, SEEK_SET) < 0 || (content = malloc(size + 1)) == NULL) {
+        fclose(file);
+        return false;
+    }
+    size = (long)fread(content, 1, size, file);
+    content[size] = '\0';
+    fclose(file);
+
+    for (ptr = strchr(content, '<'); ptr != NULL; ptr = strchr(ptr + 1, '<')) {
+        const char * tag_end = strchr(ptr, '>');
+        if (tag_end == NULL) { break; }
+
+        if (strncmp(ptr, "<keyboard", 9) == 0 &&
+            xml_attribute(ptr, tag_end, "zone", value, sizeof(value))) {
+            zone = (uint16_t)strtoul(value, NULL, 0);
+        } else if (strncmp(ptr, "<key ", 5) == 0 && zone != 0 &&
+                   xml_attribute(ptr, tag_end, "code", value, sizeof(value))) {
+            sim_add_key(sim, zone, (uint8_t)strtoul(value, NULL, 0));
+        }
+    }
+    free(content);
+    KEYLEDS_LOG(DEBUG, "simulator loaded %u blocks from %s", sim->blocks_nb, path);
+    return sim->blocks_nb > 0;
+}
+
+static bool sim_parse_path(struct sim_device * sim, const char * path, char * layouts,
+                           size_t layouts_size)
+{
+    const char * model = path + strlen(KEYLEDS_SIM_PREFIX);
+    const size_t model_len = strcspn(model, "?");
+    const char * option;
+    unsigned idx;
+
+    for (idx = 0; idx < sizeof(sim_models) / sizeof(sim_models[0]); idx += 1) {
+        if (strlen(sim_models[idx].alias) == model_len &&
+            strncmp(sim_models[idx].alias, model, model_len) == 0) {
+            memcpy(sim->model, sim_models[idx].model, sizeof(sim->model));
+            snprintf(sim->name, sizeof(sim->name), "%s", sim_models[idx].name);
+            break;
+        }
+    }
+    if (idx == sizeof(sim_models) / sizeof(sim_models[0])) {
+        if (model_len != 2 * sizeof(sim->model)) { return false; }
+        for (idx = 0; idx < sizeof(sim->model); idx += 1) {
+            unsigned byte;
+            if (sscanf(model + 2 * idx, "%2x", &byte) != 1) { return false; }
+            sim->model[idx] = (uint8_t)byte;
+        }
+        snprintf(sim->name, sizeof(sim->name), "Simulated %.12s", model);
+    }
+
+    for (option = strchr(model, '?'); option != NULL; option = strchr(option + 1, '&')) {
+        const char * value = option + 1 + strcspn(option + 1, "=&");
+        const size_t value_len = strcspn(value + 1, "&");
+        if (*value != '=') { return false; }
+
+        if (strncmp(option + 1, "latency=", 8) == 0) {
+            sim->latency = (unsigned)strtoul(value + 1, NULL, 0);
+        } else if (strncmp(option + 1, "jitter=", 7) == 0) {
+            sim->jitter = (unsigned)strtoul(value + 1, NULL, 0);
+        } else if (strncmp(option + 1, "layout=", 7) == 0) {
+            sim->layout = (uint8_t)strtoul(value + 1, NULL, 0);
+        } else if (strncmp(option + 1, "paired=", 7) == 0) {
+            sim->paired = (unsigned)strtoul(value + 1, NULL, 0);
+            if (sim->paired > KEYLEDS_TARGET_PAIRED_MAX) { return false; }
+        } else if (strncmp(option + 1, "seed=", 5) == 0) {
+            sim->seed = (unsigned)strtoul(value + 1, NULL, 0);
+        } else if (strncmp(option + 1, "layouts=", 8) == 0 && value_len < layouts_size) {
+            memcpy(layouts, value + 1, value_len);
+            layouts[value_len] = '\0';
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/****************************************************************************/
+/* Feature handlers
+ *
+ * Each handler gets the request parameters and fills the response payload.
+ * They return 0 on success or a HID++ error code.
+ */
+
+static int sim_feature_root(struct sim_device * sim, unsigned function,
+                            const uint8_t * params, uint8_t * out, size_t * out_len)
+{
+    unsigned idx;
+    (void)sim;
+
+    switch (function) {
+    case 0:     /* get feature */
+        for (idx = 0; idx < SIM_FEATURES_NB; idx += 1) {
+            if (sim_features[idx] == ((uint16_t)params[0] << 8 | params[1])) { break; }
+        }
+        out[0] = idx < SIM_FEATURES_NB ? idx : 0;
+        out[1] = 0;
+        *out_len = 2;
+        return 0;
+    case 1:     /* ping */
+        out[0] = 4;
+        out[1] = 2;
+        out[2] = params[2];
+        *out_len = 3;
+        return 0;
+    }
+    return SIM_ERR_INVALID_FUNCTION;
+}
+
+static int sim_feature_feature(struct sim_device * sim, unsigned function,
+                               const uint8_t * params, uint8_t * out, size_t * out_len)
+{
+    (void)sim;
+
+    switch (function) {
+    case 0:     /* get feature count */
+        out[0] = SIM_FEATURES_NB - 1;
+        *out_len = 1;
+        return 0;
+    case 1:     /* get feature id */
+        if (params[0] == 0 || params[0] >= SIM_FEATURES_NB) { return SIM_ERR_OUT_OF_RANGE; }
+        out[0] = sim_features[params[0]] >> 8;
+        out[1] = sim_features[params[0]] & 0xff;
+        out[2] = 0;
+        *out_len = 3;
+        return 0;
+    }
+    return SIM_ERR_INVALID_FUNCTION;
+}
+
+static int sim_feature_version(struct sim_device * sim, unsigned function,
+                               const uint8_t * params, uint8_t * out, size_t * out_len)
+{
+    switch (function) {
+    case 0:     /* get device info */
+        out[0] = 1;                                     /* firmware entities */
+        memcpy(&out[1], (uint8_t[]){0x5e, 0x1a, 0x1d, 0x00}, 4);  /* serial */
+        out[5] = 0x00; out[6] = 0x04;                   /* transport: usb */
+        memcpy(&out[7], sim->model, 6);
+        *out_len = 13;
+        return 0;
+    case 1:     /* get firmware info */
+        if (params[0] != 0) { return SIM_ERR_OUT_OF_RANGE; }
+        out[0] = 0;                                     /* main application */
+        memcpy(&out[1], "SIM", 3);
+        out[4] = 0x01; out[5] = 0x00;                   /* version 101.0 */
+        out[6] = 0x00; out[7] = 0x01;                   /* build */
+        out[8] = 1;                                     /* active */
+        out[9] = sim->model[0]; out[10] = sim->model[1];
+        memset(&out[11], 0, 5);
+        *out_len = 16;
+        return 0;
+    }
+    return SIM_ERR_INVALID_FUNCTION;
+}
+
+static int sim_feature_name(struct sim_device * sim, unsigned function,
+                            const uint8_t * params, uint8_t * out, size_t * out_len)
+{
+    const size_t length = strlen(sim->name);
+
+    switch (function) {
+    case 0:     /* get name length */
+        out[0] = (uint8_t)length;
+        *out_len = 1;
+        return 0;
+    case 1:     /* get name */
+        if (params[0] >= length) { return SIM_ERR_OUT_OF_RANGE; }
+        *out_len = length - params[0] < 16 ? length - params[0] : 16;
+        memcpy(out, sim->name + params[0], *out_len);
+        return 0;
+    case 2:     /* get type */
+        out[0] = KEYLEDS_DEVICE_TYPE_KEYBOARD;
+        *out_len = 1;
+        return 0;
+    }
+    return SIM_ERR_INVALID_FUNCTION;
+}
+
+static int sim_feature_layout(struct sim_device * sim, unsigned function,
+                              const uint8_t * params, uint8_t * out, size_t * out_len)
+{
+    (void)params;
+    if (function != 0) { return SIM_ERR_INVALID_FUNCTION; }
+    out[0] = sim->layout;
+    *out_len = 1;
+    return 0;
+}
+
+static int sim_feature_gamemode(struct sim_device * sim, unsigned function,
+                                const uint8_t * params, uint8_t * out, size_t * out_len)
+{
+    unsigned idx, jdx;
+
+    *out_len = 0;
+    switch (function) {
+    case 0:     /* get max */
+        out[0] = SIM_GAMEMODE_MAX;
+        *out_len = 1;
+        return 0;
+    case 1:     /* block keys */
+        for (idx = 0; idx < 16 && params[idx] != 0; idx += 1) {
+            for (jdx = 0; jdx < sim->gamemode_nb; jdx += 1) {
+                if (sim->gamemode[jdx] == params[idx]) { break; }
+            }
+            if (jdx < sim->gamemode_nb) { continue; }
+            if (sim->gamemode_nb >= SIM_GAMEMODE_MAX) { return SIM_ERR_OUT_OF_RANGE; }
+            sim->gamemode[sim->gamemode_nb++] = params[idx];
+        }
+        return 0;
+    case 2:     /* unblock keys */
+        for (idx = 0; idx < 16 && params[idx] != 0; idx += 1) {
+            for (jdx = 0; jdx < sim->gamemode_nb; jdx += 1) {
+                if (sim->gamemode[jdx] == params[idx]) {
+                    sim->gamemode[jdx] = sim->gamemode[--sim->gamemode_nb];
+                    break;
+                }
+            }
+        }
+        return 0;
+    case 3:     /* clear */
+        sim->gamemode_nb = 0;
+        return 0;
+    }
+    return SIM_ERR_INVALID_FUNCTION;
+}
+
+static int sim_feature_leds(struct sim_device * sim, unsigned function,
+                            const uint8_t * params, size_t params_len,
+                            uint8_t * out, size_t * out_len)
+{
+    const uint16_t block_id = (uint16_t)params[0] << 8 | params[1];
+    struct sim_block * block;
+    unsigned idx, jdx, count;
+
+    *out_len = 0;
+    switch (function) {
+    case 0:     /* get keyblocks */
+        count = 0;
+        for (idx = 0; idx < sim->blocks_nb; idx += 1) { count |= sim->blocks[idx].id; }
+        out[0] = count >> 8;
+        out[1] = count & 0xff;
+        *out_len = 2;
+        return 0;
+    case 1:     /* get block info */
+        if ((block = sim_find_block(sim, block_id)) == NULL) { return SIM_ERR_INVALID_ARGUMENT; }
+        out[0] = block->keys_nb >> 8;
+        out[1] = block->keys_nb & 0xff;
+        out[2] = out[3] = out[4] = 0xff;
+        *out_len = 5;
+        return 0;
+    case 2:     /* get leds */
+        if ((block = sim_find_block(sim, block_id)) == NULL) { return SIM_ERR_INVALID_ARGUMENT; }
+        count = (unsigned)params[2] << 8 | params[3];
+        memcpy(out, params, 4);
+        *out_len = 4;
+        /* Readback fills the largest report, as real devices do */
+        for (idx = count; idx < block->keys_nb && *out_len + 4 <= SIM_MAX_REPORT_SIZE - 3;
+             idx += 1) {
+            out[(*out_len)++] = block->keys[idx];
+            memcpy(&out[*out_len], block->colors[idx], 3);
+            *out_len += 3;
+        }
+        while (*out_len + 4 <= SIM_MAX_REPORT_SIZE - 3) { out[(*out_len)++] = 0; }
+        return 0;
+    case 3:     /* set leds */
+        if ((block = sim_find_block(sim, block_id)) == NULL) { return SIM_ERR_INVALID_ARGUMENT; }
+        count = (unsigned)params[2] << 8 | params[3];
+        if (4 + count * 4 > params_len) { return SIM_ERR_INVALID_ARGUMENT; }
+        for (idx = 0; idx < count; idx += 1) {
+            for (jdx = 0; jdx < block->keys_nb; jdx += 1) {
+                if (block->keys[jdx] == params[4 + idx * 4]) {
+                    memcpy(block->colors[jdx], &params[4 + idx * 4 + 1], 3);
+                    break;
+                }
+            }
+        }
+        return 0;
+    case 4:     /* set block leds */
+        if ((block = sim_find_block(sim, block_id)) == NULL) { return SIM_ERR_INVALID_ARGUMENT; }
+        for (idx = 0; idx < block->keys_nb; idx += 1) {
+            memcpy(block->colors[idx], &params[2], 3);
+        }
+        return 0;
+    case 5:     /* commit */
+        return 0;
+    }
+    return SIM_ERR_INVALID_FUNCTION;
+}
+
+/****************************************************************************/
+/* Report handling */
+
+static void sim_timespec_add(struct timespec * ts, long us)
+{
+    ts->tv_sec += us / 1000000;
+    ts->tv_nsec += (us % 1000000) * 1000;
+    if (ts->tv_nsec >= 1000000000) { ts->tv_sec += 1; ts->tv_nsec -= 1000000000; }
+    if (ts->tv_nsec < 0) { ts->tv_sec -= 1; ts->tv_nsec += 1000000000; }
+}
+
+static bool sim_timespec_before(const struct timespec * lhs, const struct timespec * rhs)
+{
+    return lhs->tv_sec < rhs->tv_sec ||
+           (lhs->tv_sec == rhs->tv_sec && lhs->tv_nsec < rhs->tv_nsec);
+}
+
+/* Queue a response, to be sent once latency has elapsed. Responses are never
+ * reordered, as the USB link does not. */
+static void sim_queue_response(struct sim_device * sim, const uint8_t * payload, size_t length)
+{
+    struct sim_response * response;
+    const struct sim_response * previous;
+    unsigned idx;
+    long delay = sim->latency;
+
+    assert(sim->queue_nb < SIM_QUEUE_SIZE);
+    response = &sim->queue[(sim->queue_first + sim->queue_nb) % SIM_QUEUE_SIZE];
+
+    for (idx = 0; sim_reports[idx].id != DEVICE_REPORT_INVALID; idx += 1) {
+        if (sim_reports[idx].id >= SIM_REPORT_LONG && sim_reports[idx].size >= length) { break; }
+    }
+    assert(sim_reports[idx].id != DEVICE_REPORT_INVALID);
+    response->data[0] = sim_reports[idx].id;
+    memcpy(&response->data[1], payload, length);
+    memset(&response->data[1 + length], 0, sim_reports[idx].size - length);
+    response->size = 1 + sim_reports[idx].size;
+
+    if (sim->jitter > 0) {
+        delay += (long)(rand_r(&sim->seed) % (2 * sim->jitter + 1)) - (long)sim->jitter;
+        if (delay < 0) { delay = 0; }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &response->due);
+    sim_timespec_add(&response->due, delay);
+    if (sim->queue_nb > 0) {
+        previous = &sim->queue[(sim->queue_first + sim->queue_nb - 1) % SIM_QUEUE_SIZE];
+        if (sim_timespec_before(&response->due, &previous->due)) {
+            response->due = previous->due;
+        }
+    }
+    sim->queue_nb += 1;
+}
+
+static void sim_handle_report(struct sim_device * sim, const uint8_t * report, size_t size)
+{
+    uint8_t response[SIM_MAX_REPORT_SIZE];
+    const uint8_t feature_idx = report[2];
+    const unsigned function = report[3] >> 4;
+    size_t length = 0;
+    int error;
+
+    if (size < 1 + 3 + 3) { return; }   /* not a HID++ report */
+    memset(response, 0, sizeof(response));
+
+    if (sim->paired > 0 ? report[1] < KEYLEDS_TARGET_PAIRED_MIN || report[1] > sim->paired
+                        : report[1] != KEYLEDS_TARGET_DEFAULT) {
+        /* No paired device behind that target: answer like HID++ 1.0 receivers */
+        response[0] = report[1];
+        response[1] = 0x8f;
+        response[2] = feature_idx;
+        response[3] = report[3];
+        response[4] = report[1] == KEYLEDS_TARGET_DEFAULT ? SIM_HIDPP1_ERR_INVALID_SUBID
+                                                          : SIM_HIDPP1_ERR_UNKNOWN_DEVICE;
+        sim_queue_response(sim, response, 5);
+        return;
+    }
+
+    const uint8_t * params = &report[4];
+    const size_t params_len = size - 4;
+    uint8_t * out = &response[3];
+
+    switch (feature_idx < SIM_FEATURES_NB ? sim_features[feature_idx] : 0xffff) {
+    case KEYLEDS_FEATURE_ROOT:
+        error = sim_feature_root(sim, function, params, out, &length); break;
+    case KEYLEDS_FEATURE_FEATURE:
+        error = sim_feature_feature(sim, function, params, out, &length); break;
+    case KEYLEDS_FEATURE_VERSION:
+        error = sim_feature_version(sim, function, params, out, &length); break;
+    case KEYLEDS_FEATURE_NAME:
+        error = sim_feature_name(sim, function, params, out, &length); break;
+    case KEYLEDS_FEATURE_KEYBOARD_LAYOUT_2:
+        error = sim_feature_layout(sim, function, params, out, &length); break;
+    case KEYLEDS_FEATURE_GAMEMODE:
+        error = sim_feature_gamemode(sim, function, params, out, &length); break;
+    case KEYLEDS_FEATURE_LEDS:
+        error = sim_feature_leds(sim, function, params, params_len, out, &length); break;
+    default:
+        error = SIM_ERR_INVALID_FEATURE_INDEX;
+    }
+
+    response[0] = report[1];
+    if (error != 0) {
+        response[1] = 0xff;
+        response[2] = feature_idx;
+        response[3] = report[3];
+        response[4] = (uint8_t)error;
+        length = 5;
+    } else {
+        response[1] = feature_idx;
+        response[2] = report[3];
+        length += 3;
+    }
+    sim_queue_response(sim, response, length);
+}
+
+static void * sim_thread(void * arg)
+{
+    struct sim_device * sim = arg;
+    uint8_t report[1 + SIM_MAX_REPORT_SIZE + 1];
+
+    for (;;) {
+        struct pollfd pfd = { .fd = sim->fd, .events = 0 };
+        struct timespec now, timeout;
+        ssize_t nread;
+        int ret;
+
+        /* Stop reading while queue is full, so the client blocks as it would on USB */
+        if (sim->queue_nb < SIM_QUEUE_SIZE) { pfd.events = POLLIN; }
+
+        if (sim->queue_nb > 0) {
+            const struct sim_response * next = &sim->queue[sim->queue_first];
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (sim_timespec_before(&now, &next->due)) {
+                timeout.tv_sec = next->due.tv_sec - now.tv_sec;
+                timeout.tv_nsec = next->due.tv_nsec - now.tv_nsec;
+                if (timeout.tv_nsec < 0) { timeout.tv_sec -= 1; timeout.tv_nsec += 1000000000; }
+            } else {
+                timeout.tv_sec = timeout.tv_nsec = 0;
+            }
+        }
+
+        ret = ppoll(&pfd, 1, sim->queue_nb > 0 ? &timeout : NULL, NULL);
+        if (ret < 0 && errno != EINTR) { break; }
+
+        if (ret > 0 && (pfd.revents & POLLIN) != 0) {
+            if ((nread = recv(sim->fd, report, sizeof(report), 0)) <= 0) { break; }
+            sim_handle_report(sim, report, (size_t)nread);
+        } else if (ret > 0 && (pfd.revents & (POLLHUP | POLLERR)) != 0) {
+            break;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        while (sim->queue_nb > 0 && !sim_timespec_before(&now, &sim->queue[sim->queue_first].due)) {
+            const struct sim_response * response = &sim->queue[sim->queue_first];
+            if (send(sim->fd, response->data, response->size, MSG_NOSIGNAL) < 0) { goto exit; }
+            sim->queue_first = (sim->queue_first + 1) % SIM_QUEUE_SIZE;
+            sim->queue_nb -= 1;
+        }
+    }
+exit:
+    KEYLEDS_LOG(DEBUG, "simulator for %s exiting", sim->name);
+    close(sim->fd);
+    free(sim);
+    return NULL;
+}
+
+int keyleds_sim_open(const char * path, struct keyleds_device_reports ** reports,
+                     unsigned * max_report_size)
+{
+    char layouts[PATH_MAX] = KEYLEDS_SIM_LAYOUT_DIR;
+    struct sim_device * sim;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int fds[2];
+
+    assert(path != NULL);
+    assert(reports != NULL);
+    assert(max_report_size != NULL);
+
+    if ((sim = calloc(1, sizeof(*sim))) == NULL) {
+        keyleds_set_error_errno();
+        return -1;
+    }
+    sim->layout = 2;            /* international */
+    sim->seed = 1;
+    if (!sim_parse_path(sim, path, layouts, sizeof(layouts))) {
+        KEYLEDS_LOG(ERROR, "Invalid simulator specification %s", path);
+        errno = EINVAL;
+        keyleds_set_error_errno();
+        goto error_free_sim;
+    }
+
+    if (!sim_load_layout(sim, layouts)) {
+        /* No layout file, make up a plain keyboard */
+        unsigned code;
+        KEYLEDS_LOG(WARNING, "No layout for simulated device in %s, using defaults", layouts);
+        sim->blocks_nb = 0;
+        for (code = 0x04; code <= 0x65; code += 1) { sim_add_key(sim, KEYLEDS_BLOCK_KEYS, code); }
+        sim_add_key(sim, KEYLEDS_BLOCK_MODES, 0x01);
+        sim_add_key(sim, KEYLEDS_BLOCK_MODES, 0x02);
+    }
+
+    if ((*reports = malloc(sizeof(sim_reports))) == NULL) {
+        keyleds_set_error_errno();
+        goto error_free_sim;
+    }
+    memcpy(*reports, sim_reports, sizeof(sim_reports));
+    *max_report_size = SIM_MAX_REPORT_SIZE;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        keyleds_set_error_errno();
+        goto error_free_reports;
+    }
+    sim->fd = fds[1];
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    errno = pthread_create(&thread, &attr, sim_thread, sim);
+    pthread_attr_destroy(&attr);
+    if (errno != 0) {
+        keyleds_set_error_errno();
+        goto error_close_fds;
+    }
+
+    KEYLEDS_LOG(INFO, "Simulating %s (latency %uus, jitter %uus)",
+                sim->name, sim->latency, sim->jitter);
+    return fds[0];
+
+error_close_fds:
+    close(fds[0]);
+    close(fds[1]);
+error_free_reports:
+    free(*reports);
+error_free_sim:
+    free(sim);
+    return -1;
+}
@@ -0,0 +1,185 @@
+/* Keyleds -- Gaming keyboard tool
+ * Copyright (C) 2017 Julien Hartmann, juli1.hartmann@gmail.com
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "config.h"
+#include "keyleds.h"
+#include "keyleds/device.h"
+#include "keyleds/error.h"
+#include "keyleds/stats.h"
+
+/****************************************************************************/
+/* Histogram buckets
+ *
+ * Values below 4 get a bucket each. Above that, each power of two is split in
+ * four buckets, so relative resolution stays within 25%. With 64 buckets the
+ * last one starts at 114688us.
+ */
+
+static unsigned stats_bucket(unsigned long value)
+{
+    unsigned msb, bucket;
+
+    if (value < 4) { return (unsigned)value; }
+    msb = (unsigned)(sizeof(value) * CHAR_BIT - 1) - (unsigned)__builtin_clzl(value);
+    bucket = 4 * (msb - 1) + (unsigned)((value >> (msb - 2)) & 3);
+    return bucket < KEYLEDS_STATS_BUCKETS ? bucket : KEYLEDS_STATS_BUCKETS - 1;
+}
+
+KEYLEDS_EXPORT unsigned long keyleds_stats_bucket_limit(unsigned bucket)
+{
+    if (bucket >= KEYLEDS_STATS_BUCKETS - 1) { return ULONG_MAX; }
+    if (bucket < 4) { return bucket + 1; }
+    return (5ul + bucket % 4) << (bucket / 4 - 1);
+}
+
+/****************************************************************************/
+/* Recording */
+
+static struct keyleds_stats_entry * stats_entry(struct keyleds_stats * stats, uint8_t target_id,
+                                                uint8_t feature_idx, uint8_t function)
+{
+    struct keyleds_stats_entry * entry;
+    unsigned idx;
+
+    /* Devices use a handful of functions, a linear search beats hashing */
+    for (idx = 0; idx < stats->length; idx += 1) {
+        entry = &stats->entries[idx];
+        if (entry->feature_idx == feature_idx && entry->function == function &&
+            entry->target_id == target_id) { return entry; }
+    }
+    if (stats->length >= KEYLEDS_STATS_ENTRIES) { return NULL; }
+
+    entry = &stats->entries[stats->length++];
+    entry->target_id = target_id;
+    entry->feature_idx = feature_idx;
+    entry->function = function;
+    return entry;
+}
+
+void keyleds_stats_sent(Keyleds * device, uint8_t target_id,
+                        uint8_t feature_idx, uint8_t function, size_t size)
+{
+    struct keyleds_stats_state * state = device->stats;
+    struct keyleds_stats_entry * entry;
+    assert(state != NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &state->last_sent);
+    state->last_function = function;
+
+    entry = stats_entry(&state->stats, target_id, feature_idx, function);
+    if (entry == NULL) {
+        state->stats.untracked += 1;
+        return;
+    }
+    entry->requests += 1;
+    entry->bytes_sent += size;
+}
+
+void keyleds_stats_received(Keyleds * device, uint8_t target_id,
+                            uint8_t feature_idx, uint8_t function,
+                            const struct timespec * sent, size_t size, bool error)
+{
+    struct keyleds_stats_state * state = device->stats;
+    struct keyleds_stats_entry * entry;
+    struct timespec now;
+    unsigned long latency;
+    assert(state != NULL);
+
+    entry = stats_entry(&state->stats, target_id, feature_idx, function);
+    if (entry == NULL) { return; }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    latency = (unsigned long)(now.tv_sec - sent->tv_sec) * 1000000ul
+            + (unsigned long)(now.tv_nsec / 1000) - (unsigned long)(sent->tv_nsec / 1000);
+
+    entry->responses += 1;
+    if (error) { entry->errors += 1; }
+    entry->bytes_received += size;
+    entry->latency_total += latency;
+    if (latency > entry->latency_max) { entry->latency_max = latency; }
+    entry->latency[stats_bucket(latency)] += 1;
+}
+
+void keyleds_stats_timeout(Keyleds * device, uint8_t target_id,
+                           uint8_t feature_idx, uint8_t function)
+{
+    struct keyleds_stats_entry * entry;
+    assert(device->stats != NULL);
+
+    entry = stats_entry(&device->stats->stats, target_id, feature_idx, function);
+    if (entry != NULL) { entry->timeouts += 1; }
+}
+
+void keyleds_stats_discarded(Keyleds * device)
+{
+    assert(device->stats != NULL);
+    device->stats->stats.discarded += 1;
+}
+
+/****************************************************************************/
+/* Public interface */
+
+KEYLEDS_EXPORT bool keyleds_stats_enable(Keyleds * device, bool enable)
+{
+    assert(device != NULL);
+
+    if (!enable) {
+        free(device->stats);
+        device->stats = NULL;
+        return true;
+    }
+    if (device->stats == NULL) {
+        if ((device->stats = calloc(1, sizeof(*device->stats))) == NULL) {
+            keyleds_set_error_errno();
+            return false;
+        }
+    } else {
+        memset(device->stats, 0, sizeof(*device->stats));
+    }
+    return true;
+}
+
+KEYLEDS_EXPORT bool keyleds_get_stats(Keyleds * device, struct keyleds_stats * stats)
+{
+    unsigned idx;
+
+    assert(device != NULL);
+    assert(stats != NULL);
+
+    if (device->stats == NULL) {
+        errno = EINVAL;             /* statistics were not enabled */
+        keyleds_set_error_errno();
+        return false;
+    }
+    *stats = device->stats->stats;
+
+    /* Recording only knows indices, feature ids are resolved now so the hot
+     * path never looks anything up. This may query the device. */
+    for (idx = 0; idx < stats->length; idx += 1) {
+        struct keyleds_stats_entry * entry = &stats->entries[idx];
+        entry->feature_id = keyleds_get_feature_id(device, entry->target_id,
+                                                   entry->feature_idx);
+    }
+    return true;
+}
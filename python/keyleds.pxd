@@ -14,9 +14,10 @@
 # You should have received a copy of the GNU General Public License
 # along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-cdef extern from "keyleds.h":
+cdef extern from "keyleds.h" nogil:
     ctypedef unsigned int uint8_t
     ctypedef unsigned int uint16_t
+    ctypedef bint keyleds_bool "bool"
     ctypedef struct Keyleds:
         pass
 
@@ -106,6 +107,17 @@ cdef extern from "keyleds.h":
                                uint8_t red, uint8_t green, uint8_t blue)
     bint keyleds_commit_leds(Keyleds * device, uint8_t target_id)
 
+    ctypedef unsigned keyleds_request_t
+    ctypedef void (*keyleds_completion_cb)(Keyleds * device, keyleds_request_t request,
+                                           keyleds_bool success, const uint8_t * data,
+                                           size_t length, void * userdata)
+    keyleds_request_t keyleds_submit(Keyleds * device, uint8_t target_id, uint16_t feature_id,
+                                     uint8_t function, size_t length, const uint8_t * data,
+                                     keyleds_completion_cb callback, void * userdata)
+    int keyleds_process_events(Keyleds * device)
+    unsigned keyleds_get_timeout(Keyleds * device)
+    unsigned keyleds_pending_requests(Keyleds * device)
+
     const char * keyleds_get_error_str()
 
     cdef struct keyleds_indexed_string:
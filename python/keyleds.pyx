@@ -18,6 +18,44 @@ cimport keyleds as pykeyleds
 from libc.stdio cimport sprintf
 from libc.stdlib cimport free, malloc
 from cpython cimport Py_INCREF, PyTuple_New, PyTuple_SET_ITEM
+from cpython.buffer cimport (PyObject_GetBuffer, PyBuffer_Release,
+                             PyBUF_C_CONTIGUOUS, PyBUF_WRITABLE)
+from cpython.pythread cimport (PyThread_type_lock, PyThread_allocate_lock, PyThread_free_lock,
+                               PyThread_acquire_lock, PyThread_release_lock,
+                               NOWAIT_LOCK, WAIT_LOCK)
+import asyncio
+
+
+cdef void _request_complete(pykeyleds.Keyleds * device, pykeyleds.keyleds_request_t request,
+                            pykeyleds.keyleds_bool success, const uint8_t * data, size_t length,
+                            void * userdata) noexcept with gil:
+    cdef Device owner = <Device>userdata
+    callback = owner._requests.pop(request, None)
+    if callback is not None:
+        if success:
+            callback((<const char *>data)[:length])
+        else:
+            callback(IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8')))
+
+
+def _resolve_future(future, result):
+    if future.cancelled():
+        return
+    if isinstance(result, Exception):
+        future.set_exception(result)
+    else:
+        future.set_result(result)
+
+
+# Key color buffers map directly onto an array of struct keyleds_key_color,
+# that is 4 bytes per key: id, red, green, blue. Any C-contiguous buffer of
+# bytes works: bytes, bytearray, memoryview or a numpy array of N x 4 uint8.
+cdef int _get_key_buffer(object buffer, Py_buffer * view, int flags) except -1:
+    PyObject_GetBuffer(buffer, view, flags | PyBUF_C_CONTIGUOUS)
+    if view.itemsize != 1 or view.len % sizeof(pykeyleds.keyleds_key_color) != 0:
+        PyBuffer_Release(view)
+        raise ValueError('Key buffer must hold %d bytes per key' % sizeof(pykeyleds.keyleds_key_color))
+    return 0
 
 
 cdef class DeviceVersion:
@@ -96,10 +134,17 @@ cdef class KeyColor:
         return 'KeyColor(KEY_%s, id=%s, %r' % (name.decode('UTF-8'), self.id, self.color)
 
 
+# Device I/O runs without the GIL, so threads driving different devices do not
+# wait on each other's USB round trips. A per-device lock keeps each libkeyleds
+# handle used by one thread at a time, as it requires.
 cdef class Device:
     cdef pykeyleds.Keyleds * _device
+    cdef PyThread_type_lock _lock
     cdef uint8_t _target_id
     cdef unsigned _gamemode_max
+    cdef dict _requests             # completion callbacks of submitted requests, by handle
+    cdef object _loop               # asyncio loop watching fd while requests are pending
+    cdef object _timer              # loop timer expiring requests whose response is lost
 
     cdef str path
     cdef object _protocol_version
@@ -113,9 +158,16 @@ cdef class Device:
     cdef object _leds
 
     def __cinit__(self, str path, uint8_t app_id, uint8_t target_id=0xff):
+        cdef const char * c_path
         self.path = path
+        self._requests = {}
+        self._lock = PyThread_allocate_lock()
+        if self._lock is NULL:
+            raise MemoryError()
         b_path = path.encode('UTF-8')
-        self._device = pykeyleds.keyleds_open(b_path, app_id)
+        c_path = b_path
+        with nogil:
+            self._device = pykeyleds.keyleds_open(c_path, app_id)
         self._target_id = target_id
         if self._device is NULL:
             raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
@@ -123,20 +175,45 @@ cdef class Device:
     def __dealloc__(self):
         if self._device is not NULL:
             pykeyleds.keyleds_close(self._device)
+        if self._lock is not NULL:
+            PyThread_free_lock(self._lock)
+
+    cdef inline int _acquire(self) except -1 nogil:
+        # Device may have been closed by another thread while we waited for it
+        PyThread_acquire_lock(self._lock, WAIT_LOCK)
+        if self._device is NULL:
+            PyThread_release_lock(self._lock)
+            with gil:
+                raise ValueError('I/O operation on closed device.')
+        return 0
+
+    cdef inline void _release(self) noexcept nogil:
+        PyThread_release_lock(self._lock)
 
     cdef _query_protocol(self):
         cdef unsigned version
         cdef pykeyleds.keyleds_device_handler_t handler
-        if not pykeyleds.keyleds_get_protocol(self._device, self._target_id,
-                                              &version, &handler):
+        cdef bint ok
+        with nogil:
+            self._acquire()
+            ok = pykeyleds.keyleds_get_protocol(self._device, self._target_id,
+                                                &version, &handler)
+            self._release()
+        if not ok:
             raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
         self._protocol_version = version
         self._handler = handler
 
     def close(self):
         if self._device is not NULL:
-            pykeyleds.keyleds_close(self._device)
-            self._device = NULL
+            self._unwatch()
+            with nogil:
+                PyThread_acquire_lock(self._lock, WAIT_LOCK)
+                if self._device is not NULL:    # not closed by another thread meanwhile
+                    pykeyleds.keyleds_close(self._device)
+                    self._device = NULL
+                self._release()
+            self._fail_requests(IOError('Device closed'))
 
     @property
     def fd(self):
@@ -163,28 +240,41 @@ cdef class Device:
         return self._handler
 
     def ping(self):
+        cdef bint ok
         if self._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
-        if not pykeyleds.keyleds_ping(self._device, self._target_id):
+        with nogil:
+            self._acquire()
+            ok = pykeyleds.keyleds_ping(self._device, self._target_id)
+            self._release()
+        if not ok:
             raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
 
     @property
     def features(self):
-        cdef unsigned count
+        cdef unsigned count, idx
+        cdef uint16_t c_id
         cdef tuple feature_list
         cdef object f_id
         if self._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
         if self._features is None:
-            count = pykeyleds.keyleds_get_feature_count(self._device, self._target_id)
+            with nogil:
+                self._acquire()
+                count = pykeyleds.keyleds_get_feature_count(self._device, self._target_id)
+                self._release()
             if count == 0:
                 raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
 
             feature_list = PyTuple_New(count)
             for idx in range(count):
-                f_id = pykeyleds.keyleds_get_feature_id(self._device, self._target_id, idx + 1)
+                with nogil:
+                    self._acquire()
+                    c_id = pykeyleds.keyleds_get_feature_id(self._device, self._target_id, idx + 1)
+                    self._release()
+                f_id = c_id
                 if f_id == 0:
                     raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
                 Py_INCREF(f_id) # SET_ITEM steals the ref
@@ -195,11 +285,16 @@ cdef class Device:
     @property
     def name(self):
         cdef char * name
+        cdef bint ok
         if self._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
         if self._name is None:
-            if not pykeyleds.keyleds_get_device_name(self._device, self._target_id, &name):
+            with nogil:
+                self._acquire()
+                ok = pykeyleds.keyleds_get_device_name(self._device, self._target_id, &name)
+                self._release()
+            if not ok:
                 raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
             self._name = name.decode('UTF-8')
             free(name)
@@ -209,11 +304,16 @@ cdef class Device:
     def type(self):
         cdef pykeyleds.keyleds_device_type_t dev_type
         cdef const char * type_name
+        cdef bint ok
         if self._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
         if self._type is None:
-            if not pykeyleds.keyleds_get_device_type(self._device, self._target_id, &dev_type):
+            with nogil:
+                self._acquire()
+                ok = pykeyleds.keyleds_get_device_type(self._device, self._target_id, &dev_type)
+                self._release()
+            if not ok:
                 raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
 
             type_name = pykeyleds.keyleds_lookup_string(pykeyleds.keyleds_device_types,
@@ -224,11 +324,16 @@ cdef class Device:
     @property
     def version(self):
         cdef pykeyleds.keyleds_device_version * version
+        cdef bint ok
         if self._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
         if self._version is None:
-            if not pykeyleds.keyleds_get_device_version(self._device, self._target_id, &version):
+            with nogil:
+                self._acquire()
+                ok = pykeyleds.keyleds_get_device_version(self._device, self._target_id, &version)
+                self._release()
+            if not ok:
                 raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
 
             try:
@@ -257,11 +362,16 @@ cdef class Device:
 
     @property
     def layout(self):
+        cdef pykeyleds.keyleds_keyboard_layout_t layout
         if self._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
         if self._layout is None:
-            self._layout = pykeyleds.keyleds_keyboard_layout(self._device, self._target_id)
+            with nogil:
+                self._acquire()
+                layout = pykeyleds.keyleds_keyboard_layout(self._device, self._target_id)
+                self._release()
+            self._layout = layout
         if self._layout == pykeyleds.KEYLEDS_KEYBOARD_LAYOUT_INVALID:
             raise AttributeError('Device does not define a layout')
         return self._layout
@@ -269,11 +379,16 @@ cdef class Device:
     @property
     def report_rates(self):
         cdef unsigned * rates
+        cdef bint ok
         if self._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
         if self._supported_rates is None:
-            if not pykeyleds.keyleds_get_reportrates(self._device, self._target_id, &rates):
+            with nogil:
+                self._acquire()
+                ok = pykeyleds.keyleds_get_reportrates(self._device, self._target_id, &rates)
+                self._release()
+            if not ok:
                 raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
             try:
                 idx = 0
@@ -288,28 +403,43 @@ cdef class Device:
 
     def get_report_rate(self):
         cdef unsigned rate
+        cdef bint ok
         if self._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
-        if not pykeyleds.keyleds_get_reportrate(self._device, self._target_id, &rate):
+        with nogil:
+            self._acquire()
+            ok = pykeyleds.keyleds_get_reportrate(self._device, self._target_id, &rate)
+            self._release()
+        if not ok:
             raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
         return rate
 
     def set_report_rate(self, unsigned rate):
+        cdef bint ok
         if self._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
-        if not pykeyleds.keyleds_set_reportrate(self._device, self._target_id, rate):
+        with nogil:
+            self._acquire()
+            ok = pykeyleds.keyleds_set_reportrate(self._device, self._target_id, rate)
+            self._release()
+        if not ok:
             raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
 
     @property
     def leds(self):
         cdef pykeyleds.keyleds_keyblocks_info * info
+        cdef bint ok
         if self._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
         if self._leds is None:
-            if not pykeyleds.keyleds_get_block_info(self._device, self._target_id, &info):
+            with nogil:
+                self._acquire()
+                ok = pykeyleds.keyleds_get_block_info(self._device, self._target_id, &info)
+                self._release()
+            if not ok:
                 raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
             try:
                 blocks = {}
@@ -327,20 +457,177 @@ cdef class Device:
         return self._leds
 
     def commit_leds(self):
+        cdef bint ok
+        if self._device is NULL:
+            raise ValueError('I/O operation on closed device.')
+
+        with nogil:
+            self._acquire()
+            ok = pykeyleds.keyleds_commit_leds(self._device, self._target_id)
+            self._release()
+        if not ok:
+            raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
+
+    def set_frame(self, block, buffer):
+        # Sends a whole key buffer to block, given by name or KeyBlock, and commits it
+        cdef pykeyleds.keyleds_block_id_t block_id
+        cdef Py_buffer view
+        cdef bint ok
         if self._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
-        if not pykeyleds.keyleds_commit_leds(self._device, self._target_id):
+        block_id = (block if isinstance(block, KeyBlock) else self.leds[block]).block_id
+        _get_key_buffer(buffer, &view, 0)
+        try:
+            with nogil:
+                self._acquire()
+                ok = (pykeyleds.keyleds_set_leds(self._device, self._target_id, block_id,
+                                                 <pykeyleds.keyleds_key_color *>view.buf,
+                                                 view.len // sizeof(pykeyleds.keyleds_key_color)) and
+                      pykeyleds.keyleds_commit_leds(self._device, self._target_id))
+                self._release()
+        finally:
+            PyBuffer_Release(&view)
+        if not ok:
             raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
 
+    def set_frame_async(self, block, buffer, loop=None):
+        # Awaitable set_frame, run in loop's default executor. Frames for several
+        # devices then go out concurrently, as I/O releases the GIL.
+        if loop is None:
+            loop = asyncio.get_event_loop()
+        return loop.run_in_executor(None, self.set_frame, block, buffer)
+
+    # Asynchronous requests
+    #
+    # Requests are written right away, their callback runs when their response
+    # is read, with either response data as bytes or an IOError. That happens
+    # in process_events, or in whichever call next waits for the device. The
+    # callback must not use the device.
+
+    def submit(self, unsigned feature_id, unsigned function, data=b'', callback=None):
+        cdef const unsigned char[::1] payload = data
+        cdef pykeyleds.keyleds_request_t handle
+        if self._device is NULL:
+            raise ValueError('I/O operation on closed device.')
+
+        # Callback is registered before releasing the device, so another thread
+        # cannot read the response first and find no callback for it.
+        with nogil:
+            self._acquire()
+        try:
+            with nogil:
+                handle = pykeyleds.keyleds_submit(self._device, self._target_id, feature_id, function,
+                                                  payload.shape[0],
+                                                  <const uint8_t *>&payload[0] if payload.shape[0] > 0 else NULL,
+                                                  _request_complete, <void *>self)
+            if handle == 0:
+                raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
+            self._requests[handle] = callback
+        finally:
+            self._release()
+        return handle
+
+    def process_events(self):
+        # Reads available responses without blocking, returns how many completed.
+        # Requests unanswered within the device timeout complete with an IOError.
+        return self._process_events(True)
+
+    cdef _process_events(self, bint wait):
+        # Without wait, returns None if another thread is using the device
+        cdef int completed
+        cdef bint busy = False, closed = False
+        if self._device is NULL:
+            raise ValueError('I/O operation on closed device.')
+
+        with nogil:
+            if PyThread_acquire_lock(self._lock, WAIT_LOCK if wait else NOWAIT_LOCK):
+                if self._device is not NULL:
+                    completed = pykeyleds.keyleds_process_events(self._device)
+                else:
+                    closed = True
+                self._release()
+            else:
+                busy = True
+        if busy:
+            return None
+        if closed:
+            raise ValueError('I/O operation on closed device.')
+        if completed < 0:               # pending requests got the error through callbacks
+            raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
+        return completed
+
+    @property
+    def pending_requests(self):
+        return len(self._requests)
+
+    def call_async(self, unsigned feature_id, unsigned function, data=b'', loop=None):
+        # Submits a request, returning a future of its response data. The
+        # device fd is watched by loop while requests are pending, and a timer
+        # fails those whose response does not come within the device timeout.
+        if loop is None:
+            loop = asyncio.get_event_loop()
+        future = loop.create_future()
+        self.submit(feature_id, function, data,
+                    lambda result: loop.call_soon_threadsafe(_resolve_future, future, result))
+        if self._loop is not loop:
+            self._unwatch()
+            loop.add_reader(self.fd, self._on_readable)
+            self._loop = loop
+        self._arm_timer()
+        return future
+
+    def _on_readable(self):
+        # Runs on the loop thread, which must not block on a device another
+        # thread is using: fd stays readable, so this simply runs again.
+        try:
+            self._process_events(False)
+        except IOError:
+            pass                        # pending requests got the error
+        if not self._requests:
+            self._unwatch()             # fd stays readable with unrelated input
+
+    def _on_timer(self):
+        self._timer = None
+        self._on_readable()
+        self._arm_timer()
+
+    cdef _arm_timer(self):
+        cdef unsigned timeout
+        if (self._timer is not None or self._loop is None or not self._requests or
+                self._device is NULL):
+            return
+        timeout = pykeyleds.keyleds_get_timeout(self._device)
+        if timeout > 0:
+            self._timer = self._loop.call_later(timeout / 1000000.0, self._on_timer)
+
+    cdef _unwatch(self):
+        if self._timer is not None:
+            self._timer.cancel()
+            self._timer = None
+        if self._loop is not None:
+            self._loop.remove_reader(self.fd)
+            self._loop = None
+
+    cdef _fail_requests(self, error):
+        requests, self._requests = self._requests, {}
+        for callback in requests.values():
+            if callback is not None:
+                callback(error)
+
     def set_gamemode_keys(self, keys):
         cdef uint8_t * ids
         cdef size_t count = len(keys)
+        cdef bint ok
         if self._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
         if self._gamemode_max == 0:
-            if not pykeyleds.keyleds_gamemode_max(self._device, self._target_id, &self._gamemode_max):
+            with nogil:
+                self._acquire()
+                ok = pykeyleds.keyleds_gamemode_max(self._device, self._target_id, &self._gamemode_max)
+                self._release()
+            if not ok:
                 raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
         if count > self._gamemode_max:
             raise ValueError('Too many keys for gamemode, maximum is %s' % self._gamemode_max)
@@ -350,8 +637,12 @@ cdef class Device:
             for idx, key_code in enumerate(keys):
                 ids[idx] = key_code
 
-            if (not pykeyleds.keyleds_gamemode_reset(self._device, self._target_id) or
-                not pykeyleds.keyleds_gamemode_set(self._device, self._target_id, ids, count)):
+            with nogil:
+                self._acquire()
+                ok = (pykeyleds.keyleds_gamemode_reset(self._device, self._target_id) and
+                      pykeyleds.keyleds_gamemode_set(self._device, self._target_id, ids, count))
+                self._release()
+            if not ok:
                 raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
         finally:
             free(ids)
@@ -385,14 +676,19 @@ cdef class KeyBlock:
     def get_all(self):
         cdef keyleds_key_color * keys
         cdef int start, stop, step, count
+        cdef bint ok
 
         if self._device._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
         keys = <keyleds_key_color*>malloc(sizeof(keyleds_key_color) * self.nb_keys)
         try:
-            if not pykeyleds.keyleds_get_leds(self._device._device, self._device._target_id,
-                                              self.block_id, keys, 0, self.nb_keys):
+            with nogil:
+                self._device._acquire()
+                ok = pykeyleds.keyleds_get_leds(self._device._device, self._device._target_id,
+                                                self.block_id, keys, 0, self.nb_keys)
+                self._device._release()
+            if not ok:
                 raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
 
             result = PyTuple_New(self.nb_keys)
@@ -410,6 +706,7 @@ cdef class KeyBlock:
     def set_keys(self, colors):
         cdef keyleds_key_color * keys
         cdef int start, stop, step, count
+        cdef bint ok
 
         if self._device._device is NULL:
             raise ValueError('I/O operation on closed device.')
@@ -423,16 +720,77 @@ cdef class KeyBlock:
                 keys[idx].red = colors[idx].color.red
                 keys[idx].green = colors[idx].color.green
                 keys[idx].blue = colors[idx].color.blue
-            if not pykeyleds.keyleds_set_leds(self._device._device, self._device._target_id,
-                                              self.block_id, keys, count):
+            with nogil:
+                self._device._acquire()
+                ok = pykeyleds.keyleds_set_leds(self._device._device, self._device._target_id,
+                                                self.block_id, keys, count)
+                self._device._release()
+            if not ok:
                 raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
         finally:
             free(keys)
 
     def set_all_keys(self, Color color):
+        cdef bint ok
+        if self._device._device is NULL:
+            raise ValueError('I/O operation on closed device.')
+
+        with nogil:
+            self._device._acquire()
+            ok = pykeyleds.keyleds_set_led_block(self._device._device, self._device._target_id,
+                                                 self.block_id,                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                        color.red, color.green, color.blue)
+            self._device._release()
+        if not ok:
+            raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
+
+    def get_buffer(self, buffer=None):
+        # Reads key colors into buffer, or a new (nb_keys, 4) memoryview if None
+        cdef Py_buffer view
+        cdef unsigned count
+        cdef bint ok
+
         if self._device._device is NULL:
             raise ValueError('I/O operation on closed device.')
 
-        if not pykeyleds.keyleds_set_led_block(self._device._device, self._device._target_id,
-                                               self.block_id,                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                        color.red, color.green, color.blue):
+        result = buffer
+        if buffer is None:
+            buffer = bytearray(self.nb_keys * sizeof(pykeyleds.keyleds_key_color))
+            result = memoryview(buffer).cast('B', (self.nb_keys, sizeof(pykeyleds.keyleds_key_color)))
+
+        _get_key_buffer(buffer, &view, PyBUF_WRITABLE)
+        try:
+            count = view.len // sizeof(pykeyleds.keyleds_key_color)
+            if count > self.nb_keys:
+                raise ValueError('Key buffer larger than block (%d keys)' % self.nb_keys)
+            with nogil:
+                self._device._acquire()
+                ok = pykeyleds.keyleds_get_leds(self._device._device, self._device._target_id,
+                                                self.block_id, <pykeyleds.keyleds_key_color *>view.buf,
+                                                0, count)
+                self._device._release()
+        finally:
+            PyBuffer_Release(&view)
+        if not ok:
+            raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))
+        return result
+
+    def set_buffer(self, buffer):
+        # Sets key colors from buffer, without converting it
+        cdef Py_buffer view
+        cdef bint ok
+
+        if self._device._device is NULL:
+            raise ValueError('I/O operation on closed device.')
+
+        _get_key_buffer(buffer, &view, 0)
+        try:
+            with nogil:
+                self._device._acquire()
+                ok = pykeyleds.keyleds_set_leds(self._device._device, self._device._target_id,
+                                                self.block_id, <pykeyleds.keyleds_key_color *>view.buf,
+                                                view.len // sizeof(pykeyleds.keyleds_key_color))
+                self._device._release()
+        finally:
+            PyBuffer_Release(&view)
+        if not ok:
             raise IOError(pykeyleds.keyleds_get_error_str().decode('UTF-8'))